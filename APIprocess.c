@@ -4,12 +4,153 @@
 #include "TaHomaCtl.h"
 
 #include <assert.h>
+#include <fnmatch.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <json-c/json.h>
 
-#define OBJPATH(...) (const char*[]){ __VA_ARGS__ }
+	/*
+	 * JSON helpers
+	 */
+
+enum JSONBackend json_backend = JSONB_JSONC;
+static unsigned int documents = 0;	/* Documents in use */
+
+bool setJSONBackend(const char *name){
+	enum JSONBackend b;
+
+	if(!strcmp(name, "json-c"))
+		b = JSONB_JSONC;
+	else if(!strcmp(name, "index"))
+		b = JSONB_INDEX;
+	else
+		return false;
+
+	if(documents)	/* Would be released by the wrong backend */
+		return false;
+
+	json_backend = b;
+	return true;
+}
+
+const char *JSONBackendName(void){
+	return json_backend == JSONB_INDEX ? "index" : "json-c";
+}
+
+struct json_object *parseJSON(const char *json){
+	struct timespec beg, end;
+	struct json_object *res;
+	size_t len = strlen(json);
+
+	if(debug)
+		clock_gettime(CLOCK_MONOTONIC, &beg);
+
+	if(json_backend == JSONB_INDEX)
+		res = jindexParse(json, len);
+	else
+		res = json_tokener_parse(json);
+
+	if(debug){
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double d = (end.tv_sec - beg.tv_sec) + (end.tv_nsec - beg.tv_nsec) / 1e9;
+
+		printf("*D* JSON parsed by %s%s%s : %lu bytes in %.3fms (%.1f MB/s)\n",
+			JSONBackendName(),
+			json_backend == JSONB_INDEX ? "/" : "", json_backend == JSONB_INDEX ? json_simd : "",
+			len, d * 1e3, d > 0 ? len / d / 1e6 : 0.0
+		);
+	}
+
+	if(res)
+		++documents;
+	else if(debug)
+		fputs("*E* Invalid JSON\n", stderr);
+
+	return res;
+}
+
+void releaseJSON(struct json_object *root){
+	if(!root)
+		return;
+
+	if(json_backend == JSONB_INDEX)
+		jindexRelease(root);
+	else
+		json_object_put(root);
+	--documents;
+}
+
+bool isArrayObj(struct json_object *obj){
+	if(!obj)
+		return false;
 
-static struct json_object *getObj(struct json_object *parent, const char *path[]){
+	if(json_backend == JSONB_INDEX)
+		return jindexType(obj) == JSON_ARRAY;
+	return json_object_is_type(obj, json_type_array);
+}
+
+size_t arrayLengthObj(struct json_object *obj){
+	if(json_backend == JSONB_INDEX)
+		return jindexLength(obj);
+	return json_object_array_length(obj);
+}
+
+struct json_object *arrayGetObj(struct json_object *obj, size_t idx){
+	if(json_backend == JSONB_INDEX)
+		return jindexIdx(obj, idx);
+	return json_object_array_get_idx(obj, idx);
+}
+
+enum JSONType typeObj(struct json_object *obj){
+	/* Notez-bien : json-c represents null by a NULL object */
+	if(!obj)
+		return JSON_NULL;
+
+	if(json_backend == JSONB_INDEX)
+		return jindexType(obj);
+
+	switch(json_object_get_type(obj)){
+	case json_type_boolean:
+		return json_object_get_boolean(obj) ? JSON_TRUE : JSON_FALSE;
+	case json_type_double:
+	case json_type_int:
+		return JSON_NUMBER;
+	case json_type_string:
+		return JSON_STRING;
+	case json_type_array:
+		return JSON_ARRAY;
+	case json_type_object:
+		return JSON_OBJECT;
+	default:
+		return JSON_NULL;
+	}
+}
+
+bool memberObj(struct json_object *obj, const char *key, struct json_object **val){
+	if(typeObj(obj) != JSON_OBJECT)
+		return false;
+
+	if(json_backend == JSONB_INDEX)
+		return (*val = jindexGet(obj, key)) != NULL;
+	return json_object_object_get_ex(obj, key, val);
+}
+
+bool forEachMember(struct json_object *obj, bool (*func)(const char *, struct json_object *, void *), void *data){
+	if(typeObj(obj) != JSON_OBJECT)
+		return true;
+
+	if(json_backend == JSONB_INDEX)
+		return jindexForEach(obj, func, data);
+
+	json_object_object_foreach(obj, key, val){
+		if(!func(key, val, data))
+			return false;
+	}
+	return true;
+}
+
+struct json_object *getObj(struct json_object *parent, const char *path[]){
 	struct json_object *obj = parent;
 
 	for(int i=0; path[i]; ++i){
@@ -23,58 +164,79 @@ static struct json_object *getObj(struct json_object *parent, const char *path[]
 				fprintf(stderr, "*E* Broken path at %dth\n", i);
 			return NULL;
 		}
-		obj = json_object_object_get(obj, path[i]);
+		if(json_backend == JSONB_INDEX)
+			obj = jindexGet(obj, path[i]);
+		else
+			obj = json_object_object_get(obj, path[i]);
 	}
 
 	return obj;
 }
 
-static const char *getObjString(struct json_object *parent, const char *path[]){
+const char *objString(struct json_object *obj){
+	/* NULL if not a string */
+	if(json_backend == JSONB_INDEX)
+		return jindexString(obj);
+	return json_object_is_type(obj, json_type_string) ? json_object_get_string(obj) : NULL;
+}
+
+double objNumber(struct json_object *obj){
+	if(json_backend == JSONB_INDEX)
+		return jindexNumber(obj);
+	return json_object_get_double(obj);
+}
+
+static bool objBoolean(struct json_object *obj){
+	if(json_backend == JSONB_INDEX)
+		return jindexType(obj) == JSON_TRUE;
+	return json_object_get_boolean(obj);
+}
+
+const char *getObjString(struct json_object *parent, const char *path[]){
 	struct json_object *obj = getObj(parent, path);
 	if(!obj)
 		return NULL;
 
-	if(json_object_is_type(obj, json_type_string))
-		return json_object_get_string(obj);
-	else if(debug)
+	const char *s = objString(obj);
+	if(!s && debug)
 		fputs("*E* Not a string\n", stderr);
 
-	return NULL;
+	return s;
 }
 
-static int getObjInt(struct json_object *parent, const char *path[]){
+int getObjInt(struct json_object *parent, const char *path[]){
 	struct json_object *obj = getObj(parent, path);
 	if(!obj)
 		return 0;
 
-	if(json_object_is_type(obj, json_type_int))
-		return json_object_get_int(obj);
+	if(json_backend == JSONB_INDEX ? jindexIsInteger(obj) : json_object_is_type(obj, json_type_int))
+		return objNumber(obj);
 	else if(debug)
 		fputs("*E* Not an integer\n", stderr);
 
 	return 0;
 }
 
-static double getObjNumber(struct json_object *parent, const char *path[]){
+double getObjNumber(struct json_object *parent, const char *path[]){
 	struct json_object *obj = getObj(parent, path);
 	if(!obj)
 		return 0;
 
-	if(json_object_is_type(obj, json_type_double))
-		return json_object_get_double(obj);
+	if(json_backend == JSONB_INDEX ? (jindexType(obj) == JSON_NUMBER && !jindexIsInteger(obj)) : json_object_is_type(obj, json_type_double))
+		return objNumber(obj);
 	else if(debug)
 		fputs("*E* Not a double\n", stderr);
 
 	return 0;
 }
 
-static bool getObjBool(struct json_object *parent, const char *path[]){
+bool getObjBool(struct json_object *parent, const char *path[]){
 	struct json_object *obj = getObj(parent, path);
 	if(!obj)
 		return false;
 
-	if(json_object_is_type(obj, json_type_boolean))
-		return json_object_get_boolean(obj);
+	if(json_backend == JSONB_INDEX ? (jindexType(obj) == JSON_TRUE || jindexType(obj) == JSON_FALSE) : json_object_is_type(obj, json_type_boolean))
+		return objBoolean(obj);
 	else if(debug)
 		fputs("*E* Not a boolean\n", stderr);
 
@@ -88,28 +250,148 @@ static const char *affString(const char *v){
 		return "Not found";
 }
 
+	/*
+	 * States' value
+	 */
+
+bool decodeStateValue(struct json_object *obj, struct StateValue *v){
+	/* Decode a state object ({"type":..., "value":...})
+	 * Notez-bien : strings are pointing inside obj
+	 * <- false if the type is not valid
+	 */
+	v->type = getObjInt(obj, OBJPATH( "type", NULL ));
+
+	struct json_object *val = getObj(obj, OBJPATH( "value", NULL ));
+	switch(v->type){
+	case 1:	/* Integer */
+	case 2:	/* Float */
+		v->number = val ? objNumber(val) : 0;
+		break;
+	case 3:	/* String */
+		v->string = val ? objString(val) : NULL;
+		break;
+	case 6:	/* Boolean */
+		v->boolean = val ? objBoolean(val) : false;
+		break;
+	case 10:	/* Array */
+	case 11:	/* Object */
+		v->string = NULL;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+void printStateValue(const struct StateValue *v){
+	switch(v->type){
+	case 1:	/* Number */
+	case 2:
+		printf("%lf\n", v->number);
+		break;
+	case 3:	/* String */
+		printf("\"%s\"\n", affString(v->string));
+		break;
+	case 6:	/* Boolean */
+		printf("%s\n", v->boolean ? "true":"false");
+		break;
+	case 10:
+		puts("[Array]");
+		break;
+	case 11:
+		puts("{Object}");
+		break;
+	default:
+		printf("Unknown type (%d)\n", v->type);
+	}
+}
+
 
 	/*
 	 * Devices
 	 */
 
 struct Device *devices_list = NULL;
+struct Arena devices_arena;	/* Devices' data */
 
-static void freeDevice(struct Device *dev){
-	free((void *)dev->label);
-	free((void *)dev->url);
+static void freeStateValue(struct StateValue *v){
+	if(v->type == 3)
+		free((void *)v->string);
+	v->type = 0;
 }
 
-static void freeDeviceList(void){
-	for(struct Device *dev = devices_list; dev; ){
-		freeDevice(dev);
-
-		struct Device *ans = dev;
-		dev = dev->next;
-		free(ans);
-	}
+void freeDeviceList(void){
+		/* Only states' values are living outside the arena */
+	for(struct Device *dev = devices_list; dev; dev = dev->next)
+		for(unsigned int i = 0; i < dev->nstates; ++i)
+			freeStateValue(&dev->states[i].value);
 
 	devices_list = NULL;
+	arenaReset(&devices_arena);
+	dropDevicesIndex();
+	releaseDevicesCache();
+}
+
+void devicesExchange(struct Gateway *gw){
+	SWAP(devices_list, gw->devices_list);
+	SWAP(devices_arena, gw->devices_arena);
+}
+
+void reportMemory(void){
+	struct rusage ru;
+
+	printf("*I* Devices' data : %lu bytes used (%lu allocated), %lu distinct names\n",
+		devices_arena.used, devices_arena.allocated, devices_arena.icount);
+
+	if(!getrusage(RUSAGE_SELF, &ru))
+		printf("*I* Peak RSS : %ld kB\n", ru.ru_maxrss);
+}
+
+	/* Commands and states are stored in arrays sorted by name.
+	 * Notez-bien : in both structures, the name is the first field.
+	 */
+int cmpCommand(const void *a, const void *b){
+	return strcmp(((const struct Command *)a)->command, ((const struct Command *)b)->command);
+}
+
+int cmpState(const void *a, const void *b){
+	return strcmp(((const struct State *)a)->state, ((const struct State *)b)->state);
+}
+
+size_t commandsFrom(struct Device *dev, const char *prefix, size_t len){
+	return namesFrom(dev->commands, dev->ncommands, sizeof(struct Command), prefix, len);
+}
+
+size_t statesFrom(struct Device *dev, const char *prefix, size_t len){
+	return namesFrom(dev->states, dev->nstates, sizeof(struct State), prefix, len);
+}
+
+struct Command *deviceCommand(struct Device *dev, struct substring *name){
+	size_t i = commandsFrom(dev, name->s, name->len);
+
+	if(i < dev->ncommands && !substringcmp(name, dev->commands[i].command))
+		return dev->commands + i;
+
+	return NULL;
+}
+
+struct State *deviceState(struct Device *dev, struct substring *name){
+	size_t i = statesFrom(dev, name->s, name->len);
+
+	if(i < dev->nstates && !substringcmp(name, dev->states[i].state))
+		return dev->states + i;
+
+	return NULL;
+}
+
+void setDeviceURL(struct Device *dev, const char *url){
+	dev->url = arenaStrdup(&devices_arena, url);
+
+	char *enc = curl_easy_escape(curl, url, 0);
+	assert(enc);
+	dev->escurl = arenaStrdup(&devices_arena, enc);
+	curl_free(enc);
 }
 
 static void addDevice(struct json_object *obj){
@@ -121,122 +403,109 @@ static void addDevice(struct json_object *obj){
 		return;
 #endif
 
-	struct Device *dev = malloc(sizeof(struct Device));
-	assert(dev);
+		/* Notez-bien : everything is allocated in devices_arena,
+		 * so nothing has to be freed in case of error.
+		 */
+	struct Device *dev = arenaAlloc(&devices_arena, sizeof(struct Device));
 
 		/* feed with the label */
 	t = getObjString(obj, OBJPATH( "label", NULL ));
 	assert(t);
 
-	assert( (dev->label = strdup(t)) );
-	for(char *c = (char *)dev->label; *c; ++c)
+	char *label = arenaStrdup(&devices_arena, t);
+	for(char *c = label; *c; ++c)
 		if(*c == ' ')
 			*c = '_';
+	dev->label = label;
 
 		/* and the URL */
 	assert( (t = getObjString(obj, OBJPATH( "deviceURL", NULL ) )) );
-	assert( (dev->url = strdup(t)) );
+	setDeviceURL(dev, t);
 
 		/* store known commands */
 	dev->commands = NULL;
+	dev->ncommands = 0;
+	dev->states = NULL;
+	dev->nstates = 0;
 
 	struct json_object *lstc = getObj(obj, OBJPATH( "definition", "commands", NULL ));
 	if(!lstc){
 		fprintf(stderr, "*E* [%s] commands field not found.\n", dev->label);
-		freeDevice(dev);
-		free(dev);
 		return;
 	}
 
-	if(!json_object_is_type(lstc, json_type_array)){
+	if(!isArrayObj(lstc)){
 		fprintf(stderr, "*E* [%s] commands field not an array.\n", dev->label);
-		freeDevice(dev);
-		free(dev);
 		return;
 	}
 
-	size_t nbr = json_object_array_length(lstc);
+	size_t nbr = arrayLengthObj(lstc);
 	if(debug)
 		printf("*I* %ld command(s)\n", nbr);
 
+	struct Command *cmds = arenaAlloc(&devices_arena, nbr * sizeof(struct Command));
 	for(size_t idx=0; idx < nbr; ++idx){
-		struct json_object *cmd = json_object_array_get_idx(lstc, idx);
+		struct json_object *cmd = arrayGetObj(lstc, idx);
 		if(!cmd){
 			fprintf(stderr, "*E* [%s / %ld] Command not found.\n", dev->label, idx);
-			freeDevice(dev);
-			free(dev);
 			return;
 		}
 
 		assert( (t = getObjString(cmd, OBJPATH( "commandName", NULL ) )) );
 
-		struct Command *ncmd = malloc(sizeof(struct Command));
-		assert(ncmd);
-
-		assert( (ncmd->command = strdup(t)) );
-		ncmd->nparams = getObjInt(cmd, OBJPATH( "nparams", NULL ) );
-
-		ncmd->next = dev->commands;
-		dev->commands = ncmd;
+		cmds[idx].command = arenaIntern(&devices_arena, t);
+		cmds[idx].nparams = getObjInt(cmd, OBJPATH( "nparams", NULL ) );
 	}
+	qsort(cmds, nbr, sizeof(struct Command), cmpCommand);
+	dev->commands = cmds;
+	dev->ncommands = nbr;
 
 		/* store known states */
-	dev->states = NULL;
 	lstc = getObj(obj, OBJPATH( "definition", "states", NULL ));
 	if(!lstc){
 		fprintf(stderr, "*E* [%s] states field not found.\n", dev->label);
-		for(struct Command *cmd = dev->commands; cmd; ){
-			free((void *)cmd->command);
-			struct Command *old = cmd;
-			cmd = cmd->next;
-			free(old);
-		}
-		freeDevice(dev);
-		free(dev);
 		return;
 	}
 
-	if(!json_object_is_type(lstc, json_type_array)){
+	if(!isArrayObj(lstc)){
 		fprintf(stderr, "*E* [%s] states field not an array.\n", dev->label);
-		for(struct Command *cmd = dev->commands; cmd; ){
-			free((void *)cmd->command);
-			struct Command *old = cmd;
-			cmd = cmd->next;
-			free(old);
-		}
-		freeDevice(dev);
-		free(dev);
 		return;
 	}
 
-	nbr = json_object_array_length(lstc);
+	nbr = arrayLengthObj(lstc);
 	if(debug)
 		printf("*I* %ld state(s)\n", nbr);
 
+	struct State *sts = arenaAlloc(&devices_arena, nbr * sizeof(struct State));
 	for(size_t idx=0; idx < nbr; ++idx){
-		struct json_object *state = json_object_array_get_idx(lstc, idx);
+		struct json_object *state = arrayGetObj(lstc, idx);
 		if(!state){
 			fprintf(stderr, "*E* [%s / %ld] State not found.\n", dev->label, idx);
-			for(struct Command *cmd = dev->commands; cmd; ){
-				free((void *)cmd->command);
-				struct Command *old = cmd;
-				cmd = cmd->next;
-				free(old);
-			}
-			freeDevice(dev);
-			free(dev);
 			return;
 		}
 
 		assert( (t = getObjString(state, OBJPATH( "name", NULL ) )) );
 
-		struct State *nstate = malloc(sizeof(struct State));
-		assert(nstate);
+		sts[idx].state = arenaIntern(&devices_arena, t);
+		sts[idx].value.type = 0;
+		sts[idx].updated = 0;
+	}
+	qsort(sts, nbr, sizeof(struct State), cmpState);
+	dev->states = sts;
+	dev->nstates = nbr;
+
+		/* Seed states' values */
+	lstc = getObj(obj, OBJPATH( "states", NULL ));
+	if(isArrayObj(lstc)){
+		nbr = arrayLengthObj(lstc);
 
-		assert( (nstate->state = strdup(t)) );
+		for(size_t idx=0; idx < nbr; ++idx){
+			struct json_object *state = arrayGetObj(lstc, idx);
+			struct StateValue v;
 
-		nstate->next = dev->states;
-		dev->states = nstate;
+			if(state && (t = getObjString(state, OBJPATH( "name", NULL ))) && decodeStateValue(state, &v))
+				updateState(dev, t, &v);
+		}
 	}
 
 		/* Add the new device in the list */
@@ -244,13 +513,89 @@ static void addDevice(struct json_object *obj){
 	devices_list = dev;
 }
 
-struct Device *findDevice(struct substring *name){
-	for(struct Device *r = devices_list; r; r = r->next){
-		if(!substringcmp(name, r->label))
-			return r;
+	/*
+	 * States' mirror
+	 *
+	 * Devices are storing the last known value of their states,
+	 * seeded by scan_Devices, refreshed by States' queries and by
+	 * gateway's events.
+	 */
+
+unsigned int states_ttl = 0;	/* How long a value is considered as fresh (seconds) */
+
+void updateState(struct Device *dev, const char *name, const struct StateValue *v){
+	struct substring n = { name, strlen(name) };
+	struct State *st = deviceState(dev, &n);
+
+	if(!st){	/* Not part of the definition : add it at its place */
+		size_t i = statesFrom(dev, name, n.len);
+		struct State *sts = arenaAlloc(&devices_arena, (dev->nstates + 1) * sizeof(struct State));
+
+		memcpy(sts, dev->states, i * sizeof(struct State));
+		memcpy(sts + i + 1, dev->states + i, (dev->nstates - i) * sizeof(struct State));
+		dev->states = sts;
+		++dev->nstates;
+
+		st = sts + i;
+		st->state = arenaIntern(&devices_arena, name);
+		st->value.type = 0;
 	}
 
-	return NULL;
+	freeStateValue(&st->value);
+	st->value = *v;
+	if((v->type == 3) && v->string)	/* Own a copy */
+		assert( (st->value.string = strdup(v->string)) );
+
+	st->updated = nowms();
+}
+
+static bool stateFresh(struct State *st){
+	if(!st->updated)	/* Never seen */
+		return false;
+
+	if(states_ttl && nowms() - st->updated < states_ttl * 1000UL)
+		return true;
+
+	return events_cover(st->updated);
+}
+
+static bool mirrorFresh(struct Device *dev, struct substring *name){
+	/* Can the query be answered from the mirror ?
+	 * <- false if some values are missing or outdated
+	 */
+	bool found = false;
+
+	if(name->s){	/* A specific state */
+		struct State *st = deviceState(dev, name);
+		return st && stateFresh(st);
+	}
+
+	for(struct State *st = dev->states; st < dev->states + dev->nstates; ++st)
+		if(st->updated){
+			if(!stateFresh(st))
+				return false;
+			found = true;
+		}
+
+	return found;
+}
+
+static void statesFromMirror(struct Device *dev, struct substring *name, const char *tag){
+	/* Display states from the mirror.
+	 * If not NULL, tag prefixes a specific state's value.
+	 */
+	if(name->s){
+		if(tag)
+			printf("%s : ", tag);
+		printStateValue(&deviceState(dev, name)->value);
+		return;
+	}
+
+	for(struct State *st = dev->states; st < dev->states + dev->nstates; ++st)
+		if(st->updated){
+			printf("\t%s : ", st->state);
+			printStateValue(&st->value);
+		}
 }
 
 	/*
@@ -265,16 +610,23 @@ void func_Tgw(const char *arg){
 
 	struct ResponseBuffer buff = {NULL};
 
-	callAPI("setup/gateways", &buff);
+	long http_code = callAPI("setup/gateways", &buff);
 	if(debug)
 		printf("*D* Resp: '%s'\n", buff.memory ? buff.memory : "NULL data");
 
+	if(http_code != 200){
+		if(http_code)
+			fprintf(stderr, "*E* Gateway failed (HTTP %ld)\n", http_code);
+		freeResponse(&buff);
+		return;
+	}
+
 		/* Display result */
 	if(buff.memory){
-		struct json_object *parsed_json = json_tokener_parse(buff.memory);
+		struct json_object *parsed_json = parseJSON(buff.memory);
 
-		if(json_object_is_type(parsed_json, json_type_array)){	/* 1st object is an array */
-			struct json_object *first_object = json_object_array_get_idx(parsed_json, 0);
+		if(isArrayObj(parsed_json)){	/* 1st object is an array */
+			struct json_object *first_object = arrayGetObj(parsed_json, 0);
 			if(first_object){
 				printf("gatewayId : %s\n", affString(getObjString(first_object, OBJPATH( "gatewayId", NULL ) )));
 				printf("Connected : %s\n", affString(getObjString(first_object, OBJPATH( "connectivity", "status", NULL ) )));
@@ -285,7 +637,7 @@ void func_Tgw(const char *arg){
 		} else
 			fputs("*E* Returned object is not an array", stderr);
 
-		json_object_put(parsed_json);
+		releaseJSON(parsed_json);
 	}
 	
 	freeResponse(&buff);
@@ -324,23 +676,30 @@ void func_scandevs(const char *arg){
 	}
 
 	struct ResponseBuffer buff = {NULL};
-	callAPI("setup/devices", &buff);
+	long http_code = callAPI("setup/devices", &buff);
 	if(debug)
 		printf("*D* Resp: '%s'\n", buff.memory ? buff.memory : "NULL data");
 
+	if(http_code != 200){	/* The known devices are kept */
+		if(http_code)
+			fprintf(stderr, "*E* scan_Devices failed (HTTP %ld)\n", http_code);
+		freeResponse(&buff);
+		return;
+	}
+
 		/* Process result */
 	if(buff.memory){
-		struct json_object *res= json_tokener_parse(buff.memory);
+		struct json_object *res= parseJSON(buff.memory);
 
-		if(json_object_is_type(res, json_type_array)){	/* 1st object is an array */
+		if(isArrayObj(res)){	/* 1st object is an array */
 			freeDeviceList();	/* Remove old list */
 
-			size_t nbr = json_object_array_length(res);
+			size_t nbr = arrayLengthObj(res);
 			if(debug || verbose)
 				printf("*I* %ld devices\n", nbr);
 
 			for(size_t idx=0; idx < nbr; ++idx){
-				struct json_object *obj = json_object_array_get_idx(res, idx);
+				struct json_object *obj = arrayGetObj(res, idx);
 
 				if(obj){
 					if(debug || verbose)
@@ -349,151 +708,381 @@ void func_scandevs(const char *arg){
 				} else
 					fprintf(stderr, "*E* Can't get %ld\n", idx);
 			}
+
+			indexDevices();
+			saveDevicesCache();
+
+			if(debug || verbose)
+				reportMemory();
 		} else
 			fputs("*E* Returned object is not an array", stderr);
 
-		json_object_put(res);
+		releaseJSON(res);
 	}
 	freeResponse(&buff);
 }
 
-void func_States(const char *arg){
-	if(!arg){
-		fputs("*E* States is expecting a device's name.\n", stderr);
-		return;
+	/* States' streaming decoder
+	 * The response is an array of {"name":..., "type":..., "value":...}
+	 * which are processed as soon as received.
+	 */
+struct StatesDecoder {
+	struct Device *dev;
+	struct substring *name;	/* Wanted state (s is NULL for all) */
+	const char *tag;		/* Prefixes the wanted state's value (NULL if none) */
+	bool invalid;			/* Not an array */
+	size_t nbre;			/* Decoded states */
+
+		/* Current state */
+	char *sname;
+	int type;
+	enum JSONType vtype;	/* JSON type of its value */
+	char *value;			/* Scalar value */
+};
+
+static bool states_begin(struct JSONStream *js, bool array){
+	struct StatesDecoder *sd = js->data;
+
+	if(!js->depth && !array){
+		sd->invalid = true;
+		return false;
 	}
 
-	struct substring devname, name;
-	const char *next;
+	return true;
+}
 
-		/* Extract the device name */
-	extractTokenSub(&devname, arg, &next);
+static bool states_scalar(struct JSONStream *js, enum JSONType type, const char *val, size_t){
+	struct StatesDecoder *sd = js->data;
 
-		/* Extract the state name ... if any */
-	name.s = NULL;	/* Yet empty */
-	if(next && *next){	/* We got an name */
-		const char *unused;
-		extractTokenSub(&name, next, &unused);
+	if(!js->depth){
+		sd->invalid = true;
+		return false;
 	}
 
-	struct Device *dev = findDevice(&devname);
-	if(!dev){
-		fputs("*E* Device not found.\n", stderr);
-		return;
+	if(js->depth != 2)	/* Only state's fields are interesting */
+		return true;
+
+	if(!strcmp(js->key, "name"))
+		FreeAndSet(&sd->sname, val);
+	else if(!strcmp(js->key, "type"))
+		sd->type = atoi(val);
+	else if(!strcmp(js->key, "value")){
+		sd->vtype = type;
+		FreeAndSet(&sd->value, val);
 	}
 
-	char *enc = curl_easy_escape(curl, dev->url, 0);
-	assert(enc);
-	char url[ strlen("setup/devices//states") + strlen(enc) +1];
-	sprintf(url, "setup/devices/%s/states", enc);
-	curl_free(enc);
+	return true;
+}
 
-	if(debug)
-		printf("*D* Url: '%s'\n", url);
+static bool states_end(struct JSONStream *js, bool array){
+	/* <- false when the wanted state has been found */
+	struct StatesDecoder *sd = js->data;
+
+	if(js->depth != 1 || array)	/* Not the end of a state */
+		return true;
+
+	bool more = true;
+
+	if(sd->sname){
+		struct StateValue v;
+		bool valid = true;
+
+		v.type = sd->type;
+		switch(sd->type){
+		case 1:	/* Integer */
+		case 2:	/* Float */
+			v.number = sd->value ? strtod(sd->value, NULL) : 0;
+			break;
+		case 3:	/* String */
+			v.string = (sd->vtype == JSON_STRING) ? sd->value : NULL;
+			break;
+		case 6:	/* Boolean */
+			v.boolean = (sd->vtype == JSON_TRUE);
+			break;
+		case 10:	/* Array */
+		case 11:	/* Object */
+			v.string = NULL;
+			break;
+		default:
+			valid = false;
+		}
 
-	struct ResponseBuffer buff = {NULL};
-	callAPI(url, &buff);
-	if(debug)
-		printf("*D* Resp: '%s'\n", buff.memory ? buff.memory : "NULL data");
+		if(valid)
+			updateState(sd->dev, sd->sname, &v);
+		++sd->nbre;
+
+		if(!sd->name->s){
+			printf("\t%s : ", sd->sname);
+			printStateValue(&v);
+		} else if(!substringcmp(sd->name, sd->sname)){	/* Found, no need to read further */
+			if(sd->tag)
+				printf("%s : ", sd->tag);
+			printStateValue(&v);
+			more = false;
+		}
+	}
 
-		/* Process result */
-	if(buff.memory){
-		struct json_object *res= json_tokener_parse(buff.memory);
+		/* Ready for the next one */
+	clean(&sd->sname);
+	clean(&sd->value);
+	sd->type = 0;
+	sd->vtype = JSON_NULL;
 
-		if(json_object_is_type(res, json_type_array)){	/* 1st object is an array */
-			size_t nbr = json_object_array_length(res);
-			if(debug)
-				printf("*I* %ld states\n", nbr);
-			for(size_t idx=0; idx < nbr; ++idx){
-				struct json_object *obj = json_object_array_get_idx(res, idx);
-
-				const char *n = getObjString(obj, OBJPATH( "name", NULL ));
-				if(!n || (name.s && substringcmp(&name, n)))	/* Looking for a specific state */
-					continue;
-
-				if(!name.s)
-					printf("\t%s : ", affString(n));
-				int type = getObjInt(obj, OBJPATH( "type", NULL ));
-
-				switch(type){
-				case 1:	/* Number */
-					printf("%lf\n", getObjNumber(obj, OBJPATH( "value", NULL ) ));
-					break;
-				case 3:	/* String */
-					printf("\"%s\"\n", affString(getObjString(obj, OBJPATH( "value", NULL ) )));
-					break;
-				case 6:	/* Boolean */
-					printf("%s\n", getObjBool(obj, OBJPATH( "value", NULL ) ) ? "true":"false");
-				case 10:
-					puts("[Array]");
-					break;
-				case 11:
-					puts("{Object}");
-					break;
-				default:
-					printf("Unknown type (%d)\n", type);
-				}
+	return more;
+}
+
+static void initStatesDecoder(struct StatesDecoder *sd, struct JSONStream *js, struct Device *dev, struct substring *name, const char *tag){
+	memset(sd, 0, sizeof(struct StatesDecoder));
+	sd->dev = dev;
+	sd->name = name;
+	sd->tag = tag;
+
+	jsonInit(js, states_begin, states_end, states_scalar, sd);
+}
+
+static void statesDecoded(struct StatesDecoder *sd, struct JSONStream *js){
+	/* Report the decoding's result and release the decoder */
+	if(sd->invalid)
+		fputs("*E* Returned object is not an array\n", stderr);
+	else if(!jsonEnd(js))
+		fputs("*E* Invalid or truncated response\n", stderr);
+	else if(debug)
+		printf("*I* %lu states decoded%s\n", sd->nbre, js->stopped ? " (stopped once found)" : "");
+
+	free(sd->sname);
+	free(sd->value);
+}
+
+	/* States' sweep
+	 * Devices whose label matches a pattern are queried concurrently
+	 * (up to max_inflight requests). Results are displayed once all
+	 * are received, in labels' order.
+	 * With a "gateways/labels" pattern, devices of every matching gateway
+	 * are queried at once.
+	 */
+struct SweepSlot {
+	struct Device *dev;
+	struct Gateway *gateway;
+	bool mirror;		/* Answered from the mirror */
+
+		/* Result */
+	CURLcode res;
+	long http_code;
+	double elapsed;
+	char *resp;			/* Copy of the response */
+	size_t len;
+};
+
+static void sweep_cb(struct APIRequest *req){
+	struct SweepSlot *slot = req->data;
+
+	slot->res = req->res;
+	slot->http_code = req->http_code;
+	slot->elapsed = req->elapsed;
+
+	if(req->res == CURLE_OK && req->buff.memory){	/* Only valid during the callback */
+		assert( (slot->resp = malloc(req->buff.size + 1)) );
+		memcpy(slot->resp, req->buff.memory, req->buff.size);
+		slot->resp[req->buff.size] = 0;
+		slot->len = req->buff.size;
+	}
+}
+
+static bool isPattern(struct substring *s){
+	for(size_t i = 0; i < s->len; ++i)
+		if(strchr("*?[", s->s[i]))
+			return true;
+
+	return false;
+}
+
+static size_t sweepSelect(const char *pat, struct SweepSlot **slots, size_t nslots){
+	/* Add current gateway's devices matching pat
+	 * <- new number of slots
+	 */
+	size_t nlabels;
+	const char **labels = devicesLabels(&nlabels);
+
+	assert( (*slots = realloc(*slots, (nslots + nlabels + 1) * sizeof(struct SweepSlot))) );
+
+	for(size_t i = 0; i < nlabels; ++i){
+		if(fnmatch(pat, labels[i], 0))
+			continue;
+
+		struct substring l = { labels[i], strlen(labels[i]) };
+		struct Device *dev = findDevice(&l);
+		if(dev){
+			memset(*slots + nslots, 0, sizeof(struct SweepSlot));
+			(*slots)[nslots].dev = dev;
+			(*slots)[nslots++].gateway = gateway;
+		}
+	}
+
+	return nslots;
+}
+
+static void sweepStates(struct substring *pattern, struct substring *name, bool live){
+	char pat[pattern->len + 1];
+	sprintf(pat, "%.*s", (int)pattern->len, pattern->s);
+
+		/* Select devices */
+	struct Gateway *cur = gateway;
+	struct SweepSlot *slots = NULL;
+	size_t nslots = 0;
+	bool fanout = false;	/* Labels are prefixed by their gateway */
+
+	char *sep = strchr(pat, '/');
+	if(sep){
+		*sep = 0;
+		for(struct Gateway *gw = gateways; gw; gw = gw->next)
+			if(!fnmatch(pat, gw->name, 0)){
+				fanout = true;
+				switchGateway(gw);
+				nslots = sweepSelect(sep + 1, &slots, nslots);
 			}
-		} else
-			fputs("*E* Returned object is not an array", stderr);
+		switchGateway(cur);
 
-		json_object_put(res);
+		if(!fanout)	/* Not a gateway : part of the labels */
+			*sep = '/';
 	}
-	freeResponse(&buff);
+	if(!fanout)
+		nslots = sweepSelect(pat, &slots, nslots);
+
+	if(!nslots){
+		fputs("*E* No device matches.\n", stderr);
+		free(slots);
+		return;
+	}
+
+		/* Launch queries, each in its gateway's context */
+	unsigned long start = nowms();
+	unsigned int nqueries = 0;
+
+	for(struct SweepSlot *slot = slots; slot < slots + nslots; ++slot){
+		switchGateway(slot->gateway);
+
+		if(!live && mirrorFresh(slot->dev, name)){
+			slot->mirror = true;
+			continue;
+		}
+
+		char url[ strlen("setup/devices//states") + strlen(slot->dev->escurl) +1];
+		sprintf(url, "setup/devices/%s/states", slot->dev->escurl);
+
+		if(callAPIAsync(url, NULL, sweep_cb, slot))
+			++nqueries;
+		else
+			slot->res = CURLE_FAILED_INIT;
+	}
+	switchGateway(cur);
+	pumpAPIAsync(true);
+
+	unsigned long wall = nowms() - start;
+
+		/* Display results */
+	double latencies = 0;
+	for(struct SweepSlot *slot = slots; slot < slots + nslots; ++slot){
+		char label[strlen(slot->gateway->name) + strlen(slot->dev->label) + 2];
+		if(fanout)
+			sprintf(label, "%s/%s", slot->gateway->name, slot->dev->label);
+		else
+			strcpy(label, slot->dev->label);
+
+		if(!name->s)
+			printf("%s :\n", label);
+
+		switchGateway(slot->gateway);	/* Its states' mirror */
+
+		if(slot->mirror){
+			statesFromMirror(slot->dev, name, label);
+			continue;
+		}
+
+		latencies += slot->elapsed;
+		if(slot->res != CURLE_OK || slot->http_code != 200){
+			fprintf(stderr, "*E* %s : query failed (HTTP %ld)\n", label, slot->http_code);
+			free(slot->resp);
+			continue;
+		}
+
+		struct StatesDecoder sd;
+		struct JSONStream js = { .tok = NULL, .tokcap = 0 };
+		initStatesDecoder(&sd, &js, slot->dev, name, label);
+
+		jsonFeed(&js, slot->resp ? slot->resp : "", slot->len);
+		statesDecoded(&sd, &js);
+		jsonFree(&js);
+		free(slot->resp);
+	}
+	switchGateway(cur);
+
+	if(debug || verbose)
+		printf("*I* %lu device(s), %u queried : %lums wall time, %.0fms of cumulated latency\n",
+			nslots, nqueries, wall, latencies * 1e3);
+
+	free(slots);
 }
 
-void func_Command(const char *arg){
+static void queryStates(const char *arg, bool live){
 	if(!arg){
-		fputs("*E* Command is expecting at last a device's name.\n", stderr);
+		fputs("*E* States is expecting a device's name.\n", stderr);
 		return;
 	}
 
-	struct substring devname, command;
+	struct substring devname, name;
 	const char *next;
 
 		/* Extract the device name */
 	extractTokenSub(&devname, arg, &next);
 
+		/* Extract the state name ... if any */
+	name.s = NULL;	/* Yet empty */
+	if(next && *next){	/* We got an name */
+		const char *unused;
+		extractTokenSub(&name, next, &unused);
+	}
+
 	struct Device *dev = findDevice(&devname);
 	if(!dev){
-		fputs("*E* Device not found.\n", stderr);
+		if(isPattern(&devname))
+			sweepStates(&devname, &name, live);
+		else
+			fputs("*E* Device not found.\n", stderr);
 		return;
 	}
 
-		/* Extract the command name */
-	if(!next || !*next){
-		fputs("*E* Missing command's name.\n", stderr);
+	if(!live && mirrorFresh(dev, &name)){
+		statesFromMirror(dev, &name, NULL);
+		if(debug)
+			puts("*D* Answered from the mirror");
 		return;
 	}
-	extractTokenSub(&command, next, &next);
 
-		/* build command line */
-	char *cmd = dynstringAdd(NULL, 
-"{\"label\":\"x\","
-"\"actions\":["
-"{\"commands\":["
-"{\"name\":\""
-	);
-
-	cmd = dynstringAddSub(cmd, &command);
-
-	cmd = dynstringAdd(cmd,
-"\","
-"\"parameters\":["
-	);
+	char url[ strlen("setup/devices//states") + strlen(dev->escurl) +1];
+	sprintf(url, "setup/devices/%s/states", dev->escurl);
 
-/*TODO argument */
+	if(debug)
+		printf("*D* Url: '%s'\n", url);
 
-	cmd = dynstringAdd(cmd, "]}],\"deviceURL\":\"");
+	struct StatesDecoder sd;
+	struct JSONStream js = { .tok = NULL, .tokcap = 0 };
+	initStatesDecoder(&sd, &js, dev, &name, NULL);
 
-	char *enc = curl_easy_escape(curl, dev->url, 0);
-	assert(enc);
-	cmd = dynstringAdd(cmd, enc);
-	curl_free(enc);
+	long http_code = streamAPI(url, &js);
 
-	cmd = dynstringAdd(cmd, "\"}]}");
+	if(http_code == 200)
+		statesDecoded(&sd, &js);
+	else {
+		free(sd.sname);
+		free(sd.value);
+	}
+	jsonFree(&js);
+}
 
-puts(cmd);
+void func_States(const char *arg){
+	queryStates(arg, false);
+}
 
-	free(cmd);
+void func_LiveStates(const char *arg){
+	queryStates(arg, true);
 }
@@ -6,36 +6,158 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 CURL *curl = NULL;
 static struct curl_slist *global_resolve_list = NULL;	/* forced resolver */
 static struct curl_slist *global_headers = NULL;				/* Headers */
 
+	/* An easy handle and its response buffer.
+	 * The buffer keeps its capacity from a request to another :
+	 * once the biggest response has been received, no more allocation.
+	 */
+struct APIHandle {
+	CURL *curl;
+	struct ResponseBuffer buff;
+
+	struct JSONStream *stream;	/* Successful responses are fed to this decoder */
+	bool feeding;			/* The current response is fed to stream */
+	size_t received;		/* Bytes received for the current response */
+};
+
+static struct APIHandle synchandle;	/* Synchronous calls (uses curl) */
+
+static CURLSH *share = NULL;	/* Shared by all easy handles : TLS sessions and connections */
+
+unsigned long api_activity = 0;	/* Last request's completion (ms), per gateway */
+
+#define PRESIZE_MAX (64*1024*1024)	/* Don't trust bigger Content-Length */
+
+	/* Asynchronous requests */
+unsigned int max_inflight = 8;	/* Maximum number of concurrent requests */
+
+static CURLM *multi = NULL;
+static struct APIHandle **pool = NULL;	/* Idle easy handles */
+static unsigned int pool_size = 0;	/* Number of idle handles */
+static unsigned int running = 0;	/* Requests in progress */
+static struct APIRequest *pending = NULL, *pending_last = NULL;	/* Waiting for a free slot */
+static struct APIRequest *inflight = NULL;	/* Running requests */
+
+	/* Endpoint's changes
+	 * Running transfers may still use previous headers' lists : they
+	 * are released only once no asynchronous request is running.
+	 */
+unsigned int endpoint_generation = 0;	/* Incremented each time a TaHoma's address changes */
+static unsigned int failover_generation = 0;	/* Running requests are targeting this one */
+static struct curl_slist **retired = NULL;
+static unsigned int nretired = 0;
+
+static void retireList(struct curl_slist *l){
+	if(!l)
+		return;
+
+	if(!running){
+		curl_slist_free_all(l);
+		return;
+	}
+
+	assert( (retired = realloc(retired, (nretired + 1) * sizeof(struct curl_slist *))) );
+	retired[nretired++] = l;
+}
+
+static void releaseRetired(void){
+	for(unsigned int i = 0; i < nretired; ++i)
+		curl_slist_free_all(retired[i]);
+	free(retired);
+	retired = NULL;
+	nretired = 0;
+}
+
 	/* Response handling */
 void freeResponse(struct ResponseBuffer *buff){
-	if(buff->memory){
+	if(buff->capacity)	/* Owned */
 		free(buff->memory);
-		buff->memory = NULL;
-		buff->size = 0;
+	buff->memory = NULL;
+	buff->size = buff->capacity = 0;
+}
+
+static bool reserveResponse(struct ResponseBuffer *buff, size_t needed){
+	/* Ensure the buffer can hold needed bytes (growing geometrically) */
+	if(needed <= buff->capacity)
+		return true;
+
+	size_t ncap = buff->capacity ? buff->capacity * 2 : 4096;
+	if(ncap < needed)
+		ncap = needed;
+
+	char *p = realloc(buff->memory, ncap);
+	if(!p){
+		fputs("*E* Out of memory\n", stderr);
+		return false;
 	}
+
+	buff->memory = p;
+	buff->capacity = ncap;
+	++buff->reallocs;
+
+	return true;
+}
+
+static void resetResponse(struct APIHandle *h){
+	/* Start a new response, keeping the buffer */
+	h->received = 0;
+	h->feeding = false;
+	h->buff.size = 0;
+	h->buff.reallocs = 0;
+	if(h->buff.memory)
+		*h->buff.memory = 0;
+}
+
+static struct ResponseBuffer viewResponse(struct APIHandle *h){
+	/* Borrowed view of handle's response, valid until its next request
+	 * (NULL memory if nothing has been received)
+	 */
+	struct ResponseBuffer v = { h->buff.size ? h->buff.memory : NULL, h->buff.size, 0, h->buff.reallocs };
+
+	if(debug && h->buff.size)
+		printf("*D* Response : %lu bytes, %u reallocation%s (capacity %lu)\n", h->buff.size, h->buff.reallocs, h->buff.reallocs > 1 ? "s":"", h->buff.capacity);
+
+	return v;
 }
 
 static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp){
 	size_t realsize = size * nmemb;
-	struct ResponseBuffer *mem = (struct ResponseBuffer *)userp;
-	char *p;
+	struct APIHandle *h = (struct APIHandle *)userp;
+	struct ResponseBuffer *mem = &h->buff;
 
-	if(!mem->memory)
-		p = malloc(realsize + 1);
-	else
-		p = realloc(mem->memory, mem->size + realsize + 1);
+	if(h->stream){	/* Decode on the fly, without buffering */
+		if(!h->received){	/* Only successful responses are JSON */
+			long code = 0;
+			curl_easy_getinfo(h->curl, CURLINFO_RESPONSE_CODE, &code);
+			h->feeding = (code == 200);
+		}
+		h->received += realsize;
 
-	if(!p){
-		fputs("*E* Out of memory\n", stderr);
-		return 0;	/* Signal error to libcurl */
+		if(h->feeding){
+				/* Once the decoder got what it wanted, the remaining is
+				 * read and dropped : aborting would close the connection.
+				 */
+			if(h->stream->stopped || jsonFeed(h->stream, contents, realsize) || h->stream->stopped)
+				return realsize;
+			return 0;	/* Invalid JSON : aborts the transfer */
+		}
+	}
+
+	if(!mem->size){	/* 1st chunk : presize from Content-Length if known */
+		curl_off_t cl = -1;
+		curl_easy_getinfo(h->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
+		if(cl > 0 && cl < PRESIZE_MAX && !reserveResponse(mem, (size_t)cl + 1))
+			return 0;
 	}
 
-	mem->memory = p;
+	if(!reserveResponse(mem, mem->size + realsize + 1))
+		return 0;	/* Signal error to libcurl */
+
 	memcpy(&(mem->memory[mem->size]), contents, realsize);	/* Append new data */
 	mem->size += realsize;
 	mem->memory[mem->size] = 0;
@@ -45,10 +167,27 @@ static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *use
 
 	/* API handling */
 void curl_cleanup(void){
+	if(share && curl){	/* Keep TLS sessions for next invocations */
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+		saveTLSSessions(curl);
+	}
+
 		/* internally protected against NULL pointer */
 	curl_easy_cleanup(curl);	
+	freeResponse(&synchandle.buff);
+	for(unsigned int i = 0; i < pool_size; ++i){
+		curl_easy_cleanup(pool[i]->curl);
+		freeResponse(&pool[i]->buff);
+		free(pool[i]);
+	}
+	free(pool);
+	if(multi)
+		curl_multi_cleanup(multi);
+	if(share)	/* Once no more handle is using it */
+		curl_share_cleanup(share);
 	curl_slist_free_all(global_resolve_list);
 	curl_slist_free_all(global_headers);
+	releaseRetired();
 	curl_global_cleanup();
 }
 
@@ -57,10 +196,7 @@ void buildURL(void){
 		return;
 
 		/* Build target base URL */
-	if(url){
-		free(url);
-		url = NULL;
-	}
+	char *previous = url;
 
 	url_len = strlen("https://:/enduser-mobile-web/1/enduserAPI/");
 	url_len += strlen(ip);
@@ -72,14 +208,16 @@ void buildURL(void){
 	sprintf(url, "https://%s:%u/enduser-mobile-web/1/enduserAPI/", ip, port);
 	url_len = strlen(url);	/* Because the port length is unknown */
 
+	if(previous && strcmp(previous, url))	/* The TaHoma moved */
+		gateway->moved = ++endpoint_generation;
+	free(previous);
+
 	if(debug)
 		printf("*D* url: '%s'\n", url);
 
 		/* Build DNS overwriting */
-	if(global_resolve_list){
-		curl_slist_free_all(global_resolve_list);
-		global_resolve_list = NULL;
-	}
+	retireList(global_resolve_list);
+	global_resolve_list = NULL;
 
 	char resolve_entry[strlen(tahoma) + strlen(ip) + 3]; /* host:port:ip */
 	sprintf(resolve_entry, "%s:%u:%s", tahoma, port, ip);
@@ -91,13 +229,9 @@ void buildURL(void){
 		return;
 	}
 
-	curl_easy_setopt(curl, CURLOPT_RESOLVE, global_resolve_list);
-
 		/* Authorization header string */
-	if(global_headers){
-		curl_slist_free_all(global_headers);
-		global_headers = NULL;
-	}
+	retireList(global_headers);
+	global_headers = NULL;
 	
 	char auth_header[strlen("Authorization: Bearer ") + strlen(token) + 1];
 	strcpy(auth_header, "Authorization: Bearer ");
@@ -122,52 +256,815 @@ void buildURL(void){
 	if(debug)
 		for(struct curl_slist *c = global_headers; c; c = c->next)
 			printf("*D* Header -> '%s'\n", c->data);
+}
+
+static void setupHandle(CURL *h){
+	/* Apply connection settings to an easy handle */
+
+	if(!share){
+		if((share = curl_share_init())){
+			curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+			curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);	/* A connection kept warm serves everyone */
+		} else
+			fputs("*E* curl_share_init() failed.\n", stderr);
+	}
+	if(share){
+		curl_easy_setopt(h, CURLOPT_SHARE, share);
+		loadTLSSessions(h);	/* Before the 1st request */
+	}
 
-	int res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, global_headers);
+	curl_easy_setopt(h, CURLOPT_RESOLVE, global_resolve_list);
+
+	int res = curl_easy_setopt(h, CURLOPT_HTTPHEADER, global_headers);
 	if(res != CURLE_OK)
-		fprintf(stderr, "*E* curl_easy_setopt(%p) : %s\n", curl, curl_easy_strerror(res));
+		fprintf(stderr, "*E* curl_easy_setopt(%p) : %s\n", h, curl_easy_strerror(res));
+
+	if(unsafe){
+		curl_easy_setopt(h, CURLOPT_SSL_VERIFYPEER, 0L);	/* Don't verify SSL */
+		curl_easy_setopt(h, CURLOPT_SSL_VERIFYHOST, 0L);
+	}
+
+	curl_easy_setopt(h, CURLOPT_TIMEOUT, timeout);
+	curl_easy_setopt(h, CURLOPT_VERBOSE, debug ? 1L : 0L);
+}
+
+	/* ***
+	 * Retry policy and circuit breaker
+	 *
+	 * Transient failures (transport errors, 502, 503 and 504) of GETs are
+	 * retried after a random delay (full jitter) whose upper bound doubles
+	 * at each attempt. POSTs (exec/apply, ...) are not idempotent : they are
+	 * retried only if the connection couldn't be established.
+	 * Synchronous requests sleep b/w attempts, asynchronous ones are
+	 * queued again and relaunched once the delay is over.
+	 *
+	 * After breaker_threshold consecutive failures, the breaker opens :
+	 * requests fail immediately for breaker_cooldown seconds, then a single
+	 * trial request is let through (half-open) and closes it if it succeeds ;
+	 * others still fail until its completion.
+	 * Each gateway has its own breaker : an unreachable one doesn't
+	 * prevent reaching the others.
+	 * ***/
+
+unsigned int max_retries = 2;		/* Retries of a failed request */
+unsigned int breaker_threshold = 5;	/* Consecutive failures opening the breaker, 0 : disabled */
+unsigned int breaker_cooldown = 30;	/* How long it stays open (seconds) */
+
+#define BACKOFF_BASE 250	/* Upper bound of the 1st retry's delay (ms) */
+#define BACKOFF_MAX 8000
+
+	/* Current gateway's breaker */
+static enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALFOPEN } breaker = BREAKER_CLOSED;
+static unsigned int failures = 0;		/* Consecutive failures */
+static unsigned long opened;			/* When the breaker opened (ms) */
+static bool trial_inflight = false;	/* Half-open : the trial request is running */
+
+static unsigned long nretried = 0;		/* Retries done */
+static unsigned long nrejected = 0;		/* Requests refused while open */
+
+static bool transientFailure(CURLcode res, long http_code){
+	if(res != CURLE_OK)
+		return true;
+
+	return http_code == 502 || http_code == 503 || http_code == 504;
+}
+
+static bool notSent(CURLcode res){
+	/* The request can't have reached the TaHoma */
+	return res == CURLE_COULDNT_RESOLVE_HOST || res == CURLE_COULDNT_CONNECT;
+}
+
+static bool breakerAllows(void){
+	if(breaker == BREAKER_OPEN){
+		if(nowms() - opened < breaker_cooldown * 1000UL){
+			++nrejected;
+			return false;
+		}
+
+		breaker = BREAKER_HALFOPEN;	/* Let a trial request go */
+		trial_inflight = false;
+		if(debug || verbose)
+			puts("*I* Circuit breaker half-open : trying the TaHoma again");
+	}
+
+	if(breaker == BREAKER_HALFOPEN){
+		if(trial_inflight){	/* Only one at a time */
+			++nrejected;
+			return false;
+		}
+		trial_inflight = true;
+	}
+
+	return true;
+}
+
+static void breakerRecord(bool failed){
+	trial_inflight = false;
+
+	if(!failed){
+		if(breaker != BREAKER_CLOSED && (debug || verbose))
+			puts("*I* Circuit breaker closed");
+		breaker = BREAKER_CLOSED;
+		failures = 0;
+		return;
+	}
+
+	++failures;
+	if(breaker == BREAKER_HALFOPEN || (breaker_threshold && failures >= breaker_threshold)){
+		if(breaker != BREAKER_OPEN)
+			fprintf(stderr, "*W* Circuit breaker open after %u failures : requests fail for %us\n", failures, breaker_cooldown);
+		breaker = BREAKER_OPEN;
+		opened = nowms();
+	}
+}
+
+static unsigned long backoff(unsigned int attempt){
+	/* Delay before the retry following attempt (ms) */
+	static bool seeded = false;
+	if(!seeded){
+		srandom(nowms() ^ getpid());
+		seeded = true;
+	}
+
+	unsigned long max = BACKOFF_BASE << (attempt < 5 ? attempt : 5);
+	if(max > BACKOFF_MAX)
+		max = BACKOFF_MAX;
+
+	return random() % (max + 1);
+}
+
+void breakerReport(void){
+	printf("\tRetries : %u (%lu done), circuit breaker : ", max_retries, nretried);
+
+	if(!breaker_threshold)
+		puts("disabled");
+	else {
+		switch(breaker){
+		case BREAKER_CLOSED:
+			printf("closed (%u consecutive failure%s, opens at %u)", failures, failures > 1 ? "s":"", breaker_threshold);
+			break;
+		case BREAKER_OPEN: {
+				unsigned long elapsed = nowms() - opened;
+				printf("open (%lus left)", elapsed < breaker_cooldown * 1000UL ? (breaker_cooldown * 1000UL - elapsed + 999) / 1000 : 0);
+			}
+			break;
+		case BREAKER_HALFOPEN:
+			printf("half-open%s", trial_inflight ? " (trial running)" : "");
+			break;
+		}
+		if(nrejected)
+			printf(", %lu request%s refused", nrejected, nrejected > 1 ? "s":"");
+		putchar('\n');
+	}
+}
+
+static bool resetBreaker(void){
+	breaker = BREAKER_CLOSED;
+	trial_inflight = false;
+	failures = 0;
+	return false;
+}
+
+void breakerReset(void){
+	forEachGateway(resetBreaker);
+}
+
+	/* ***
+	 * Rate limiter
+	 *
+	 * Token bucket protecting the TaHoma : it holds up to rate_burst tokens,
+	 * refilled at rate_limit tokens per second. Each request costs its
+	 * endpoint class' weight. Requests exceeding the budget wait : synchronous
+	 * ones sleep, asynchronous ones stay in the pending queue.
+	 * When a TaHoma answers 429 or 503, its requests are paused
+	 * (for Retry-After seconds if provided).
+	 *
+	 * Notez-bien : the bucket is shared by all gateways (it bounds the
+	 *	process' overall request rate), only pauses are per gateway.
+	 * ***/
+
+double rate_limit = 0;			/* Tokens per second, 0 : unlimited */
+unsigned int rate_burst = 20;	/* Bucket's capacity */
+
+#define THROTTLE_PAUSE 5	/* Pause if no Retry-After is provided (seconds) */
+#define THROTTLE_MAX 60		/* Longest pause (seconds) */
+
+enum EndpointClass { EP_DISCOVERY = 0, EP_STATES, EP_EXEC, EP_EVENTS, EP_OTHER };
+
+static struct {
+	const char *name;
+	double weight;			/* Tokens per request */
+
+		/* Budget usage */
+	unsigned long requests;
+	double spent;			/* Tokens */
+	unsigned long waited;	/* Time spent waiting for tokens (ms) */
+	unsigned long throttled;	/* 429 and 503 received */
+} classes[] = {
+	{ "discovery", 10, 0, 0, 0, 0 },	/* setup, setup/devices, ... : expensive */
+	{ "states", 1, 0, 0, 0, 0 },
+	{ "exec", 2, 0, 0, 0, 0 },
+	{ "events", 1, 0, 0, 0, 0 },
+	{ "other", 1, 0, 0, 0, 0 },
+	{ NULL, 0, 0, 0, 0, 0 }
+};
+
+static double tokens = 0;			/* Available tokens */
+static unsigned long refilled = 0;	/* Last refill (ms), 0 : bucket not started */
+static unsigned long paused_until = 0;	/* Throttled by the current TaHoma (ms) */
+
+static enum EndpointClass endpointClass(const char *api){
+	if(!strncmp(api, "setup/devices/", 14) && strstr(api + 14, "/states"))
+		return EP_STATES;
+	if(!strncmp(api, "setup", 5))
+		return EP_DISCOVERY;
+	if(!strncmp(api, "exec/", 5))
+		return EP_EXEC;
+	if(!strncmp(api, "events/", 7))
+		return EP_EVENTS;
+	return EP_OTHER;
+}
+
+static double classWeight(enum EndpointClass c){
+	/* Never more than the bucket can hold */
+	return classes[c].weight < rate_burst ? classes[c].weight : rate_burst;
+}
+
+static unsigned long pauseDelay(void){
+	/* <- how long (ms) the current TaHoma asked to wait */
+	unsigned long now = nowms();
+
+	return paused_until > now ? paused_until - now : 0;
+}
+
+static unsigned long rateDelay(enum EndpointClass c){
+	/* <- how long (ms) a request has to wait before being sent */
+	unsigned long now = nowms(), d = pauseDelay();
+
+	if(d)
+		return d;
+
+	if(!rate_limit)
+		return 0;
+
+	if(!refilled)	/* Starts full */
+		tokens = rate_burst;
+	else {
+		tokens += (now - refilled) * rate_limit / 1000;
+		if(tokens > rate_burst)
+			tokens = rate_burst;
+	}
+	refilled = now;
+
+	double w = classWeight(c);
+	if(tokens >= w)
+		return 0;
+
+	return (unsigned long)((w - tokens) * 1000 / rate_limit) + 1;
+}
+
+static void rateConsume(enum EndpointClass c, unsigned long waited){
+	++classes[c].requests;
+	classes[c].waited += waited;
+
+	if(rate_limit){
+		tokens -= classWeight(c);
+		classes[c].spent += classWeight(c);
+	}
+}
+
+static void rateWait(enum EndpointClass c){
+	/* Synchronous requests : sleep until the budget allows it */
+	unsigned long d, waited = 0;
+
+	while((d = rateDelay(c))){
+		if(debug)
+			printf("*D* Rate limiter : %s request waiting %lums\n", classes[c].name, d);
+		usleep(d * 1000);
+		waited += d;
+	}
+
+	rateConsume(c, waited);
 }
 
-void callAPI(const char *api, struct ResponseBuffer *buff){
+static void rateThrottled(CURL *h, enum EndpointClass c, long http_code){
+	/* The TaHoma asks to slow down */
+	if(http_code != 429 && http_code != 503)
+		return;
+
+	curl_off_t after = -1;
+#if LIBCURL_VERSION_NUM >= 0x074200	/* 7.66.0 */
+	curl_easy_getinfo(h, CURLINFO_RETRY_AFTER, &after);
+#endif
+	if(after <= 0)
+		after = THROTTLE_PAUSE;
+	else if(after > THROTTLE_MAX)
+		after = THROTTLE_MAX;
+
+	++classes[c].throttled;
+	paused_until = nowms() + after * 1000UL;
+
+	if(verbose || debug)
+		printf("*W* TaHoma is overloaded (HTTP %ld) : requests paused for %lds\n", http_code, (long)after);
+}
+
+bool setRateWeight(const char *name, double weight){
+	for(int i = 0; classes[i].name; ++i)
+		if(!strcmp(name, classes[i].name)){
+			classes[i].weight = weight;
+			return true;
+		}
+
+	return false;
+}
+
+void rateReport(void){
+	if(rate_limit)
+		printf("\tRate limit : %g tokens/s, burst %u (%.1f available)\n", rate_limit, rate_burst, refilled ? tokens : rate_burst);
+	else
+		puts("\tRate limit : none");
+
+	unsigned long now = nowms();
+	if(paused_until > now)
+		printf("\t\tPaused by the TaHoma for %lums\n", paused_until - now);
+
+	for(int i = 0; classes[i].name; ++i){
+		printf("\t\t%s (weight %g) : %lu request%s", classes[i].name, classes[i].weight, classes[i].requests, classes[i].requests > 1 ? "s":"");
+		if(classes[i].spent)
+			printf(", %g tokens", classes[i].spent);
+		if(classes[i].waited)
+			printf(", waited %lums", classes[i].waited);
+		if(classes[i].throttled)
+			printf(", %lu throttled", classes[i].throttled);
+		putchar('\n');
+	}
+}
+
+void connectionExchange(struct Gateway *gw){
+	SWAP(global_resolve_list, gw->resolve_list);
+	SWAP(global_headers, gw->headers);
+	SWAP(api_activity, gw->activity);
+	SWAP(breaker, gw->breaker);
+	SWAP(trial_inflight, gw->trial_inflight);
+	SWAP(failures, gw->failures);
+	SWAP(opened, gw->opened);
+	SWAP(paused_until, gw->paused_until);
+}
+
+static long performAPI(const char *api, const char *post, struct ResponseBuffer *buff, struct JSONStream *stream){
+	/* Synchronous API call
+	 * -> post : POST data, NULL for GET
+	 * -> stream : if not NULL, a successful response is fed to it
+	 * <- HTTP return code, 0 in case of error
+	 */
 	if(!tahoma || !ip || !port || !token){
 		fputs("*E* missing connection information to run the request.\n", stderr);
-		return;
+		return 0;
 	}
 	
-	char full_url[url_len + strlen(api) + 1];
+	freeResponse(buff);
+	synchandle.curl = curl;
+	synchandle.stream = stream;
+	resetResponse(&synchandle);	/* Nothing left from the previous request if refused */
+
+	enum EndpointClass cls = endpointClass(api);
+	long http_code = 0;
+	for(unsigned int attempt = 0;; ++attempt){
+		if(!breakerAllows()){
+			fputs("*E* TaHoma unreachable (circuit breaker open)\n", stderr);
+			http_code = 0;
+			break;
+		}
+		rateWait(cls);
+
+		char full_url[url_len + strlen(api) + 1];	/* The TaHoma may have moved since the previous attempt */
+		strcpy(full_url, url);
+		strcpy(full_url + url_len, api);
+		unsigned int gen = endpoint_generation;
+
+		resetResponse(&synchandle);
+
+		setupHandle(curl);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&synchandle);
+
+		if(debug)
+			printf("*D* calling '%s'\n", full_url);
+		curl_easy_setopt(curl, CURLOPT_URL, full_url);
+
+		if(post){
+			if(debug)
+				printf("*D* posting '%s'\n", post);
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post);
+		} else
+			curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+
+		spent(false);
+		int res = curl_easy_perform(curl);
+		spent(true);
+		api_activity = nowms();
+
+		if(debug && stream && stream->stopped)
+			printf("*D* Response's decoding stopped, %lu bytes received\n", synchandle.received);
+
+		http_code = 0;
+		if(res != CURLE_OK)
+			fprintf(stderr, "*E* Calling error : %s\n", curl_easy_strerror(res));
+		else {
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+			if(verbose || debug)
+				printf("*I* HTTP return code : %ld\n", http_code);
+
+			if(debug){
+				double t;
+				curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &t);
+
+				printf("*D* Connection : %.2fs\n", t);
+			}
+		}
+		tlsHandshakeDone(curl);
+		rateThrottled(curl, cls, http_code);
+
+		bool failed = transientFailure(res, http_code);
+		breakerRecord(failed);
+
+		if(http_code == 429 && !post)	/* Retried once the pause is over */
+			failed = true;
+		if(failed && res != CURLE_OK && (!post || notSent(res))){	/* Did it move meanwhile ? */
+			watcher_tick();
+			if(gateway->moved > gen){
+				if(verbose || debug)
+					puts("*I* TaHoma moved : request sent to its new address");
+				continue;
+			}
+		}
+		if(!failed || attempt >= max_retries || breaker == BREAKER_OPEN)
+			break;
+		if(post && !notSent(res))	/* May have been executed */
+			break;
+		if(stream && synchandle.feeding)	/* The decoder already got a part of it */
+			break;
+
+		unsigned long delay = backoff(attempt);
+		if(verbose || debug)
+			printf("*W* Retrying in %lums (%u/%u)\n", delay, attempt + 1, max_retries);
+		++nretried;
+		usleep(delay * 1000);
+	}
+
+	synchandle.stream = NULL;
+	if(!http_code)	/* Refused or failed : a partial body is meaningless */
+		resetResponse(&synchandle);
+	*buff = viewResponse(&synchandle);
+	return http_code;
+}
+
+long callAPI(const char *api, struct ResponseBuffer *buff){
+	return performAPI(api, NULL, buff, NULL);
+}
+
+long postAPI(const char *api, const char *data, struct ResponseBuffer *buff){
+	return performAPI(api, data, buff, NULL);
+}
+
+long streamAPI(const char *api, struct JSONStream *stream){
+	/* Notez-bien : unsuccessful responses are buffered and displayed
+	 * in debug mode.
+	 */
+	struct ResponseBuffer buff = {NULL};
+	long http_code = performAPI(api, NULL, &buff, stream);
+
+	if(debug && buff.memory)
+		printf("*D* Resp: '%s'\n", buff.memory);
+
+	freeResponse(&buff);
+	return http_code;
+}
+
+	/* ***
+	 * Asynchronous API calling
+	 *
+	 * Requests are queued by callAPIAsync() and processed by pumpAPIAsync()
+	 * using a pool of easy handles driven by a curl multi handle.
+	 * At most max_inflight requests are running concurrently.
+	 * ***/
+
+static void freeRequest(struct APIRequest *req){
+	free(req->api);
+	free(req->post);
+	freeResponse(&req->buff);
+	free(req);
+}
+
+static bool launchRequest(struct APIRequest *req){
+	struct APIHandle *h;
+
+	if(pool_size)	/* Reuse an idle handle */
+		h = pool[--pool_size];
+	else {
+		assert( (h = calloc(1, sizeof(struct APIHandle))) );
+		if(!(h->curl = curl_easy_init())){
+			fputs("*E* curl_easy_init() failed.\n", stderr);
+			free(h);
+			return false;
+		}
+	}
+
+	char full_url[url_len + strlen(req->api) + 1];
 	strcpy(full_url, url);
-	strcpy(full_url + url_len, api);
+	strcpy(full_url + url_len, req->api);
 
-	freeResponse(buff);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)buff);
+	resetResponse(h);
+	setupHandle(h->curl);
+	curl_easy_setopt(h->curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+	curl_easy_setopt(h->curl, CURLOPT_WRITEDATA, (void *)h);
+	curl_easy_setopt(h->curl, CURLOPT_PRIVATE, (void *)req);
+	curl_easy_setopt(h->curl, CURLOPT_URL, full_url);	/* The string is copied by libcurl */
+	if(req->post)
+		curl_easy_setopt(h->curl, CURLOPT_POSTFIELDS, req->post);
+	else
+		curl_easy_setopt(h->curl, CURLOPT_HTTPGET, 1L);
 
 	if(debug)
-		printf("*D* calling '%s'\n", full_url);
-	curl_easy_setopt(curl, CURLOPT_URL, full_url);
+		printf("*D* async calling '%s'\n", full_url);
 
-	if(timeout)
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+	req->handle = h;
+	req->generation = endpoint_generation;
+	curl_multi_add_handle(multi, h->curl);
+	++running;
 
-	if(debug)
-		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	req->next = inflight;
+	inflight = req;
 
-	spent(false);
-	int res = curl_easy_perform(curl);
-	spent(true);
+	return true;
+}
 
-	if(res != CURLE_OK)
-		fprintf(stderr, "*E* Calling error : %s\n", curl_easy_strerror(res));
-	else if(verbose || debug){
-		long http_code = 0;
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-		printf("*I* HTTP return code : %ld\n", http_code);
+static void releaseHandle(struct APIHandle *h){
+	curl_multi_remove_handle(multi, h->curl);
 
-		if(debug){
-			double t;
-			curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &t);
+	if(!(pool = realloc(pool, (pool_size + 1) * sizeof(struct APIHandle *)))){
+		fputs("*F* Out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	pool[pool_size++] = h;
+}
+
+static void removeInflight(struct APIRequest *req){
+	for(struct APIRequest **p = &inflight; *p; p = &(*p)->next)
+		if(*p == req){
+			*p = req->next;
+			break;
+		}
+	req->next = NULL;
+}
+
+static void failover(void){
+	/* The TaHoma moved : requests running against its previous address
+	 * are sent again to the new one, as soon as possible.
+	 * Notez-bien : POSTs are only moved if not connected yet (so can't
+	 *	have been received).
+	 */
+	struct APIRequest *moved = NULL, *moved_last = NULL;
+
+	failover_generation = endpoint_generation;
+
+	for(struct APIRequest **p = &inflight; *p;){
+		struct APIRequest *req = *p;
+		double conn = 0;
+
+		bool stale = req->gateway->moved > req->generation;
+		if(stale && req->post)
+			curl_easy_getinfo(req->handle->curl, CURLINFO_CONNECT_TIME, &conn);
+
+		if(!stale || conn > 0){
+			p = &req->next;
+			continue;
+		}
+
+		*p = req->next;
+		releaseHandle(req->handle);
+		--running;
+		req->handle = NULL;
+
+		if(req->trial){	/* Tried again once relaunched */
+			struct Gateway *cur = gateway;
+			switchGateway(req->gateway);
+			trial_inflight = false;
+			switchGateway(cur);
+			req->trial = false;
+		}
+
+		req->next = NULL;
+		if(moved_last)
+			moved_last->next = req;
+		else
+			moved = req;
+		moved_last = req;
+
+		if(verbose || debug)
+			printf("*I* '%s' moved to the new address\n", req->api);
+	}
 
-			printf("*D* Connection : %.2fs\n", t);
+	if(moved){	/* Ahead of the queue */
+		moved_last->next = pending;
+		if(!pending)
+			pending_last = moved_last;
+		pending = moved;
+	}
+}
+
+static unsigned long launchPending(void){
+	/* <- how long (ms) the 1st waiting request has to wait for
+	 * the rate limiter or its retry, 0 if none
+	 * Notez-bien : requests waiting for their retry or to a paused
+	 *	gateway are skipped, others keep their order.
+	 */
+	struct APIRequest **p = &pending, *prev = NULL;
+	unsigned long wait = 0, now = nowms();
+
+	while(*p && running < max_inflight){
+		struct APIRequest *req = *p;
+		struct Gateway *cur = gateway;	/* Launched in its own context */
+		switchGateway(req->gateway);
+
+		unsigned long d = req->retry_at > now ? req->retry_at - now : 0;
+		if(!d)
+			d = pauseDelay();
+		bool paused = d;
+		if(!d)
+			d = rateDelay(endpointClass(req->api));
+		if(d){	/* Stays in the queue */
+			switchGateway(cur);
+			if(!req->queued)
+				req->queued = nowms();
+			if(!wait || d < wait)
+				wait = d;
+			if(!paused)	/* The bucket is empty for everyone */
+				return wait;
+
+			prev = req;
+			p = &req->next;
+			continue;
+		}
+
+		if(!(*p = req->next))
+			pending_last = prev;
+		req->next = NULL;
+
+		if(!breakerAllows()){	/* Fail fast */
+			if(debug)
+				printf("*D* '%s' refused : circuit breaker open\n", req->api);
+			req->res = CURLE_COULDNT_CONNECT;
+			req->func(req);
+			freeRequest(req);
+		} else {
+			req->trial = (breaker == BREAKER_HALFOPEN);
+
+			if(!launchRequest(req)){
+				if(req->trial)	/* Never reached the TaHoma */
+					trial_inflight = false;
+				req->res = CURLE_FAILED_INIT;
+				req->func(req);
+				freeRequest(req);
+			} else
+				rateConsume(endpointClass(req->api), req->queued ? nowms() - req->queued : 0);
 		}
+
+		switchGateway(cur);
+	}
+
+	return wait;
+}
+
+bool callAPIAsync(const char *api, const char *post, void (*func)(struct APIRequest *), void *data){
+	if(!tahoma || !ip || !port || !token || !url){
+		fputs("*E* missing connection information to run the request.\n", stderr);
+		return false;
 	}
+
+	if(!multi && !(multi = curl_multi_init())){
+		fputs("*E* curl_multi_init() failed.\n", stderr);
+		return false;
+	}
+
+	struct APIRequest *req = calloc(1, sizeof(struct APIRequest));
+	assert(req);
+
+	assert( (req->api = strdup(api)) );
+	if(post)
+		assert( (req->post = strdup(post)) );
+	req->func = func;
+	req->data = data;
+	req->gateway = gateway;
+
+		/* Queue it */
+	if(pending_last)
+		pending_last->next = req;
+	else
+		pending = req;
+	pending_last = req;
+
+	return true;
+}
+
+void pumpAPIAsync(bool wait){
+	if(!multi)
+		return;
+
+	if(!max_inflight)	/* Avoid dead lock */
+		max_inflight = 1;
+
+	do {
+		if(failover_generation != endpoint_generation)
+			failover();
+		launchPending();
+
+		int still;
+		CURLMcode mc = curl_multi_perform(multi, &still);
+		if(mc != CURLM_OK){
+			fprintf(stderr, "*E* curl_multi_perform() : %s\n", curl_multi_strerror(mc));
+			return;
+		}
+
+			/* Collect finished requests */
+		CURLMsg *msg;
+		int left;
+		while((msg = curl_multi_info_read(multi, &left))){
+			if(msg->msg != CURLMSG_DONE)
+				continue;
+
+			struct APIRequest *req;
+			CURL *h = msg->easy_handle;
+			curl_easy_getinfo(h, CURLINFO_PRIVATE, (char **)&req);
+			removeInflight(req);
+
+			struct Gateway *cur = gateway;	/* Completed in its own context */
+			switchGateway(req->gateway);
+
+			req->res = msg->data.result;
+			api_activity = nowms();
+			curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &req->http_code);
+			breakerRecord(transientFailure(req->res, req->http_code));
+			rateThrottled(h, endpointClass(req->api), req->http_code);
+			curl_easy_getinfo(h, CURLINFO_TOTAL_TIME, &req->elapsed);
+
+			if(req->res != CURLE_OK)
+				fprintf(stderr, "*E* Calling error (%s) : %s\n", req->api, curl_easy_strerror(req->res));
+			else if(debug)
+				printf("*D* '%s' : HTTP %ld in %.3fs\n", req->api, req->http_code, req->elapsed);
+			tlsHandshakeDone(h);
+
+				/* Same retry policy as synchronous requests */
+			bool failed = transientFailure(req->res, req->http_code) || (req->http_code == 429 && !req->post);
+			if(failed && req->attempts < max_retries && breaker != BREAKER_OPEN && (!req->post || notSent(req->res))){
+				unsigned long delay = backoff(req->attempts++);
+				if(verbose || debug)
+					printf("*W* Retrying '%s' in %lums (%u/%u)\n", req->api, delay, req->attempts, max_retries);
+				++nretried;
+				switchGateway(cur);
+
+				releaseHandle(req->handle);
+				--running;
+				req->handle = NULL;
+				req->trial = false;
+				req->queued = 0;
+				req->retry_at = nowms() + delay;
+
+				if(pending_last)	/* Queued again */
+					pending_last->next = req;
+				else
+					pending = req;
+				pending_last = req;
+				continue;
+			}
+
+			req->buff = viewResponse(req->handle);
+			req->func(req);
+			switchGateway(cur);
+
+				/* The buffer is kept with the handle for further requests */
+			releaseHandle(req->handle);
+			--running;
+			req->handle = NULL;
+			freeRequest(req);
+		}
+
+		if(!running && nretired)	/* No more transfer is using them */
+			releaseRetired();
+
+		unsigned long d = launchPending();	/* Slots may have been freed */
+
+		if(wait && (running || pending))
+			curl_multi_poll(multi, NULL, 0, (d && d < 1000) ? d : 1000, NULL);
+	} while(wait && (running || pending));
+}
+
+unsigned int pendingAPIAsync(void){
+	unsigned int nbre = running;
+
+	for(struct APIRequest *req = pending; req; req = req->next)
+		++nbre;
+
+	return nbre;
 }
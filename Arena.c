@@ -0,0 +1,123 @@
+/* Arena allocator
+ *
+ * Objects sharing the same lifetime are allocated in big chunks
+ * and released all together : no per object malloc()/free(),
+ * no heap fragmentation.
+ * Strings can be interned : each distinct value is stored only once.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE 16384
+#define ALIGNMENT (sizeof(void *))
+
+struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t size;	/* Data's size */
+	size_t used;
+	char data[];
+};
+
+void *arenaAlloc(struct Arena *arena, size_t size){
+	size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+	struct ArenaChunk *c = arena->chunks;
+	if(!c || c->size - c->used < size){	/* Need a new chunk */
+		size_t csize = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+
+		assert( (c = malloc(sizeof(struct ArenaChunk) + csize)) );
+		c->size = csize;
+		c->used = 0;
+		c->next = arena->chunks;
+		arena->chunks = c;
+		arena->allocated += csize;
+	}
+
+	void *p = c->data + c->used;
+	c->used += size;
+	arena->used += size;
+
+	return p;
+}
+
+char *arenaStrdup(struct Arena *arena, const char *s){
+	size_t l = strlen(s) + 1;
+	char *p = arenaAlloc(arena, l);
+
+	memcpy(p, s, l);
+	return p;
+}
+
+static uint32_t hash(const char *s){
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+
+	for(; *s; ++s){
+		h ^= (unsigned char)*s;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void internInsert(struct Arena *arena, const char *s){
+	size_t i = hash(s) & (arena->isize - 1);
+
+	while(arena->interned[i])
+		i = (i + 1) & (arena->isize - 1);
+	arena->interned[i] = s;
+}
+
+const char *arenaIntern(struct Arena *arena, const char *s){
+	if(arena->isize){
+		for(size_t i = hash(s) & (arena->isize - 1); arena->interned[i]; i = (i + 1) & (arena->isize - 1))
+			if(!strcmp(arena->interned[i], s))
+				return arena->interned[i];
+	}
+
+	if((arena->icount + 1) * 2 > arena->isize){	/* Grow the table (load factor under 50%) */
+		const char **old = arena->interned;
+		size_t osize = arena->isize;
+
+		arena->isize = osize ? osize * 2 : 64;
+		assert( (arena->interned = calloc(arena->isize, sizeof(const char *))) );
+
+		for(size_t i = 0; i < osize; ++i)
+			if(old[i])
+				internInsert(arena, old[i]);
+		free(old);
+	}
+
+	const char *p = arenaStrdup(arena, s);
+	internInsert(arena, p);
+	++arena->icount;
+
+	return p;
+}
+
+void arenaReset(struct Arena *arena){
+	/* The 1st chunk is kept for reuse */
+	struct ArenaChunk *c = arena->chunks;
+
+	if(c){
+		for(struct ArenaChunk *n = c->next; n; ){
+			struct ArenaChunk *old = n;
+			n = n->next;
+			free(old);
+		}
+
+		c->next = NULL;
+		c->used = 0;
+		arena->allocated = c->size;
+	}
+	arena->used = 0;
+
+	free(arena->interned);
+	arena->interned = NULL;
+	arena->isize = arena->icount = 0;
+}
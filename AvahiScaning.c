@@ -24,6 +24,95 @@ AvahiProtocol avahiIP = AVAHI_PROTO_UNSPEC;
 
 static AvahiSimplePoll *simple_poll = NULL;
 
+	/* Multi-results scan (scan_Gateways)
+	 * Every advertised gateway is resolved and collected, instead
+	 * of stopping at the 1st one.
+	 */
+#define SCAN_TIMEOUT 5	/* Default deadline (seconds) */
+#define SCAN_MAXADDR 4	/* Addresses kept per gateway */
+
+struct ScanResult {
+	char *name;			/* Service's instance */
+	char *host;
+	uint16_t port;
+	char *addresses[SCAN_MAXADDR];
+	unsigned int naddr;
+	char *fw_version;	/* TXT fields, NULL if not provided */
+	char *gateway_pin;
+	char *api_version;
+};
+
+static struct ScanResult *results = NULL;
+static unsigned int nresults = 0;
+
+static bool collecting = false;	/* Don't stop at the 1st resolution */
+static unsigned int pending = 0;	/* Running resolvers */
+static bool exhausted = false;	/* The browser sent ALL_FOR_NOW */
+
+static void freeResults(void){
+	for(unsigned int i = 0; i < nresults; ++i){
+		clean(&results[i].name);
+		clean(&results[i].host);
+		for(unsigned int j = 0; j < results[i].naddr; ++j)
+			clean(&results[i].addresses[j]);
+		clean(&results[i].fw_version);
+		clean(&results[i].gateway_pin);
+		clean(&results[i].api_version);
+	}
+	free(results);
+	results = NULL;
+	nresults = 0;
+}
+
+static void txtField(AvahiStringList *txt, const char *key, char **storage){
+	AvahiStringList *f = avahi_string_list_find(txt, key);
+	char *k, *v;
+
+	if(f && !avahi_string_list_get_pair(f, &k, &v, NULL)){
+		if(v)
+			FreeAndSet(storage, v);
+		avahi_free(k);
+		avahi_free(v);
+	}
+}
+
+static void collectResult(const char *name, const char *host_name, const char *a, uint16_t aport, AvahiStringList *txt){
+	/* A gateway is resolved once per interface and protocol : merge them */
+	struct ScanResult *r = NULL;
+
+	for(unsigned int i = 0; i < nresults; ++i)
+		if(!strcmp(results[i].name, name)){
+			r = results + i;
+			break;
+		}
+
+	if(!r){
+		assert( (results = realloc(results, (nresults + 1) * sizeof(struct ScanResult))) );
+		r = results + nresults++;
+		memset(r, 0, sizeof(struct ScanResult));
+		FreeAndSet(&r->name, name);
+		FreeAndSet(&r->host, host_name);
+		r->port = aport;
+	}
+
+	bool known = false;
+	for(unsigned int i = 0; i < r->naddr; ++i)
+		if(!strcmp(r->addresses[i], a))
+			known = true;
+	if(!known && r->naddr < SCAN_MAXADDR)
+		FreeAndSet(&r->addresses[r->naddr++], a);
+
+	txtField(txt, "fw_version", &r->fw_version);
+	txtField(txt, "gateway_pin", &r->gateway_pin);
+	txtField(txt, "api_version", &r->api_version);
+}
+
+static void scanDone(void){
+	/* Stop as soon as everything known has been resolved */
+	if(collecting && exhausted && !pending)
+		avahi_simple_poll_quit(simple_poll);
+}
+
 static void resolve_callback(
 	AvahiServiceResolver *r,
 	AvahiIfIndex interface,
@@ -71,16 +160,26 @@ static void resolve_callback(
 					!!(flags & AVAHI_LOOKUP_RESULT_CACHED)
 				);
 
+			avahi_free(t);
+
+			if(collecting){
+				collectResult(name, host_name, a, aport, txt);
+				break;
+			}
+
 			FreeAndSet(&tahoma, host_name);
 			FreeAndSet(&ip, a);
 			port = aport;
 
-			avahi_free(t);
 			avahi_simple_poll_quit(simple_poll);
 			break;
 		}
 	}
 	avahi_service_resolver_free(r);
+
+	if(pending)
+		--pending;
+	scanDone();
 }
 
 static void browse_callback(
@@ -111,6 +210,8 @@ static void browse_callback(
 			   the resolver for us. */
 			if(!(avahi_service_resolver_new(c, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, 0, resolve_callback, c)))
 				fprintf(stderr, "*E* Failed to resolve service '%s': %s\n", name, avahi_strerror(avahi_client_errno(c)));
+			else
+				++pending;
 			break;
 		case AVAHI_BROWSER_REMOVE:
 			if(debug)
@@ -120,6 +221,10 @@ static void browse_callback(
 		case AVAHI_BROWSER_CACHE_EXHAUSTED:
 			if(debug)
 				printf("*D* (Browser) %s\n", event == AVAHI_BROWSER_CACHE_EXHAUSTED ? "CACHE_EXHAUSTED" : "ALL_FOR_NOW");
+			if(event == AVAHI_BROWSER_ALL_FOR_NOW){	/* No more advertisements expected soon */
+				exhausted = true;
+				scanDone();
+			}
 			break;
 	}
 }
@@ -134,14 +239,17 @@ static void client_callback(AvahiClient *c, AvahiClientState state, AVAHI_GCC_UN
 	}
 }
 
-void func_scan(const char *){
+static bool browse(unsigned long deadline){
+	/* Run a browser until the loop is left or the deadline (ms, 0 : none)
+	 * <- false if Avahi can't be used
+	 */
 	AvahiClient *client = NULL;
 	AvahiServiceBrowser *sb = NULL;
+	bool ret = false;
 	int error;
 
-		/* Remove old references */
-	clean(&tahoma);
-	clean(&url);
+	pending = 0;
+	exhausted = false;
 
 		/* ***
 		 * Avahi listener 
@@ -160,21 +268,30 @@ void func_scan(const char *){
 	}
 
 		/* Create the service browser */
-	if(!(sb = avahi_service_browser_new(client, AVAHI_IF_UNSPEC, avahiIP, "_kizboxdev._tcp", NULL, 0, browse_callback, client))) {
+	if(!(sb = avahi_service_browser_new(client, AVAHI_IF_UNSPEC, avahiIP, SERVICE_TYPE, NULL, 0, browse_callback, client))) {
 		fprintf(stderr, "*E* Failed to create service browser: %s\n", avahi_strerror(avahi_client_errno(client)));
 		goto cleanup;
 	}
 
 		/* Wait for events */
-	avahi_simple_poll_loop(simple_poll);
-
-		/* The TaHoma may have been discovered : trying
-		 * to build connection informations
-		 */
-	buildURL();
+	if(!deadline)
+		avahi_simple_poll_loop(simple_poll);
+	else for(;;){
+		unsigned long now = nowms();
+		if(now >= deadline){
+			if(verbose || debug)
+				printf("*I* Scan deadline reached (%u resolution%s pending)\n", pending, pending > 1 ? "s":"");
+			break;
+		}
+		if(avahi_simple_poll_iterate(simple_poll, deadline - now))	/* Quit or failure */
+			break;
+	}
+	ret = true;
 
 cleanup:
-		/* Cleanup things */
+		/* Cleanup things
+		 * Notez-bien : the client frees resolvers still running.
+		 */
 	if (sb)
 		avahi_service_browser_free(sb);
 
@@ -183,4 +300,288 @@ cleanup:
 
 	if (simple_poll)
 		avahi_simple_poll_free(simple_poll);
+	simple_poll = NULL;
+
+	return ret;
+}
+
+void func_scan(const char *){
+		/* Remove old references */
+	clean(&tahoma);
+	clean(&url);
+
+	collecting = false;
+	if(browse(0) && tahoma){
+			/* The TaHoma has been discovered : trying
+			 * to build connection informations
+			 */
+		buildURL();
+		saveDiscovery();
+	}
+}
+
+void func_scanall(const char *arg){
+	unsigned int duration = arg ? atoi(arg) : SCAN_TIMEOUT;
+	if(!duration)
+		duration = SCAN_TIMEOUT;
+
+	freeResults();
+
+	unsigned long start = nowms();
+	collecting = true;
+	bool ok = browse(start + duration * 1000UL);
+	collecting = false;
+	if(!ok)
+		return;
+
+	printf("*I* %u gateway%s found in %lums\n", nresults, nresults > 1 ? "s":"", nowms() - start);
+	if(!nresults)
+		return;
+
+		/* Tab separated, to be easily scripted */
+	puts("name\thost\tport\taddresses\tfw_version\tgateway_pin\tapi_version");
+	for(unsigned int i = 0; i < nresults; ++i){
+		struct ScanResult *r = results + i;
+
+		printf("%s\t%s\t%u\t", r->name, r->host, r->port);
+		for(unsigned int j = 0; j < r->naddr; ++j)
+			printf("%s%s", j ? ",":"", r->addresses[j]);
+		printf("\t%s\t%s\t%s\n",
+			r->fw_version ? r->fw_version : "-",
+			r->gateway_pin ? r->gateway_pin : "-",
+			r->api_version ? r->api_version : "-"
+		);
+	}
+}
+
+	/* ***
+	 * Background watcher
+	 *
+	 * The browser is kept running, driven by backgroundTasks(). Resolvers
+	 * are kept as well : Avahi calls them again when the service's records
+	 * change, so any new address of the TaHoma is applied immediately
+	 * (running requests fail over to it, see APIrequest.c).
+	 * ***/
+
+#define WATCH_MAXRESOLVERS 8
+
+static AvahiSimplePoll *watch_poll = NULL;
+static AvahiClient *watch_client = NULL;
+static AvahiServiceBrowser *watch_browser = NULL;
+static bool watch_failed = false;	/* Avahi connection lost */
+
+static struct {
+	AvahiServiceResolver *r;
+	AvahiIfIndex interface;
+	AvahiProtocol protocol;
+	char *name;
+} watch_resolvers[WATCH_MAXRESOLVERS];
+
+static unsigned long nmoves = 0;	/* Address changes seen */
+
+static void forgetResolver(unsigned int i){
+	avahi_service_resolver_free(watch_resolvers[i].r);
+	watch_resolvers[i].r = NULL;
+	clean(&watch_resolvers[i].name);
+}
+
+static void watch_resolve_callback(
+	AvahiServiceResolver *r,
+	AvahiIfIndex interface,
+	AvahiProtocol protocol,
+	AvahiResolverEvent event,
+	const char *name,
+	const char *type,
+	const char *domain,
+	const char *host_name,
+	const AvahiAddress *address,
+	uint16_t aport,
+	AvahiStringList *txt,
+	AvahiLookupResultFlags flags,
+	void* userdata){
+	unsigned int slot = (uintptr_t)userdata;
+
+	if(event == AVAHI_RESOLVER_FAILURE){
+		if(debug)
+			printf("*D* (Watcher) Can't resolve '%s': %s\n", name, avahi_strerror(avahi_client_errno(watch_client)));
+		forgetResolver(slot);
+		return;
+	}
+
+	char a[AVAHI_ADDRESS_STR_MAX];
+	avahi_address_snprint(a, sizeof(a), address);
+
+	struct Gateway *gw = gatewayByHost(host_name);
+	if(!gw){
+		if(tahoma){	/* Unknown gateway */
+			if(debug)
+				printf("*D* (Watcher) '%s' ignored (%s)\n", host_name, a);
+			return;
+		}
+		gw = gateway;	/* Adopted by the current one */
+	}
+
+	struct Gateway *cur = gateway;
+	switchGateway(gw);
+
+	if(ip && !strcmp(ip, a) && port == aport){
+		if(debug)
+			printf("*D* (Watcher) '%s' still at %s:%u\n", host_name, a, aport);
+	} else {
+		printf("*I* TaHoma '%s' %s %s:%u\n", gw->name, ip ? "moved to" : "found at", a, aport);
+		++nmoves;
+
+		FreeAndSet(&tahoma, host_name);
+		FreeAndSet(&ip, a);
+		port = aport;
+		buildURL();
+		saveDiscovery();
+	}
+
+	switchGateway(cur);
+}
+
+static void watch_browse_callback(
+	AvahiServiceBrowser *b,
+	AvahiIfIndex interface,
+	AvahiProtocol protocol,
+	AvahiBrowserEvent event,
+	const char *name,
+	const char *type,
+	const char *domain,
+	AvahiLookupResultFlags flags,
+	void* userdata){
+	unsigned int i;
+
+	switch (event) {
+		case AVAHI_BROWSER_FAILURE:
+			fprintf(stderr, "*E* (Watcher) %s\n", avahi_strerror(avahi_client_errno(watch_client)));
+			watch_failed = true;
+			return;
+		case AVAHI_BROWSER_NEW: {
+			if(debug)
+				printf("*D* (Watcher) NEW: service '%s' (interface %d)\n", name, interface);
+
+			for(i = 0; i < WATCH_MAXRESOLVERS && watch_resolvers[i].r; ++i);
+			if(i == WATCH_MAXRESOLVERS){
+				fputs("*E* (Watcher) Too many services advertised\n", stderr);
+				return;
+			}
+
+				/* Stick to the family in use, avoiding to bounce b/w IPv4 and IPv6 */
+			AvahiProtocol aproto = avahiIP;
+			if(aproto == AVAHI_PROTO_UNSPEC)
+				aproto = (ip && strchr(ip, ':')) ? AVAHI_PROTO_INET6 : AVAHI_PROTO_INET;
+
+			if(!(watch_resolvers[i].r = avahi_service_resolver_new(watch_client, interface, protocol, name, type, domain, aproto, 0, watch_resolve_callback, (void *)(uintptr_t)i))){
+				fprintf(stderr, "*E* (Watcher) Failed to resolve service '%s': %s\n", name, avahi_strerror(avahi_client_errno(watch_client)));
+				return;
+			}
+			watch_resolvers[i].interface = interface;
+			watch_resolvers[i].protocol = protocol;
+			FreeAndSet(&watch_resolvers[i].name, name);
+			break;
+		}
+		case AVAHI_BROWSER_REMOVE:
+			if(verbose || debug)
+				printf("*I* (Watcher) '%s' not advertised anymore\n", name);
+
+			for(i = 0; i < WATCH_MAXRESOLVERS; ++i)
+				if(watch_resolvers[i].r && watch_resolvers[i].interface == interface && watch_resolvers[i].protocol == protocol && !strcmp(watch_resolvers[i].name, name))
+					forgetResolver(i);
+			break;
+		case AVAHI_BROWSER_ALL_FOR_NOW:
+		case AVAHI_BROWSER_CACHE_EXHAUSTED:
+			break;
+	}
+}
+
+static void watch_client_callback(AvahiClient *c, AvahiClientState state, AVAHI_GCC_UNUSED void * userdata) {
+	if (state == AVAHI_CLIENT_FAILURE) {
+		fprintf(stderr, "*E* (Watcher) Server connection failure: %s\n", avahi_strerror(avahi_client_errno(c)));
+		watch_failed = true;	/* Can't be freed from its own callback */
+	}
+}
+
+static void stopWatcher(void){
+		/* Notez-bien : the client frees its browser and resolvers */
+	if(watch_client)
+		avahi_client_free(watch_client);
+	watch_client = NULL;
+	watch_browser = NULL;
+
+	for(unsigned int i = 0; i < WATCH_MAXRESOLVERS; ++i){
+		watch_resolvers[i].r = NULL;
+		clean(&watch_resolvers[i].name);
+	}
+
+	if(watch_poll)
+		avahi_simple_poll_free(watch_poll);
+	watch_poll = NULL;
+	watch_failed = false;
+}
+
+static bool startWatcher(void){
+	int error;
+
+	if(!(watch_poll = avahi_simple_poll_new())){
+		fputs("*E* Failed to create simple poll object.\n", stderr);
+		return false;
+	}
+
+	if(!(watch_client = avahi_client_new(avahi_simple_poll_get(watch_poll), 0, watch_client_callback, NULL, &error))){
+		fprintf(stderr, "*E* Failed to create client: %s\n", avahi_strerror(error));
+		stopWatcher();
+		return false;
+	}
+
+	if(!(watch_browser = avahi_service_browser_new(watch_client, AVAHI_IF_UNSPEC, avahiIP, SERVICE_TYPE, NULL, 0, watch_browse_callback, NULL))){
+		fprintf(stderr, "*E* Failed to create service browser: %s\n", avahi_strerror(avahi_client_errno(watch_client)));
+		stopWatcher();
+		return false;
+	}
+
+	return true;
+}
+
+bool watcher_tick(void){
+	if(!watch_poll)
+		return false;
+
+	if(watch_failed){
+		fputs("*W* Avahi watcher stopped\n", stderr);
+		stopWatcher();
+		return false;
+	}
+
+		/* Dispatch what is ready, without waiting */
+	for(int i = 0; i < 4; ++i)
+		if(avahi_simple_poll_iterate(watch_poll, 0))
+			break;
+
+	return true;
+}
+
+void watcherReport(void){
+	if(!watch_poll)
+		return;
+
+	unsigned int nbre = 0;
+	for(unsigned int i = 0; i < WATCH_MAXRESOLVERS; ++i)
+		if(watch_resolvers[i].r)
+			++nbre;
+
+	printf("\tAvahi watcher : %u service%s followed, %lu address change%s\n", nbre, nbre > 1 ? "s":"", nmoves, nmoves > 1 ? "s":"");
+}
+
+void func_watch(const char *arg){
+	if(!arg)
+		printf("*I* Avahi watcher : %s\n", watch_poll ? "on" : "off");
+	else if(!strcmp(arg, "on")){
+		if(!watch_poll && startWatcher() && (verbose || debug))
+			puts("*I* Watching TaHoma's advertisements");
+	} else if(!strcmp(arg, "off"))
+		stopWatcher();
+	else
+		fputs("*E* on or off expected\n", stderr);
 }
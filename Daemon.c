@@ -0,0 +1,208 @@
+/* Daemon mode
+ *
+ * Keeps TaHomaCtl's context (CURL handle and its connection, devices' list, ...)
+ * alive and executes commands received through a local Unix socket.
+ *
+ * Protocol : a client connects, sends one or more command lines
+ * (using the same grammar as the interactive mode), then shuts down its
+ * writing side. Everything the commands are printing out (stdout and stderr)
+ * is sent back, then the connection is closed.
+ * Replies of coalesced commands are deferred : the connection is closed
+ * only once they have been sent.
+ * A client can't stop the daemon : Quit only ends its own session.
+ */
+
+#include "TaHomaCtl.h"
+#include "Daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+const char *daemon_socket = NULL;	/* Socket's path (default one if NULL) */
+bool daemon_serving = false;	/* stdout and stderr are redirected to a client */
+bool daemon_closing = false;	/* The client asked to end its session (Quit) */
+
+static char sockpath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int listenfd = -1;
+static volatile sig_atomic_t leaving = 0;
+
+static void daemon_cleanup(void){
+	if(listenfd != -1){
+		close(listenfd);
+		listenfd = -1;
+		unlink(sockpath);
+	}
+}
+
+static void daemon_signal(int){
+	leaving = 1;
+}
+
+static bool daemon_listen(void){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+
+		/* Is another daemon already listening ? */
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(probe == -1){
+		perror("socket()");
+		return false;
+	}
+
+	if(!connect(probe, (struct sockaddr *)&addr, sizeof(addr))){
+		fprintf(stderr, "*F* A daemon is already listening on '%s'\n", sockpath);
+		close(probe);
+		return false;
+	}
+	close(probe);
+	unlink(sockpath);	/* Remove stale socket, if any */
+
+	if((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+		perror("socket()");
+		return false;
+	}
+
+	mode_t old = umask(0077);	/* Only the owner can talk to us */
+	int res = bind(listenfd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old);
+
+	if(res == -1){
+		perror(sockpath);
+		close(listenfd);
+		listenfd = -1;
+		return false;
+	}
+
+	if(listen(listenfd, 8) == -1){
+		perror("listen()");
+		daemon_cleanup();
+		return false;
+	}
+
+	atexit(daemon_cleanup);
+	return true;
+}
+
+static void daemon_serve(int fd){
+		/* Don't let a stuck client freeze the daemon */
+	struct timeval tv = { 5, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	FILE *in = fdopen(fd, "r");
+	if(!in){
+		perror("fdopen()");
+		close(fd);
+		return;
+	}
+
+		/* Redirect outputs to the client */
+	fflush(stdout);
+	fflush(stderr);
+	int sout = dup(STDOUT_FILENO);
+	int serr = dup(STDERR_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	daemon_serving = true;
+	daemon_closing = false;
+
+	char *l = NULL;
+	size_t len = 0;
+	while(!daemon_closing && getline(&l, &len, in) != -1){
+		char *c = strchr(l, '\n');	// Remove leading CR
+		if(c)
+			*c = 0;
+
+		char *line;
+		for(line = l; *line && !isgraph(*line); ++line);	// Strip spaces
+
+		if(*line)	// Ignore empty line
+			execline(line);
+	}
+	free(l);
+
+		/* Restore outputs */
+	daemon_serving = false;
+	fflush(stdout);
+	fflush(stderr);
+	dup2(sout, STDOUT_FILENO);
+	dup2(serr, STDERR_FILENO);
+	close(sout);
+	close(serr);
+
+	fclose(in);
+}
+
+void daemon_loop(void){
+	if(daemon_socket){
+		if(strlen(daemon_socket) >= sizeof(sockpath)){
+			fputs("*F* Socket's path is too long\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		strcpy(sockpath, daemon_socket);
+	} else
+		defaultSocket(sockpath, sizeof(sockpath));
+
+	if(!daemon_listen())
+		exit(EXIT_FAILURE);
+
+	signal(SIGPIPE, SIG_IGN);	/* Clients may leave without reading the reply */
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;	/* No SA_RESTART : poll() has to be interrupted */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if(verbose || debug)
+		printf("*I* Daemon listening on '%s'\n", sockpath);
+
+	bool busy = backgroundTasks();
+	while(!leaving){
+		struct pollfd pfd = { listenfd, POLLIN, 0 };
+
+		int delay = busy ? 100 : -1;
+		long remaining = coalesce_remaining();
+		if(remaining != -1 && (delay == -1 || remaining < delay))
+			delay = remaining;
+
+		int res = poll(&pfd, 1, delay);
+		busy = backgroundTasks();
+
+		if(res == -1){
+			if(errno != EINTR)
+				perror("poll()");
+			continue;
+		}
+
+		if(pfd.revents & POLLIN){
+			int fd = accept(listenfd, NULL, NULL);
+			if(fd == -1){
+				if(errno != EINTR)
+					perror("accept()");
+				continue;
+			}
+
+			if(debug)
+				puts("*D* Client connected");
+			daemon_serve(fd);
+			busy = backgroundTasks();	/* The command may have started some */
+		}
+	}
+
+		/* Don't leave callers behind */
+	coalesce_flush();
+	pumpAPIAsync(true);
+
+	if(verbose || debug)
+		puts("*I* Daemon is leaving");
+}
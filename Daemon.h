@@ -0,0 +1,30 @@
+/* Daemon.h
+ *
+ *	Definitions shared by TaHomaCtl's daemon mode and its client.
+ *	Kept apart from TaHomaCtl.h as the client doesn't need any
+ *	3rd party library.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+	/* Default socket's location
+	 *	$XDG_RUNTIME_DIR/tahomactl.sock if the runtime directory exists,
+	 *	/tmp/tahomactl-<uid>.sock otherwise.
+	 */
+static inline const char *defaultSocket(char *buf, size_t len){
+	const char *rt = getenv("XDG_RUNTIME_DIR");
+
+	if(rt && *rt)
+		snprintf(buf, len, "%s/tahomactl.sock", rt);
+	else
+		snprintf(buf, len, "/tmp/tahomactl-%u.sock", (unsigned int)getuid());
+
+	return buf;
+}
+
+#endif
@@ -0,0 +1,333 @@
+/* Devices' cache
+ *
+ * scan_Devices is very resource-intensive for the TaHoma. Consequently,
+ * devices' definition is stored in a compact binary file which is
+ * memory-mapped at startup : no JSON parsing, strings are used directly
+ * from the mapping.
+ *
+ * File layout (native endianness, offsets from the beginning of the file) :
+ *	struct CacheHeader
+ *	struct CacheDevice[ndevices]
+ *	struct CacheCommand[ncommands]
+ *	struct CacheState[nstates]
+ *	strings (nul terminated)
+ *
+ * Each device's commands and states are stored sorted by name.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "TaHoDev"
+#define CACHE_VERSION 2
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;			/* Whole file's size */
+	int64_t created;		/* time_t */
+	uint32_t gateway;		/* TaHoma's hostname */
+	uint32_t ndevices;
+	uint32_t ncommands;
+	uint32_t nstates;
+};
+
+struct CacheDevice {
+	uint32_t label;
+	uint32_t url;
+	uint32_t escurl;
+	uint32_t commands;		/* Index of the first command */
+	uint32_t ncommands;
+	uint32_t states;		/* Index of the first state */
+	uint32_t nstates;
+};
+
+struct CacheCommand {
+	uint32_t name;
+	uint32_t nparams;
+};
+
+struct CacheState {
+	uint32_t name;
+};
+
+char *devices_cache = NULL;	/* Cache file, NULL if disabled */
+
+static void *map = NULL;	/* Mapped cache */
+static size_t mapsize = 0;
+
+void devcacheExchange(struct Gateway *gw){
+	SWAP(devices_cache, gw->devices_cache);
+	SWAP(map, gw->map);
+	SWAP(mapsize, gw->mapsize);
+}
+
+void releaseDevicesCache(void){
+	if(map){
+		munmap(map, mapsize);
+		map = NULL;
+		mapsize = 0;
+	}
+}
+
+	/*
+	 * Writing
+	 */
+
+struct strpool {
+	char *s;
+	size_t len;
+};
+
+static uint32_t addString(struct strpool *pool, size_t base, const char *str){
+	size_t l = strlen(str) + 1;
+
+	assert( (pool->s = realloc(pool->s, pool->len + l)) );
+	memcpy(pool->s + pool->len, str, l);
+	pool->len += l;
+
+	return base + pool->len - l;
+}
+
+void saveDevicesCache(void){
+	if(!devices_cache || !tahoma)
+		return;
+
+		/* Count objects */
+	struct CacheHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, CACHE_MAGIC);
+	hdr.version = CACHE_VERSION;
+	hdr.created = time(NULL);
+
+	for(struct Device *dev = devices_list; dev; dev = dev->next){
+		++hdr.ndevices;
+		hdr.ncommands += dev->ncommands;
+		hdr.nstates += dev->nstates;
+	}
+
+	size_t base = sizeof(struct CacheHeader) +
+		hdr.ndevices * sizeof(struct CacheDevice) +
+		hdr.ncommands * sizeof(struct CacheCommand) +
+		hdr.nstates * sizeof(struct CacheState);
+
+		/* Build tables */
+	struct CacheDevice *devs = calloc(hdr.ndevices ? hdr.ndevices : 1, sizeof(struct CacheDevice));
+	struct CacheCommand *cmds = calloc(hdr.ncommands ? hdr.ncommands : 1, sizeof(struct CacheCommand));
+	struct CacheState *sts = calloc(hdr.nstates ? hdr.nstates : 1, sizeof(struct CacheState));
+	assert(devs && cmds && sts);
+
+	struct strpool pool = { NULL, 0 };
+	hdr.gateway = addString(&pool, base, tahoma);
+
+	uint32_t idev = 0, icmd = 0, ist = 0;
+	for(struct Device *dev = devices_list; dev; dev = dev->next, ++idev){
+		devs[idev].label = addString(&pool, base, dev->label);
+		devs[idev].url = addString(&pool, base, dev->url);
+		devs[idev].escurl = addString(&pool, base, dev->escurl);
+
+		devs[idev].commands = icmd;
+		devs[idev].ncommands = dev->ncommands;
+		for(unsigned int i = 0; i < dev->ncommands; ++i, ++icmd){
+			cmds[icmd].name = addString(&pool, base, dev->commands[i].command);
+			cmds[icmd].nparams = dev->commands[i].nparams;
+		}
+
+		devs[idev].states = ist;
+		devs[idev].nstates = dev->nstates;
+		for(unsigned int i = 0; i < dev->nstates; ++i, ++ist)
+			sts[ist].name = addString(&pool, base, dev->states[i].state);
+	}
+	hdr.size = base + pool.len;
+
+		/* Write a temporary file, then replace the cache :
+		 * an existing mapping stays valid.
+		 */
+	char tmp[strlen(devices_cache) + 5];
+	sprintf(tmp, "%s.tmp", devices_cache);
+
+	FILE *f = fopen(tmp, "w");
+	if(!f){
+		perror(tmp);
+	} else {
+		bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+		if(hdr.ndevices)
+			ok = ok && fwrite(devs, sizeof(struct CacheDevice), hdr.ndevices, f) == hdr.ndevices;
+		if(hdr.ncommands)
+			ok = ok && fwrite(cmds, sizeof(struct CacheCommand), hdr.ncommands, f) == hdr.ncommands;
+		if(hdr.nstates)
+			ok = ok && fwrite(sts, sizeof(struct CacheState), hdr.nstates, f) == hdr.nstates;
+		ok = ok && fwrite(pool.s, 1, pool.len, f) == pool.len;
+
+		if(fclose(f) || !ok){
+			fprintf(stderr, "*E* Can't write '%s'\n", tmp);
+			unlink(tmp);
+		} else if(rename(tmp, devices_cache) == -1){
+			perror(devices_cache);
+			unlink(tmp);
+		} else if(debug || verbose)
+			printf("*I* %u devices cached in '%s' (%u bytes)\n", hdr.ndevices, devices_cache, hdr.size);
+	}
+
+	free(pool.s);
+	free(devs);
+	free(cmds);
+	free(sts);
+}
+
+	/*
+	 * Loading
+	 */
+
+static const char *mapString(uint32_t off){
+	/* Strings are checked to be inside the mapping
+	 * which ends with a nul.
+	 */
+	return off < mapsize ? (const char *)map + off : NULL;
+}
+
+bool loadDevicesCache(void){
+	if(!devices_cache)
+		return false;
+
+	int fd = open(devices_cache, O_RDONLY);
+	if(fd == -1){
+		if(debug)
+			perror(devices_cache);
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct CacheHeader)){
+		close(fd);
+		fprintf(stderr, "*E* '%s' is not a devices' cache\n", devices_cache);
+		return false;
+	}
+
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED){
+		perror("mmap()");
+		return false;
+	}
+
+		/* Sanity checks */
+	const struct CacheHeader *hdr = m;
+	const char *err = NULL;
+	size_t base = sizeof(struct CacheHeader) +
+		(size_t)hdr->ndevices * sizeof(struct CacheDevice) +
+		(size_t)hdr->ncommands * sizeof(struct CacheCommand) +
+		(size_t)hdr->nstates * sizeof(struct CacheState);
+
+	if(memcmp(hdr->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)))
+		err = "not a devices' cache";
+	else if(hdr->version != CACHE_VERSION)
+		err = "unsupported version";
+	else if(hdr->size != (uint64_t)st.st_size || base > hdr->size || hdr->gateway >= hdr->size || ((const char *)m)[hdr->size - 1])
+		err = "corrupted";
+	else if(tahoma && strcmp(tahoma, (const char *)m + hdr->gateway))
+		err = "made for another TaHoma";
+
+	if(err){
+		fprintf(stderr, "*E* '%s' : %s\n", devices_cache, err);
+		munmap(m, st.st_size);
+		return false;
+	}
+
+		/* Replace current devices */
+	freeDeviceList();
+	map = m;
+	mapsize = st.st_size;
+
+	const struct CacheDevice *devs = (const struct CacheDevice *)(hdr + 1);
+	const struct CacheCommand *cmds = (const struct CacheCommand *)(devs + hdr->ndevices);
+	const struct CacheState *sts = (const struct CacheState *)(cmds + hdr->ncommands);
+
+		/* The list is built by insertion at its head : go backward to
+		 * keep the original order.
+		 */
+	for(uint32_t i = hdr->ndevices; i--; ){
+		const struct CacheDevice *cd = devs + i;
+
+		if(cd->commands + cd->ncommands > hdr->ncommands || cd->states + cd->nstates > hdr->nstates ||
+		  !mapString(cd->label) || !mapString(cd->url) || !mapString(cd->escurl)){
+			fprintf(stderr, "*E* '%s' : device %u is corrupted\n", devices_cache, i);
+			continue;
+		}
+
+		struct Device *dev = arenaAlloc(&devices_arena, sizeof(struct Device));
+
+		dev->label = mapString(cd->label);
+		dev->url = mapString(cd->url);
+		dev->escurl = mapString(cd->escurl);
+
+		dev->commands = arenaAlloc(&devices_arena, cd->ncommands * sizeof(struct Command));
+		dev->ncommands = 0;
+		for(uint32_t j = 0; j < cd->ncommands; ++j){
+			const char *n = mapString(cmds[cd->commands + j].name);
+			if(!n)
+				continue;
+
+			dev->commands[dev->ncommands].command = n;
+			dev->commands[dev->ncommands++].nparams = cmds[cd->commands + j].nparams;
+		}
+
+		dev->states = arenaAlloc(&devices_arena, cd->nstates * sizeof(struct State));
+		dev->nstates = 0;
+		for(uint32_t j = 0; j < cd->nstates; ++j){
+			const char *n = mapString(sts[cd->states + j].name);
+			if(!n)
+				continue;
+
+			struct State *state = dev->states + dev->nstates++;
+			state->state = n;
+			state->value.type = 0;
+			state->updated = 0;
+		}
+
+		dev->next = devices_list;
+		devices_list = dev;
+	}
+
+	indexDevices();
+
+	if(debug || verbose){
+		char t[32];
+		time_t created = hdr->created;
+		strftime(t, sizeof(t), "%F %T", localtime(&created));
+		printf("*I* %u devices loaded from '%s' (cached on %s)\n", hdr->ndevices, devices_cache, t);
+	}
+
+	return true;
+}
+
+	/*
+	 * User command
+	 */
+
+void func_devcache(const char *arg){
+	if(!arg){
+		printf("*I* Devices' cache : %s", devices_cache ? devices_cache : "disabled");
+		if(map)
+			printf(" (devices loaded from it)");
+		putchar('\n');
+	} else if(!strcmp(arg, "off"))
+		clean(&devices_cache);
+	else if(!strcmp(arg, "drop")){	/* Invalidate */
+		if(devices_cache && unlink(devices_cache) == -1)
+			perror(devices_cache);
+	} else if(!strcmp(arg, "load")){
+		if(!loadDevicesCache())
+			fputs("*E* Devices' cache not loaded\n", stderr);
+	} else
+		FreeAndSet(&devices_cache, arg);
+}
@@ -0,0 +1,119 @@
+/* Devices' index
+ *
+ * Open addressing hash tables (linear probing) to find devices
+ * by label or by URL without walking devices_list, and sorted labels
+ * for completion.
+ * They are rebuilt each time devices_list is replaced.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct Device **bylabel = NULL;
+static struct Device **byurl = NULL;
+static size_t mask = 0;	/* Tables' size - 1 (size is a power of 2) */
+static const char **labels = NULL;	/* Sorted labels */
+static size_t nlabels = 0;
+
+static uint32_t hash(const char *s, size_t len){
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+
+	while(len--){
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+void dropDevicesIndex(void){
+	free(bylabel);
+	free(byurl);
+	bylabel = byurl = NULL;
+	mask = 0;
+
+	free(labels);
+	labels = NULL;
+	nlabels = 0;
+}
+
+static int cmplabel(const void *a, const void *b){
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+void indexDevices(void){
+	dropDevicesIndex();
+
+	size_t nbre = 0;
+	for(struct Device *dev = devices_list; dev; dev = dev->next)
+		++nbre;
+
+	size_t size = 16;
+	while(size < nbre * 2)	/* Keep load factor under 50% */
+		size <<= 1;
+	mask = size - 1;
+
+	assert( (bylabel = calloc(size, sizeof(struct Device *))) );
+	assert( (byurl = calloc(size, sizeof(struct Device *))) );
+	assert( (labels = malloc((nbre ? nbre : 1) * sizeof(const char *))) );
+
+	for(struct Device *dev = devices_list; dev; dev = dev->next){
+			/* In case of duplicates, the first one wins (as for the list) */
+		size_t i = hash(dev->label, strlen(dev->label)) & mask;
+		while(bylabel[i] && strcmp(bylabel[i]->label, dev->label))
+			i = (i + 1) & mask;
+		if(!bylabel[i]){
+			bylabel[i] = dev;
+			labels[nlabels++] = dev->label;
+		}
+
+		i = hash(dev->url, strlen(dev->url)) & mask;
+		while(byurl[i] && strcmp(byurl[i]->url, dev->url))
+			i = (i + 1) & mask;
+		if(!byurl[i])
+			byurl[i] = dev;
+	}
+
+	qsort(labels, nlabels, sizeof(const char *), cmplabel);
+
+	if(debug)
+		printf("*D* %lu devices indexed (%lu slots)\n", nbre, size);
+}
+
+struct Device *findDevice(struct substring *name){
+	if(bylabel)
+		for(size_t i = hash(name->s, name->len) & mask; bylabel[i]; i = (i + 1) & mask)
+			if(!substringcmp(name, bylabel[i]->label))
+				return bylabel[i];
+
+	return findGatewayDevice(name);	/* "gateway/label" ? */
+}
+
+struct Device *findDeviceByURL(const char *url){
+	if(!byurl)
+		return NULL;
+
+	for(size_t i = hash(url, strlen(url)) & mask; byurl[i]; i = (i + 1) & mask)
+		if(!strcmp(url, byurl[i]->url))
+			return byurl[i];
+
+	return NULL;
+}
+
+void indexExchange(struct Gateway *gw){
+	SWAP(bylabel, gw->bylabel);
+	SWAP(byurl, gw->byurl);
+	SWAP(mask, gw->mask);
+	SWAP(labels, gw->labels);
+	SWAP(nlabels, gw->nlabels);
+}
+
+const char **devicesLabels(size_t *nbre){
+	*nbre = nlabels;
+	return labels;
+}
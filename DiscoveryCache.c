@@ -0,0 +1,234 @@
+/* Discovery cache
+ *
+ * Waiting for TaHoma's advertisement may take minutes. The last discovered
+ * endpoint is stored in a small file with its discovery time. At startup,
+ * the known endpoint (from the configuration or this cache, if not older
+ * than discovery_ttl) is checked by a quick TCP connection : mDNS is only
+ * queried if it doesn't answer (as example, its DHCP lease changed).
+ *
+ * File layout (native endianness) : struct DiscoveryRecord
+ */
+
+#include "TaHomaCtl.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define DISCOVERY_MAGIC "TaHoDis"
+#define DISCOVERY_VERSION 1
+
+#define CHECK_TIMEOUT 500	/* TCP connection's check (ms) */
+#define PROBE_DURATION "3"	/* mDNS probing when the endpoint moved (seconds) */
+
+struct DiscoveryRecord {
+	char magic[8];
+	uint32_t version;
+	uint16_t port;
+	int64_t discovered;		/* time_t */
+	char host[256];
+	char ip[64];
+};
+
+char *discovery_cache = NULL;	/* Cache file, NULL if disabled */
+unsigned int discovery_ttl = 7*24*3600;	/* How long a cached endpoint is trusted (seconds) */
+
+void discoveryExchange(struct Gateway *gw){
+	SWAP(discovery_cache, gw->discovery_cache);
+}
+
+	/*
+	 * Storage
+	 */
+
+void saveDiscovery(void){
+	if(!discovery_cache || !tahoma || !ip || !port)
+		return;
+
+	struct DiscoveryRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	strcpy(rec.magic, DISCOVERY_MAGIC);
+	rec.version = DISCOVERY_VERSION;
+	rec.port = port;
+	rec.discovered = time(NULL);
+	if(strlen(tahoma) >= sizeof(rec.host) || strlen(ip) >= sizeof(rec.ip)){
+		fputs("*E* Discovered endpoint too long to be cached\n", stderr);
+		return;
+	}
+	strcpy(rec.host, tahoma);
+	strcpy(rec.ip, ip);
+
+		/* Write a temporary file, then replace the cache */
+	char tmp[strlen(discovery_cache) + 5];
+	sprintf(tmp, "%s.tmp", discovery_cache);
+
+	FILE *f = fopen(tmp, "w");
+	if(!f){
+		perror(tmp);
+		return;
+	}
+
+	bool ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+	if(fclose(f) || !ok){
+		fprintf(stderr, "*E* Can't write '%s'\n", tmp);
+		unlink(tmp);
+	} else if(rename(tmp, discovery_cache) == -1){
+		perror(discovery_cache);
+		unlink(tmp);
+	} else if(debug)
+		printf("*D* Endpoint %s:%u (%s) saved in '%s'\n", tahoma, port, ip, discovery_cache);
+}
+
+static bool loadDiscovery(struct DiscoveryRecord *rec){
+	/* <- true if a fresh endpoint has been read */
+	if(!discovery_cache)
+		return false;
+
+	FILE *f = fopen(discovery_cache, "r");
+	if(!f){
+		if(debug)
+			perror(discovery_cache);
+		return false;
+	}
+
+	bool ok = fread(rec, sizeof(struct DiscoveryRecord), 1, f) == 1;
+	fclose(f);
+
+	if(!ok || memcmp(rec->magic, DISCOVERY_MAGIC, sizeof(DISCOVERY_MAGIC)) || rec->version != DISCOVERY_VERSION
+	  || !memchr(rec->host, 0, sizeof(rec->host)) || !memchr(rec->ip, 0, sizeof(rec->ip))){
+		fprintf(stderr, "*E* '%s' is not a discovery cache\n", discovery_cache);
+		return false;
+	}
+
+	time_t age = time(NULL) - rec->discovered;
+	if(discovery_ttl && age > discovery_ttl){
+		if(verbose || debug)
+			printf("*I* Cached endpoint is outdated (%lds old)\n", (long)age);
+		return false;
+	}
+
+	return true;
+}
+
+	/*
+	 * Liveness check
+	 */
+
+static bool checkEndpoint(const char *addr, uint16_t aport){
+	/* Is something listening at this address ?
+	 * Only the TCP connection is done : the TLS handshake is left to
+	 * the 1st request (which may resume a cached session).
+	 */
+	struct addrinfo hints, *res;
+	char service[6];
+	bool ok = false;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	sprintf(service, "%u", aport);
+
+	if(getaddrinfo(addr, service, &hints, &res)){
+		fprintf(stderr, "*E* Invalid address '%s'\n", addr);
+		return false;
+	}
+
+	int fd = socket(res->ai_family, SOCK_STREAM, 0);
+	if(fd != -1){
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		if(!connect(fd, res->ai_addr, res->ai_addrlen))
+			ok = true;
+		else if(errno == EINPROGRESS){
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			int err;
+			socklen_t len = sizeof(err);
+
+			if(poll(&pfd, 1, CHECK_TIMEOUT) == 1 && !getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err)
+				ok = true;
+		}
+		close(fd);
+	}
+
+	freeaddrinfo(res);
+	return ok;
+}
+
+void checkDiscovery(void){
+	/* At startup : ensure the endpoint is still valid */
+	struct DiscoveryRecord rec;
+	bool cached = false;
+
+	if(!discovery_cache)
+		return;
+
+	if(!tahoma || !ip || !port){	/* Not (fully) configured */
+		if(!(cached = loadDiscovery(&rec)))
+			return;
+
+		if(!tahoma)
+			FreeAndSet(&tahoma, rec.host);
+		if(!ip)
+			FreeAndSet(&ip, rec.ip);
+		if(!port)
+			port = rec.port;
+	}
+
+	unsigned long start = nowms();
+	if(checkEndpoint(ip, port)){
+		if(verbose || debug)
+			printf("*I* TaHoma %s (%s:%u) answered in %lums\n", cached ? "from the cache" : "configured", ip, port, nowms() - start);
+		buildURL();
+		return;
+	}
+
+	if(verbose || debug)
+		printf("*I* TaHoma is not reachable at %s:%u : looking for it\n", ip, port);
+
+	char previous[strlen(ip) + 1];
+	uint16_t pport = port;
+	strcpy(previous, ip);
+
+	func_probe(PROBE_DURATION);
+	if(!strcmp(previous, ip) && pport == port){
+		fputs("*W* TaHoma not found elsewhere : its last known endpoint is kept, try scan_TaHoma\n", stderr);
+		buildURL();
+	}
+}
+
+	/*
+	 * User commands
+	 */
+
+void func_discache(const char *arg){
+	if(!arg){
+		printf("*I* Discovery cache : %s", discovery_cache ? discovery_cache : "disabled");
+		if(discovery_cache)
+			printf(" (trusted for %us)", discovery_ttl);
+		putchar('\n');
+	} else if(!strcmp(arg, "off"))
+		clean(&discovery_cache);
+	else if(!strcmp(arg, "drop")){	/* Invalidate */
+		if(discovery_cache && unlink(discovery_cache) == -1)
+			perror(discovery_cache);
+	} else
+		FreeAndSet(&discovery_cache, arg);
+}
+
+void func_disttl(const char *arg){
+	if(arg){
+		int v = atoi(arg);
+		if(v < 0)
+			fputs("*E* discovery_ttl can't be negative.\n", stderr);
+		else
+			discovery_ttl = v;
+	} else
+		printf("*I* Discovered endpoint trusted for %us%s\n", discovery_ttl, discovery_ttl ? "" : " (forever)");
+}
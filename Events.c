@@ -0,0 +1,349 @@
+/* Gateway's events
+ *
+ * Register an events listener on the TaHoma and fetch continuously
+ * its events. The listener expires if not fetched regularly : in such
+ * case, it is registered again automatically.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool listening = false;		/* Fetching events in background */
+unsigned int events_period = 2;	/* Delay b/w fetches (seconds) */
+
+static char *listener = NULL;	/* Listener's ID */
+static bool inflight = false;	/* A background request is running */
+static unsigned long lastfetch = 0;	/* When the last fetch has been issued (ms) */
+static unsigned long nevents = 0;	/* Number of received events */
+static unsigned long registered = 0;	/* When the listener has been registered (ms) */
+static unsigned long lastsuccess = 0;	/* Last successful fetch (ms) */
+
+static const struct {
+	const char *name;
+	enum EventType type;
+} EventTypes[] = {
+	{ "DeviceStateChangedEvent", EVT_DEVICESTATECHANGED },
+	{ "DeviceAvailableEvent", EVT_DEVICEAVAILABLE },
+	{ "DeviceUnavailableEvent", EVT_DEVICEUNAVAILABLE },
+	{ "DeviceCreatedEvent", EVT_DEVICECREATED },
+	{ "DeviceRemovedEvent", EVT_DEVICEREMOVED },
+	{ "ExecutionRegisteredEvent", EVT_EXECUTIONREGISTERED },
+	{ "ExecutionStateChangedEvent", EVT_EXECUTIONSTATECHANGED },
+	{ "CommandExecutionStateChangedEvent", EVT_COMMANDEXECUTIONSTATECHANGED },
+	{ "GatewayAliveEvent", EVT_GATEWAYALIVE },
+	{ "GatewayDownEvent", EVT_GATEWAYDOWN },
+	{ NULL, EVT_UNKNOWN }
+};
+
+void eventsExchange(struct Gateway *gw){
+	SWAP(listening, gw->listening);
+	SWAP(listener, gw->listener);
+	SWAP(inflight, gw->ev_inflight);
+	SWAP(lastfetch, gw->lastfetch);
+	SWAP(nevents, gw->nevents);
+	SWAP(registered, gw->registered);
+	SWAP(lastsuccess, gw->lastsuccess);
+}
+
+static enum EventType eventType(const char *name){
+	if(name)
+		for(int i = 0; EventTypes[i].name; ++i)
+			if(!strcmp(name, EventTypes[i].name))
+				return EventTypes[i].type;
+
+	return EVT_UNKNOWN;
+}
+
+	/*
+	 * Events' processing
+	 */
+
+static void printEvent(struct Event *evt){
+	printf("*I* %s", evt->name ? evt->name : "Unnamed event");
+	if(evt->deviceURL)
+		printf(" %s", evt->deviceURL);
+	if(evt->execId)
+		printf(" [%s]", evt->execId);
+	if(evt->oldState || evt->newState)
+		printf(" %s -> %s", evt->oldState ? evt->oldState : "?", evt->newState ? evt->newState : "?");
+	if(evt->gatewayId)
+		printf(" gateway %s", evt->gatewayId);
+	putchar('\n');
+
+	for(size_t i = 0; i < evt->nstates; ++i){
+		printf("\t%s : ", evt->states[i].name);
+		printStateValue(&evt->states[i].value);
+	}
+}
+
+static void dispatchEvent(struct Event *evt, bool print){
+	++nevents;
+
+	if(print)
+		printEvent(evt);
+
+		/* Refresh states' mirror */
+	if(evt->type == EVT_DEVICESTATECHANGED && evt->deviceURL){
+		struct Device *dev = findDeviceByURL(evt->deviceURL);
+		if(dev)
+			for(size_t i = 0; i < evt->nstates; ++i)
+				updateState(dev, evt->states[i].name, &evt->states[i].value);
+	}
+}
+
+static void decodeEvent(struct json_object *obj, bool print){
+	struct Event evt;
+	memset(&evt, 0, sizeof(evt));
+
+	evt.name = getObjString(obj, OBJPATH( "name", NULL ));
+	evt.type = eventType(evt.name);
+	evt.deviceURL = getObjString(obj, OBJPATH( "deviceURL", NULL ));
+	evt.execId = getObjString(obj, OBJPATH( "execId", NULL ));
+	evt.oldState = getObjString(obj, OBJPATH( "oldState", NULL ));
+	evt.newState = getObjString(obj, OBJPATH( "newState", NULL ));
+	evt.gatewayId = getObjString(obj, OBJPATH( "gatewayId", NULL ));
+
+	if(evt.type == EVT_DEVICESTATECHANGED){
+		struct json_object *lst = getObj(obj, OBJPATH( "deviceStates", NULL ));
+
+		if(isArrayObj(lst)){
+			size_t nbr = arrayLengthObj(lst);
+			struct EventState states[nbr ? nbr : 1];
+
+			for(size_t idx = 0; idx < nbr; ++idx){
+				struct json_object *st = arrayGetObj(lst, idx);
+				const char *n = st ? getObjString(st, OBJPATH( "name", NULL )) : NULL;
+
+				if(!n || !decodeStateValue(st, &states[evt.nstates].value)){
+					if(debug)
+						fprintf(stderr, "*E* [%s] Invalid state %ld\n", evt.deviceURL ? evt.deviceURL : "?", idx);
+					continue;
+				}
+				states[evt.nstates++].name = n;
+			}
+
+			evt.states = states;
+			dispatchEvent(&evt, print);
+			return;
+		}
+	}
+
+	dispatchEvent(&evt, print);
+}
+
+static void decodeEvents(const char *json, bool print){
+	struct json_object *res = parseJSON(json);
+
+	if(isArrayObj(res)){
+		size_t nbr = arrayLengthObj(res);
+		if(debug)
+			printf("*D* %ld event(s)\n", nbr);
+
+		for(size_t idx = 0; idx < nbr; ++idx){
+			struct json_object *obj = arrayGetObj(res, idx);
+			if(obj)
+				decodeEvent(obj, print);
+		}
+	} else
+		fputs("*E* Returned events are not an array\n", stderr);
+
+	releaseJSON(res);
+}
+
+	/*
+	 * Listener's handling
+	 */
+
+static bool storeListener(const char *json){
+	/* Extract listener's ID from register's response */
+	struct json_object *res = parseJSON(json);
+	const char *id = getObjString(res, OBJPATH( "id", NULL ));
+
+	if(id){
+		FreeAndSet(&listener, id);
+		registered = lastsuccess = nowms();
+		if(verbose || debug)
+			printf("*I* Events listener '%s' registered\n", listener);
+	} else
+		fputs("*E* No listener ID returned\n", stderr);
+
+	releaseJSON(res);
+	return !!id;
+}
+
+static void events_cleanup(void);
+
+static bool registerListener(void){
+	static bool atexitdone = false;
+	struct ResponseBuffer buff = {NULL};
+	bool ret = false;
+
+	if(!atexitdone){	/* Don't leave our listener behind */
+		atexit(events_cleanup);
+		atexitdone = true;
+	}
+
+	if(postAPI("events/register", "", &buff) == 200 && buff.memory)
+		ret = storeListener(buff.memory);
+	else
+		fputs("*E* Can't register an events listener\n", stderr);
+
+	freeResponse(&buff);
+	return ret;
+}
+
+static void unregisterListener(void){
+	if(!listener)
+		return;
+
+	char api[strlen("events//unregister") + strlen(listener) + 1];
+	sprintf(api, "events/%s/unregister", listener);
+
+	struct ResponseBuffer buff = {NULL};
+	postAPI(api, "", &buff);
+	freeResponse(&buff);
+
+	if(verbose || debug)
+		printf("*I* Events listener '%s' unregistered\n", listener);
+	clean(&listener);
+}
+
+static void listenerExpired(long http_code){
+	if(verbose || debug)
+		printf("*W* Events listener expired (HTTP %ld) : registering again\n", http_code);
+	clean(&listener);
+}
+
+	/* Background processing */
+static void registered_cb(struct APIRequest *req){
+	inflight = false;
+
+	if(req->res == CURLE_OK && req->http_code == 200 && req->buff.memory)
+		storeListener(req->buff.memory);
+	else
+		fprintf(stderr, "*E* Can't register an events listener (HTTP %ld)\n", req->http_code);
+}
+
+static void fetched_cb(struct APIRequest *req){
+	inflight = false;
+
+	if(req->res != CURLE_OK)
+		return;	/* Transport error : will be retried */
+
+	if(req->http_code >= 400 && req->http_code < 500)
+		listenerExpired(req->http_code);
+	else if(req->http_code == 200 && req->buff.memory){
+		lastsuccess = nowms();
+		decodeEvents(req->buff.memory, verbose || debug);
+	}
+}
+
+bool events_cover(unsigned long t){
+	/* Values got after the listener registration are kept up to date
+	 * as long as fetches are succeeding.
+	 */
+	if(!listening || !listener || t < registered)
+		return false;
+
+	return nowms() - lastsuccess <= 3 * events_period * 1000UL;
+}
+
+bool events_tick(void){
+	if(!listening)
+		return false;
+
+	if(inflight)
+		return true;
+
+	unsigned long now = nowms();
+	if(lastfetch && now - lastfetch < events_period * 1000UL)
+		return true;
+	lastfetch = now;
+
+	if(!listener)
+		inflight = callAPIAsync("events/register", "", registered_cb, NULL);
+	else {
+		char api[strlen("events//fetch") + strlen(listener) + 1];
+		sprintf(api, "events/%s/fetch", listener);
+
+		inflight = callAPIAsync(api, "", fetched_cb, NULL);
+	}
+
+	return true;
+}
+
+static bool unregisterEach(void){
+	unregisterListener();
+	return false;
+}
+
+static void events_cleanup(void){
+	forEachGateway(unregisterEach);	/* Each gateway has its own listener */
+}
+
+	/*
+	 * User commands
+	 */
+
+void func_Listen(const char *arg){
+	if(!arg){
+		printf("*I* Events listener : %s", listener ? listener : "not registered");
+		if(listening)
+			printf(", fetched every %us", events_period);
+		printf(", %lu event%s received\n", nevents, nevents > 1 ? "s":"");
+	} else if(!strcmp(arg, "on")){
+		if(!listener && !registerListener())
+			return;
+
+		listening = true;
+		lastfetch = 0;
+	} else if(!strcmp(arg, "off")){
+		listening = false;
+		pumpAPIAsync(true);	/* Wait for ongoing request */
+		unregisterListener();
+	} else
+		fputs("*E* Listen accepts only 'on' and 'off'\n", stderr);
+}
+
+void func_Events(const char *arg){
+	if(arg){
+		fputs("*E* Events doesn't expect an argument.\n", stderr);
+		return;
+	}
+
+	if(listening)
+		pumpAPIAsync(true);	/* Don't collide with background fetching */
+
+	if(!listener && !registerListener())
+		return;
+
+	char api[strlen("events//fetch") + strlen(listener) + 1];
+	sprintf(api, "events/%s/fetch", listener);
+
+	struct ResponseBuffer buff = {NULL};
+	long http_code = postAPI(api, "", &buff);
+
+	if(http_code >= 400 && http_code < 500){
+		listenerExpired(http_code);
+
+		if(registerListener()){
+			char api[strlen("events//fetch") + strlen(listener) + 1];
+			sprintf(api, "events/%s/fetch", listener);
+			http_code = postAPI(api, "", &buff);
+		}
+	}
+
+	if(debug)
+		printf("*D* Resp: '%s'\n", buff.memory ? buff.memory : "NULL data");
+
+	if(http_code == 200 && buff.memory){
+		lastsuccess = nowms();
+		decodeEvents(buff.memory, true);
+	}
+
+	freeResponse(&buff);
+}
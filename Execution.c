@@ -0,0 +1,524 @@
+/* Commands' execution
+ *
+ * Actions are sent to the TaHoma through exec/apply. Several actions
+ * (for many devices) can be collected in a batch and sent together in
+ * a single execution : the gateway schedules the radio frames itself.
+ *
+ * In daemon mode, Commands received within coalesce_window milliseconds
+ * are merged in a single execution as well. Each caller gets its reply
+ * (with the shared execution ID) when the execution is submitted.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct Action *batch = NULL, *batch_last = NULL;	/* Actions waiting for Batch_Run */
+static unsigned int batch_count = 0;
+static struct Gateway *batch_gateway;	/* The batch is sent to this gateway */
+
+unsigned int coalesce_window = 0;	/* Commands' coalescing delay (ms), 0 to disable */
+
+struct Coalesced {
+	struct Coalesced *next;
+	struct Action *act;
+	struct Gateway *gateway;	/* Where to send it */
+	int client;		/* Where to send the reply */
+};
+static struct Coalesced *held = NULL, *held_last = NULL;	/* Commands waiting for the window's end */
+static unsigned long held_since;	/* When the 1st one has been received (ms) */
+
+	/*
+	 * Actions' handling
+	 */
+
+void freeActions(struct Action *act){
+	while(act){
+		struct Action *next = act->next;
+
+		free(act->label);
+		free(act->url);
+		free(act->command);
+		free(act->params);
+		free(act);
+
+		act = next;
+	}
+}
+
+static char *addJSONString(char *json, const char *s, size_t len){
+	/* Append a quoted and escaped string */
+	char buf[len * 6 + 3], *p = buf;	/* Worst case : \u00xx */
+
+	*p++ = '"';
+	for(; len--; ++s){
+		switch(*s){
+		case '"':
+		case '\\':
+			*p++ = '\\';
+			*p++ = *s;
+			break;
+		case '\n':
+			*p++ = '\\';
+			*p++ = 'n';
+			break;
+		case '\t':
+			*p++ = '\\';
+			*p++ = 't';
+			break;
+		default:
+			if((unsigned char)*s < 0x20)
+				p += sprintf(p, "\\u%04x", (unsigned char)*s);
+			else
+				*p++ = *s;
+		}
+	}
+	*p++ = '"';
+	*p = 0;
+
+	return dynstringAdd(json, buf);
+}
+
+static char *addParameter(char *json, const char *s, size_t len){
+	/* Add an unquoted parameter, typed from its value :
+	 *	true/false -> boolean
+	 *	decimal number -> number
+	 *	otherwise -> string
+	 */
+	char tok[len + 1];
+	memcpy(tok, s, len);
+	tok[len] = 0;
+
+	if(!strcmp(tok, "true") || !strcmp(tok, "false"))
+		return dynstringAdd(json, tok);
+
+	if(isdigit((unsigned char)*tok) || ((*tok == '-' || *tok == '.') && len > 1)){
+		char *end;
+		double v = strtod(tok, &end);
+
+		if(!*end && isfinite(v) && !strpbrk(tok, "xXpP")){	/* No hexadecimal */
+			char num[32];
+			sprintf(num, "%.15g", v);
+			return dynstringAdd(json, num);
+		}
+	}
+
+	return addJSONString(json, s, len);
+}
+
+static char *parseParameters(const char *arg, unsigned int *nbre){
+	/* Convert blank separated arguments to a JSON list (without brackets).
+	 * Double quoted arguments are always strings.
+	 */
+	char *json = dynstringAdd(NULL, "");
+
+	*nbre = 0;
+	while(arg && *arg){
+		while(isblank((unsigned char)*arg))
+			++arg;
+		if(!*arg)
+			break;
+
+		if(*nbre)
+			json = dynstringAdd(json, ",");
+
+		if(*arg == '"'){
+			const char *end = strchr(++arg, '"');
+			size_t len = end ? (size_t)(end - arg) : strlen(arg);
+
+			json = addJSONString(json, arg, len);
+			arg += len;
+			if(end)
+				++arg;
+		} else {
+			size_t len = strcspn(arg, " \t");
+
+			json = addParameter(json, arg, len);
+			arg += len;
+		}
+
+		++*nbre;
+	}
+
+	return json;
+}
+
+struct Action *parseAction(const char *arg){
+	if(!arg){
+		fputs("*E* Expecting at least a device's name.\n", stderr);
+		return NULL;
+	}
+
+	struct substring devname, command;
+	const char *next;
+
+		/* Extract the device name */
+	extractTokenSub(&devname, arg, &next);
+
+	struct Device *dev = findDevice(&devname);
+	if(!dev){
+		fputs("*E* Device not found.\n", stderr);
+		return NULL;
+	}
+
+		/* Extract the command name */
+	if(!next || !*next){
+		fputs("*E* Missing command's name.\n", stderr);
+		return NULL;
+	}
+	extractTokenSub(&command, next, &next);
+
+	struct Command *cmd = deviceCommand(dev, &command);
+	if(!cmd){
+		fprintf(stderr, "*E* \"%.*s\" is not supported by \"%s\".\n", (int)command.len, command.s, dev->label);
+		return NULL;
+	}
+
+		/* Build the action
+		 * Notez-bien : the device is referenced by its label and URL,
+		 * not by its struct Device which is freed by scan_Devices.
+		 */
+	struct Action *act = calloc(1, sizeof(struct Action));
+	assert(act);
+
+	assert( (act->label = strdup(dev->label)) );
+	assert( (act->url = strdup(dev->url)) );
+	assert( (act->command = strdup(cmd->command)) );
+
+	unsigned int nparams;
+	act->params = parseParameters(next, &nparams);
+
+	if(nparams != cmd->nparams && (verbose || debug))
+		printf("*W* \"%s\" expects %u parameter%s, %u given\n", cmd->command, cmd->nparams, cmd->nparams > 1 ? "s":"", nparams);
+
+	return act;
+}
+
+char *execPayload(struct Action *list, const char *label){
+	/* Build exec/apply's JSON.
+	 * Actions targeting the same device are grouped in the same
+	 * element of "actions", in their original order.
+	 */
+	char *json = dynstringAdd(NULL, "{\"label\":");
+	json = addJSONString(json, label, strlen(label));
+	json = dynstringAdd(json, ",\"actions\":[");
+
+	for(struct Action *act = list; act; act = act->next){
+		bool done = false;	/* Device already emitted ? */
+		for(struct Action *prev = list; prev != act; prev = prev->next)
+			if(!strcmp(prev->url, act->url)){
+				done = true;
+				break;
+			}
+		if(done)
+			continue;
+
+		if(act != list)
+			json = dynstringAdd(json, ",");
+		json = dynstringAdd(json, "{\"deviceURL\":");
+		json = addJSONString(json, act->url, strlen(act->url));
+		json = dynstringAdd(json, ",\"commands\":[");
+
+		bool first = true;
+		for(struct Action *same = act; same; same = same->next){
+			if(strcmp(same->url, act->url))
+				continue;
+
+			if(!first)
+				json = dynstringAdd(json, ",");
+			first = false;
+
+			json = dynstringAdd(json, "{\"name\":");
+			json = addJSONString(json, same->command, strlen(same->command));
+			json = dynstringAdd(json, ",\"parameters\":[");
+			json = dynstringAdd(json, same->params);
+			json = dynstringAdd(json, "]}");
+		}
+
+		json = dynstringAdd(json, "]}");
+	}
+
+	return dynstringAdd(json, "]}");
+}
+
+static char *decodeExecId(long http_code, const char *resp, char *why, size_t len){
+	/* <- execId (to be freed), NULL on error
+	 * -> why : filled with the error's reason
+	 */
+	char *execId = NULL;
+
+	if(http_code == 200 && resp){
+		struct json_object *res = parseJSON(resp);
+		const char *id = getObjString(res, OBJPATH( "execId", NULL ));
+
+		if(id)
+			assert( (execId = strdup(id)) );
+		else
+			snprintf(why, len, "No execution ID returned");
+
+		releaseJSON(res);
+	} else if(resp)
+		snprintf(why, len, "Execution refused (HTTP %ld)\n*E* %s", http_code, resp);
+	else
+		snprintf(why, len, "Execution refused (HTTP %ld)", http_code);
+
+	return execId;
+}
+
+char *execApply(struct Action *list, const char *label){
+	char *payload = execPayload(list, label);
+	struct ResponseBuffer buff = {NULL};
+
+	long http_code = postAPI("exec/apply", payload, &buff);
+
+	if(debug)
+		printf("*D* Resp: '%s'\n", buff.memory ? buff.memory : "NULL data");
+
+	char why[1024];
+	char *execId = decodeExecId(http_code, buff.memory, why, sizeof(why));
+	if(!execId)
+		fprintf(stderr, "*E* %s\n", why);
+
+	freeResponse(&buff);
+	free(payload);
+
+	return execId;
+}
+
+	/*
+	 * Coalescing (daemon mode)
+	 */
+
+static void coalescedReply(struct Coalesced *c, const char *execId, const char *why, unsigned int nbre){
+	/* Send the reply and release the caller
+	 * -> why : error's reason, if any (execId is NULL)
+	 */
+	if(execId)
+		dprintf(c->client, "*I* Execution ID : %s (%s %s, %u action%s)\n", execId, c->act->label, c->act->command, nbre, nbre > 1 ? "s":"");
+	else {
+		if(why)
+			dprintf(c->client, "*E* %s\n", why);
+		dprintf(c->client, "*E* %s %s : execution failed\n", c->act->label, c->act->command);
+	}
+
+	close(c->client);
+	freeActions(c->act);
+	free(c);
+}
+
+static void coalesced_cb(struct APIRequest *req){
+	struct Coalesced *lst = req->data;
+	char *execId = NULL, why[1024];
+
+		/* Errors are for the callers, not the daemon's own stderr */
+	if(req->res == CURLE_OK)
+		execId = decodeExecId(req->http_code, req->buff.memory, why, sizeof(why));
+	else
+		snprintf(why, sizeof(why), "Calling error (exec/apply) : %s", curl_easy_strerror(req->res));
+
+	unsigned int nbre = 0;
+	for(struct Coalesced *c = lst; c; c = c->next)
+		++nbre;
+
+	if(verbose || debug)
+		printf("*I* %u coalesced action%s : %s\n", nbre, nbre > 1 ? "s":"", execId ? execId : "failed");
+
+	while(lst){
+		struct Coalesced *next = lst->next;
+		coalescedReply(lst, execId, why, nbre);
+		lst = next;
+	}
+
+	free(execId);
+}
+
+static void submitHeld(void){
+	/* Send held commands.
+	 * Notez-bien : an execution gets only one action per device,
+	 * others go to the following executions.
+	 */
+	while(held){
+		struct Coalesced *round = NULL, *round_last = NULL;
+		struct Coalesced **prev = &held;
+
+		held_last = NULL;
+		for(struct Coalesced *c = held; c; ){
+			struct Coalesced *next = c->next;
+			bool busy = false;	/* Device already in this round ? */
+
+			for(struct Coalesced *r = round; r; r = r->next)
+				if(r->gateway != c->gateway || !strcmp(r->act->url, c->act->url)){	/* An execution targets a single gateway */
+					busy = true;
+					break;
+				}
+
+			if(busy){	/* Kept for the next round */
+				held_last = c;
+				prev = &c->next;
+			} else {	/* Moved to this round */
+				*prev = next;
+				c->next = NULL;
+				if(round_last){
+					round_last->next = c;
+					round_last->act->next = c->act;
+				} else
+					round = c;
+				round_last = c;
+			}
+
+			c = next;
+		}
+
+		char *payload = execPayload(round->act, "TaHomaCtl coalesced");
+		struct Gateway *cur = gateway;
+		switchGateway(round->gateway);
+		bool ok = callAPIAsync("exec/apply", payload, coalesced_cb, round);
+		switchGateway(cur);
+		free(payload);
+
+			/* Each action is owned again by its own caller */
+		for(struct Coalesced *r = round; r; r = r->next)
+			r->act->next = NULL;
+
+		if(!ok)
+			while(round){
+				struct Coalesced *next = round->next;
+				coalescedReply(round, NULL, "Can't launch the request", 0);
+				round = next;
+			}
+	}
+}
+
+static void holdAction(struct Action *act){
+	struct Coalesced *c = malloc(sizeof(struct Coalesced));
+	assert(c);
+
+	c->next = NULL;
+	c->act = act;
+	c->gateway = gateway;	/* The device's one */
+	if((c->client = dup(STDOUT_FILENO)) == -1){	/* stdout is redirected to the caller */
+		perror("dup()");
+		free(c);
+		freeActions(act);
+		return;
+	}
+
+	if(!held)
+		held_since = nowms();
+
+	if(held_last)
+		held_last->next = c;
+	else
+		held = c;
+	held_last = c;
+}
+
+long coalesce_remaining(void){
+	if(!held)
+		return -1;
+
+	unsigned long spent = nowms() - held_since;
+	return spent >= coalesce_window ? 0 : coalesce_window - spent;
+}
+
+bool coalesce_tick(void){
+	if(!held)
+		return false;
+
+	if(!coalesce_remaining())
+		submitHeld();
+
+	return true;
+}
+
+void coalesce_flush(void){
+	submitHeld();
+}
+
+	/*
+	 * User commands
+	 */
+
+void func_Command(const char *arg){
+	struct Action *act = parseAction(arg);
+	if(!act)
+		return;
+
+	if(coalesce_window && daemon_serving){	/* Replied when submitted */
+		holdAction(act);
+		return;
+	}
+
+	char *execId = execApply(act, "TaHomaCtl");
+	if(execId){
+		printf("*I* Execution ID : %s\n", execId);
+		free(execId);
+	}
+
+	freeActions(act);
+}
+
+void func_BatchAdd(const char *arg){
+	struct Action *act = parseAction(arg);
+	if(!act)
+		return;
+
+	if(batch && batch_gateway != gateway){
+		fprintf(stderr, "*E* The batch targets gateway '%s'\n", batch_gateway->name);
+		freeActions(act);
+		return;
+	}
+	batch_gateway = gateway;
+
+	if(batch_last)
+		batch_last->next = act;
+	else
+		batch = act;
+	batch_last = act;
+	++batch_count;
+
+	if(verbose || debug)
+		printf("*I* %u action%s in the batch\n", batch_count, batch_count > 1 ? "s":"");
+}
+
+void func_BatchList(const char *){
+	if(!batch){
+		puts("*I* The batch is empty");
+		return;
+	}
+
+	for(struct Action *act = batch; act; act = act->next)
+		printf("%s : %s(%s)\n", act->label, act->command, act->params);
+}
+
+static void clearBatch(void){
+	freeActions(batch);
+	batch = batch_last = NULL;
+	batch_count = 0;
+}
+
+void func_BatchClear(const char *){
+	clearBatch();
+}
+
+void func_BatchRun(const char *arg){
+	if(!batch){
+		fputs("*E* The batch is empty\n", stderr);
+		return;
+	}
+
+	selectGateway(batch_gateway);
+	char *execId = execApply(batch, arg ? arg : "TaHomaCtl batch");
+	if(execId){
+		printf("*I* Execution ID : %s (%u action%s)\n", execId, batch_count, batch_count > 1 ? "s":"");
+		free(execId);
+		clearBatch();
+	} else
+		fputs("*E* The batch is kept, fix it or clear it\n", stderr);
+}
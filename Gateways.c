@@ -0,0 +1,176 @@
+/* Multiple gateways
+ *
+ * Each TaHoma is a context owning its connection's information, its
+ * devices (with their index and cache) and its events' listener. Modules
+ * keep working on their globals : switching to another gateway exchanges
+ * them with the ones stored in the gateway's context.
+ *
+ * Devices of any gateway are reachable as "gateway/label" : the command
+ * runs in the device's gateway, then the previous one is selected again.
+ * Asynchronous requests are launched and completed in the context they
+ * have been issued in, so requests to several gateways run concurrently.
+ *
+ * Notez-bien : the current gateway's storage is empty, everything
+ *	is in the globals.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static struct Gateway first = { .name = "default" };	/* Initial context */
+
+struct Gateway *gateways = &first;
+struct Gateway *gateway = &first;
+
+static struct Gateway *home = NULL;	/* Gateway to restore after the command, NULL if none */
+
+static void exchange(struct Gateway *gw){
+	SWAP(tahoma, gw->tahoma);
+	SWAP(ip, gw->ip);
+	SWAP(port, gw->port);
+	SWAP(token, gw->token);
+	SWAP(url, gw->url);
+	SWAP(url_len, gw->url_len);
+
+	connectionExchange(gw);
+	heartbeatExchange(gw);
+	devicesExchange(gw);
+	indexExchange(gw);
+	devcacheExchange(gw);
+	eventsExchange(gw);
+	discoveryExchange(gw);
+}
+
+void switchGateway(struct Gateway *gw){
+	if(gw == gateway)
+		return;
+
+	exchange(gateway);	/* Store the current one */
+	exchange(gw);		/* Load the new one */
+	gateway = gw;
+}
+
+void selectGateway(struct Gateway *gw){
+	/* Only until the end of the current command */
+	if(!home)
+		home = gateway;
+	switchGateway(gw);
+}
+
+void gatewayRestore(void){
+	if(home){
+		switchGateway(home);
+		home = NULL;
+	}
+}
+
+bool forEachGateway(bool (*func)(void)){
+	struct Gateway *cur = gateway;
+	bool ret = false;
+
+	for(struct Gateway *gw = gateways; gw; gw = gw->next){
+		switchGateway(gw);
+		ret |= func();
+	}
+	switchGateway(cur);
+
+	return ret;
+}
+
+static struct Gateway *findGateway(const char *name, size_t len){
+	for(struct Gateway *gw = gateways; gw; gw = gw->next)
+		if(strlen(gw->name) == len && !strncmp(gw->name, name, len))
+			return gw;
+
+	return NULL;
+}
+
+struct Gateway *gatewayByHost(const char *host){
+	for(struct Gateway *gw = gateways; gw; gw = gw->next){
+		const char *h = (gw == gateway) ? tahoma : gw->tahoma;
+		if(h && !strcasecmp(h, host))
+			return gw;
+	}
+
+	return NULL;
+}
+
+struct Device *findGatewayDevice(struct substring *name){
+	const char *sep = name->s ? memchr(name->s, '/', name->len) : NULL;
+	if(!sep)
+		return NULL;
+
+	struct Gateway *gw = findGateway(name->s, sep - name->s);
+	if(!gw)
+		return NULL;
+
+	struct substring label = { sep + 1, name->len - (sep - name->s) - 1 };
+	struct Gateway *cur = gateway;
+
+	switchGateway(gw);
+	struct Device *dev = findDevice(&label);
+	switchGateway(cur);
+
+	if(dev)
+		selectGateway(gw);
+
+	return dev;
+}
+
+static struct Gateway *newGateway(const char *name){
+	struct Gateway *gw = calloc(1, sizeof(struct Gateway));
+	assert(gw);
+	assert( (gw->name = strdup(name)) );
+
+		/* Its own devices' cache, next to the default one */
+	const char *base = (gateway == &first) ? devices_cache : first.devices_cache;
+	if(base){
+		assert( (gw->devices_cache = malloc(strlen(base) + strlen(name) + 2)) );
+		sprintf(gw->devices_cache, "%s.%s", base, name);
+	}
+
+	struct Gateway **last = &gateways;
+	while(*last)
+		last = &(*last)->next;
+	*last = gw;
+
+	return gw;
+}
+
+	/*
+	 * User command
+	 */
+
+void func_gateway(const char *arg){
+	if(!arg){
+		for(struct Gateway *gw = gateways; gw; gw = gw->next){
+			const char *h = (gw == gateway) ? tahoma : gw->tahoma;
+			printf("%c %s : %s\n", gw == gateway ? '*':' ', gw->name, h ? h : "not set");
+		}
+		return;
+	}
+
+	if(strchr(arg, '/') || strchr(arg, ' ')){
+		fputs("*E* A gateway's name can't contain '/' or spaces\n", stderr);
+		return;
+	}
+
+	struct Gateway *gw = findGateway(arg, strlen(arg));
+	bool created = !gw;
+	if(created)
+		gw = newGateway(arg);
+
+	home = NULL;	/* Permanent */
+	switchGateway(gw);
+
+	if(created){
+		if(verbose || debug)
+			printf("*I* Gateway '%s' created\n", gw->name);
+		loadDevicesCache();
+	}
+}
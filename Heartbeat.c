@@ -0,0 +1,140 @@
+/* Keep warm heartbeat
+ *
+ * The TaHoma may take a very long time to answer a request after
+ * being idle, then answers quickly. When enabled, a cheap request
+ * (apiVersion) is sent in background when no request has been done
+ * for a while, keeping the connection (shared by all easy handles)
+ * and the gateway warm.
+ *
+ * The interval is adaptive : it doubles (up to keepwarm_max) while
+ * probes are answered as fast as usual and falls back when a probe is
+ * clearly slower (the gateway started to cool down).
+ *
+ * Each gateway has its own heartbeat, exchanged as the other per
+ * gateway globals.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KW_MIN 5		/* Shortest interval (seconds) */
+#define KW_MAX 110		/* libcurl closes connections idle for more than 118s */
+
+unsigned int keepwarm_max = 0;	/* Longest interval b/w probes (seconds), 0 : disabled */
+
+static struct Heartbeat hb = { KW_MIN };	/* Current gateway's */
+
+void heartbeatExchange(struct Gateway *gw){
+	SWAP(hb, gw->heartbeat);
+}
+
+static void probe_cb(struct APIRequest *req){
+	hb.inflight = false;
+
+	if(req->res != CURLE_OK || req->http_code != 200){
+		++hb.nfailed;
+		hb.interval = KW_MIN;
+		if(debug)
+			printf("*D* Heartbeat of '%s' failed (HTTP %ld)\n", gateway->name, req->http_code);
+		return;
+	}
+
+	double rtt = req->elapsed * 1e3;
+
+	if(hb.nprobes){
+		hb.jitter += (fabs(rtt - hb.last_rtt) - hb.jitter) / 16;	/* Mean deviation b/w consecutive probes */
+
+		if(rtt > hb.srtt * 3 && rtt - hb.srtt > 200){	/* Cooling down */
+			hb.interval /= 2;
+			if(hb.interval < KW_MIN)
+				hb.interval = KW_MIN;
+		} else if(hb.interval < keepwarm_max){	/* Still warm */
+			hb.interval *= 2;
+			if(hb.interval > keepwarm_max)
+				hb.interval = keepwarm_max;
+		}
+
+		hb.srtt += (rtt - hb.srtt) / 8;
+	} else
+		hb.srtt = rtt;
+
+	hb.last_rtt = rtt;
+	++hb.nprobes;
+
+	if(debug)
+		printf("*D* Heartbeat of '%s' : %.1fms (smoothed %.1fms, jitter %.1fms), next in %us\n", gateway->name, rtt, hb.srtt, hb.jitter, hb.interval);
+}
+
+bool heartbeat_tick(void){
+	/* Notez-bien : called for each gateway, in its context */
+	if(!keepwarm_max)
+		return false;
+
+	if(!url)	/* Not configured */
+		return false;
+
+	if(hb.inflight)
+		return true;
+
+	if(!hb.interval)	/* Gateway added afterward */
+		hb.interval = KW_MIN;
+
+	if(nowms() - api_activity < hb.interval * 1000UL)	/* Recently used */
+		return true;
+
+	hb.inflight = callAPIAsync("apiVersion", NULL, probe_cb, NULL);
+	if(!hb.inflight)	/* Connection's information are missing : retry later */
+		api_activity = nowms();
+
+	return true;
+}
+
+void heartbeatReport(void){
+	if(!keepwarm_max)
+		return;
+
+	printf("\tKeep warm : every %us (up to %us), %lu probe%s", hb.interval ? hb.interval : KW_MIN, keepwarm_max, hb.nprobes, hb.nprobes > 1 ? "s":"");
+	if(hb.nfailed)
+		printf(", %lu failed", hb.nfailed);
+	if(hb.nprobes)
+		printf(", RTT %.1fms (smoothed %.1fms), jitter %.1fms", hb.last_rtt, hb.srtt, hb.jitter);
+	putchar('\n');
+}
+
+static bool restart(void){
+	hb.interval = KW_MIN;
+	return false;
+}
+
+	/*
+	 * User command
+	 */
+
+void func_keepwarm(const char *arg){
+	if(!arg){
+		if(keepwarm_max)
+			heartbeatReport();
+		else
+			puts("*I* Keep warm disabled");
+		return;
+	}
+
+	int v = atoi(arg);
+	if(!strcmp(arg, "off") || !v)
+		keepwarm_max = 0;
+	else if(v < KW_MIN)
+		fprintf(stderr, "*E* keep_warm expects at least %us\n", KW_MIN);
+	else {
+		if(v > KW_MAX){
+			fprintf(stderr, "*W* keep_warm limited to %us\n", KW_MAX);
+			v = KW_MAX;
+		}
+
+		keepwarm_max = v;
+		forEachGateway(restart);
+	}
+}
@@ -0,0 +1,527 @@
+/* JSON structural index
+ *
+ * Alternative JSON backend, for big responses (setup/devices) :
+ *	1/ structural characters ({}[]:, and strings' opening quotes) are
+ *	located 64 bytes at a time using SIMD instructions (SSE2 or AVX2 on x86,
+ *	NEON on ARM64, scalar fallback otherwise),
+ *	2/ a tape of values is built from them : each container knows where it
+ *	ends, so siblings are skipped without walking their content,
+ *	3/ strings and numbers are decoded only when accessed.
+ *
+ * Values are handled as opaque struct json_object * (pointing to the tape)
+ * so the same accessors are used whatever the backend.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#	if defined(__GNUC__) && defined(__x86_64__)
+#		define JI_AVX2	/* Selected at run time */
+#	endif
+#elif defined(__aarch64__)
+#	include <arm_neon.h>
+#	define JI_NEON
+#endif
+
+#define JI_MAXDEPTH 256
+
+struct JNode {
+	const char *p;		/* Value's beginning (decoded string once accessed) */
+	uint32_t skip;		/* Number of nodes of this value (itself included) */
+	uint32_t count;		/* Containers : number of elements */
+	uint32_t cacheidx;	/* Arrays : last accessed element ... */
+	uint32_t cacheoff;	/* ... and its offset (0 if none) */
+	uint8_t type;		/* enum JSONType */
+	bool decoded;		/* Strings : p points to the decoded value */
+};
+
+struct JDoc {
+	char *buf;			/* Private copy of the JSON (strings are decoded in place) */
+	size_t nnodes;
+	struct JNode nodes[];
+};
+
+	/*
+	 * Stage 1 : structural characters
+	 */
+
+struct Masks {	/* 1 bit per byte of a 64 bytes block */
+	uint64_t quote;
+	uint64_t bslash;
+	uint64_t structural;
+};
+
+enum { CQUOTE = 1, CBSLASH = 2, CSTRUCT = 4 };
+static const uint8_t charclass[256] = {
+	['"'] = CQUOTE, ['\\'] = CBSLASH,
+	['{'] = CSTRUCT, ['}'] = CSTRUCT, ['['] = CSTRUCT, [']'] = CSTRUCT,
+	[':'] = CSTRUCT, [','] = CSTRUCT
+};
+
+static void classify_scalar(const uint8_t *p, struct Masks *m){
+	m->quote = m->bslash = m->structural = 0;
+
+	for(int i = 0; i < 64; ++i){
+		uint8_t c = charclass[p[i]];
+		uint64_t bit = 1ULL << i;
+
+		if(c & CQUOTE)
+			m->quote |= bit;
+		else if(c & CBSLASH)
+			m->bslash |= bit;
+		else if(c & CSTRUCT)
+			m->structural |= bit;
+	}
+}
+
+	/* Notez-bien : '[' | 0x20 == '{' and ']' | 0x20 == '}', and no other
+	 * character gives them : brackets are found with 2 comparisons.
+	 */
+#ifdef __SSE2__
+static void classify_sse2(const uint8_t *p, struct Masks *m){
+	const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+	const __m128i lower = _mm_set1_epi8(0x20), open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+	const __m128i colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(',');
+
+	m->quote = m->bslash = m->structural = 0;
+
+	for(int i = 0; i < 4; ++i){
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+		__m128i l = _mm_or_si128(v, lower);
+		__m128i s = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(l, open), _mm_cmpeq_epi8(l, close)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma))
+		);
+
+		m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << (16 * i);
+		m->bslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bslash)) << (16 * i);
+		m->structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << (16 * i);
+	}
+}
+#endif
+
+#ifdef JI_AVX2
+__attribute__((target("avx2")))
+static void classify_avx2(const uint8_t *p, struct Masks *m){
+	const __m256i quote = _mm256_set1_epi8('"'), bslash = _mm256_set1_epi8('\\');
+	const __m256i lower = _mm256_set1_epi8(0x20), open = _mm256_set1_epi8('{'), close = _mm256_set1_epi8('}');
+	const __m256i colon = _mm256_set1_epi8(':'), comma = _mm256_set1_epi8(',');
+
+	m->quote = m->bslash = m->structural = 0;
+
+	for(int i = 0; i < 2; ++i){
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+		__m256i l = _mm256_or_si256(v, lower);
+		__m256i s = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(l, open), _mm256_cmpeq_epi8(l, close)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, comma))
+		);
+
+		m->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)) << (32 * i);
+		m->bslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bslash)) << (32 * i);
+		m->structural |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << (32 * i);
+	}
+}
+#endif
+
+#ifdef JI_NEON
+static inline uint64_t neon_movemask(uint8x16_t v){
+	/* 1 bit per byte (bytes are 0x00 or 0xff) */
+	const uint8x16_t bits = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t t = vandq_u8(v, bits);
+
+	t = vpaddq_u8(t, t);
+	t = vpaddq_u8(t, t);
+	t = vpaddq_u8(t, t);
+	return vgetq_lane_u16(vreinterpretq_u16_u8(t), 0);
+}
+
+static void classify_neon(const uint8_t *p, struct Masks *m){
+	const uint8x16_t quote = vdupq_n_u8('"'), bslash = vdupq_n_u8('\\');
+	const uint8x16_t lower = vdupq_n_u8(0x20), open = vdupq_n_u8('{'), close = vdupq_n_u8('}');
+	const uint8x16_t colon = vdupq_n_u8(':'), comma = vdupq_n_u8(',');
+
+	m->quote = m->bslash = m->structural = 0;
+
+	for(int i = 0; i < 4; ++i){
+		uint8x16_t v = vld1q_u8(p + 16 * i);
+		uint8x16_t l = vorrq_u8(v, lower);
+		uint8x16_t s = vorrq_u8(
+			vorrq_u8(vceqq_u8(l, open), vceqq_u8(l, close)),
+			vorrq_u8(vceqq_u8(v, colon), vceqq_u8(v, comma))
+		);
+
+		m->quote |= neon_movemask(vceqq_u8(v, quote)) << (16 * i);
+		m->bslash |= neon_movemask(vceqq_u8(v, bslash)) << (16 * i);
+		m->structural |= neon_movemask(s) << (16 * i);
+	}
+}
+#endif
+
+static void (*classify)(const uint8_t *, struct Masks *) = NULL;
+const char *json_simd = NULL;	/* Flavour used to find structural characters */
+
+static void selectClassifier(void){
+	classify = classify_scalar;
+	json_simd = "scalar";
+
+#ifdef __SSE2__
+	classify = classify_sse2;
+	json_simd = "SSE2";
+#endif
+#ifdef JI_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		classify = classify_avx2;
+		json_simd = "AVX2";
+	}
+#endif
+#ifdef JI_NEON
+	classify = classify_neon;
+	json_simd = "NEON";
+#endif
+}
+
+static uint32_t *structurals(const char *buf, size_t len, size_t *nbre){
+	/* <- positions of structural characters outside strings
+	 * and of strings' opening quote, NULL if invalid
+	 */
+	size_t cap = len / 8 + 16;
+	uint32_t *res = malloc(cap * sizeof(uint32_t));
+	assert(res);
+
+	bool instring = false;
+	size_t escaped = (size_t)-1;	/* Position of the escaped character */
+
+	*nbre = 0;
+	for(size_t base = 0; base < len; base += 64){
+		const uint8_t *p = (const uint8_t *)buf + base;
+		uint8_t tail[64];
+		struct Masks m;
+
+		if(len - base < 64){	/* Padded with spaces */
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, p, len - base);
+			p = tail;
+		}
+		classify(p, &m);
+
+		uint64_t cand = m.quote | m.bslash | m.structural;
+		while(cand){
+			int i = __builtin_ctzll(cand);
+			uint64_t bit = 1ULL << i;
+			size_t pos = base + i;
+			cand &= cand - 1;
+
+			if(pos == escaped)
+				continue;
+
+			if(m.bslash & bit){
+				if(instring)
+					escaped = pos + 1;
+				continue;
+			}
+
+			if(m.quote & bit){
+				instring = !instring;
+				if(!instring)	/* Closing quote */
+					continue;
+			} else if(instring)	/* Structural inside a string */
+				continue;
+
+			if(*nbre == cap){
+				cap *= 2;
+				assert( (res = realloc(res, cap * sizeof(uint32_t))) );
+			}
+			res[(*nbre)++] = pos;
+		}
+	}
+
+	if(instring){
+		free(res);
+		return NULL;
+	}
+	return res;
+}
+
+	/*
+	 * Stage 2 : tape
+	 */
+
+static const char *skipBlank(const char *p){
+	while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		++p;
+	return p;
+}
+
+static bool addScalar(struct JDoc *doc, const char *p, uint32_t *stack, int sp){
+	/* Add the scalar starting at p, if any
+	 * <- false if there is none
+	 */
+	p = skipBlank(p);
+	if(!*p || strchr("\"{[]},:", *p))
+		return false;
+
+	struct JNode *n = doc->nodes + doc->nnodes++;
+	memset(n, 0, sizeof(struct JNode));
+	n->p = p;
+	n->skip = 1;
+	n->type = *p == 't' ? JSON_TRUE : *p == 'f' ? JSON_FALSE : *p == 'n' ? JSON_NULL : JSON_NUMBER;
+
+	if(sp)
+		++doc->nodes[stack[sp - 1]].count;
+	return true;
+}
+
+struct json_object *jindexParse(const char *json, size_t len){
+	if(!classify)
+		selectClassifier();
+
+	size_t n;
+	uint32_t *s = structurals(json, len, &n);
+	if(!s)
+		return NULL;
+
+	struct JDoc *doc = malloc(sizeof(struct JDoc) + (2 * n + 2) * sizeof(struct JNode));
+	assert(doc);
+	assert( (doc->buf = malloc(len + 1)) );
+	memcpy(doc->buf, json, len);
+	doc->buf[len] = 0;
+	doc->nnodes = 0;
+
+	uint32_t stack[JI_MAXDEPTH];
+	int sp = 0;
+	bool ok = true;
+
+	if(!n || doc->buf[s[0]] == '"')	/* Top level scalar */
+		ok = (n <= 1) && (n || addScalar(doc, doc->buf, stack, 0));
+
+	for(size_t k = 0; ok && k < n; ++k){
+		const char *p = doc->buf + s[k];
+		struct JNode *node;
+
+		switch(*p){
+		case '{':
+		case '[':
+			if(sp == JI_MAXDEPTH || (!sp && k)){	/* Too deep or several roots */
+				ok = false;
+				break;
+			}
+			if(sp)
+				++doc->nodes[stack[sp - 1]].count;
+
+			node = doc->nodes + doc->nnodes;
+			memset(node, 0, sizeof(struct JNode));
+			node->p = p;
+			node->type = *p == '{' ? JSON_OBJECT : JSON_ARRAY;
+			stack[sp++] = doc->nnodes++;
+
+			if(*p == '[')
+				addScalar(doc, p + 1, stack, sp);
+			break;
+		case '}':
+		case ']':
+			if(!sp || doc->nodes[stack[sp - 1]].type != (*p == '}' ? JSON_OBJECT : JSON_ARRAY)){
+				ok = false;
+				break;
+			}
+			--sp;
+			doc->nodes[stack[sp]].skip = doc->nnodes - stack[sp];
+			break;
+		case '"':
+			node = doc->nodes + doc->nnodes++;
+			memset(node, 0, sizeof(struct JNode));
+			node->p = p;
+			node->skip = 1;
+			node->type = JSON_STRING;
+
+				/* Keys are followed by ':' and are not counted */
+			if(sp && !(k + 1 < n && doc->buf[s[k + 1]] == ':'))
+				++doc->nodes[stack[sp - 1]].count;
+			break;
+		case ':':
+		case ',':
+			addScalar(doc, p + 1, stack, sp);
+			break;
+		}
+	}
+	free(s);
+
+	if(!ok || sp || !doc->nnodes){
+		free(doc->buf);
+		free(doc);
+		return NULL;
+	}
+
+	return (struct json_object *)doc->nodes;
+}
+
+void jindexRelease(struct json_object *root){
+	if(!root)
+		return;
+
+	struct JDoc *doc = (struct JDoc *)((char *)root - offsetof(struct JDoc, nodes));
+	free(doc->buf);
+	free(doc);
+}
+
+	/*
+	 * Accessors
+	 */
+
+static const char *nodeString(struct JNode *n){
+	/* Decode the string in place (the result is never longer than its source) */
+	if(n->decoded)
+		return n->p;
+
+	const char *src = n->p + 1;	/* Skip the opening quote */
+	char *dst = (char *)n->p, *res = dst;
+
+	while(*src && *src != '"'){
+		if(*src != '\\'){
+			*dst++ = *src++;
+			continue;
+		}
+
+		switch(*++src){
+		case 'b': *dst++ = '\b'; break;
+		case 'f': *dst++ = '\f'; break;
+		case 'n': *dst++ = '\n'; break;
+		case 'r': *dst++ = '\r'; break;
+		case 't': *dst++ = '\t'; break;
+		case 'u': {
+				unsigned int c = 0;
+				int i;
+				for(i = 1; i <= 4 && src[i]; ++i){
+					char h = src[i];
+					c = (c << 4) | (h >= '0' && h <= '9' ? h - '0' : ((h | 0x20) - 'a' + 10));
+				}
+				src += i - 1;
+
+				if(c < 0x80)
+					*dst++ = c;
+				else if(c < 0x800){
+					*dst++ = 0xc0 | (c >> 6);
+					*dst++ = 0x80 | (c & 0x3f);
+				} else {
+					*dst++ = 0xe0 | (c >> 12);
+					*dst++ = 0x80 | ((c >> 6) & 0x3f);
+					*dst++ = 0x80 | (c & 0x3f);
+				}
+			}
+			break;
+		case 0:
+			continue;
+		default:	/* ", \, / */
+			*dst++ = *src;
+		}
+		++src;
+	}
+	*dst = 0;
+
+	n->p = res;
+	n->decoded = true;
+	return res;
+}
+
+enum JSONType jindexType(struct json_object *obj){
+	return ((struct JNode *)obj)->type;
+}
+
+struct json_object *jindexGet(struct json_object *obj, const char *key){
+	struct JNode *n = (struct JNode *)obj;
+
+	if(!n || n->type != JSON_OBJECT)
+		return NULL;
+
+	for(struct JNode *k = n + 1; k < n + n->skip; k = k + 1 + k[1].skip)
+		if(!strcmp(nodeString(k), key))
+			return (struct json_object *)(k + 1);
+
+	return NULL;
+}
+
+bool jindexForEach(struct json_object *obj, bool (*func)(const char *, struct json_object *, void *), void *data){
+	struct JNode *n = (struct JNode *)obj;
+
+	if(!n || n->type != JSON_OBJECT)
+		return true;
+
+	for(struct JNode *k = n + 1; k < n + n->skip; k = k + 1 + k[1].skip)
+		if(!func(nodeString(k), (struct json_object *)(k + 1), data))
+			return false;
+
+	return true;
+}
+
+size_t jindexLength(struct json_object *obj){
+	struct JNode *n = (struct JNode *)obj;
+
+	return (n && n->type == JSON_ARRAY) ? n->count : 0;
+}
+
+struct json_object *jindexIdx(struct json_object *obj, size_t idx){
+	/* Sequential accesses restart from the previous element */
+	struct JNode *n = (struct JNode *)obj;
+
+	if(!n || n->type != JSON_ARRAY || idx >= n->count)
+		return NULL;
+
+	size_t i = 0;
+	struct JNode *e = n + 1;
+	if(n->cacheoff && n->cacheidx <= idx){
+		i = n->cacheidx;
+		e = n + n->cacheoff;
+	}
+
+	for(; i < idx; ++i)
+		e += e->skip;
+
+	n->cacheidx = idx;
+	n->cacheoff = e - n;
+	return (struct json_object *)e;
+}
+
+const char *jindexString(struct json_object *obj){
+	struct JNode *n = (struct JNode *)obj;
+
+	return (n && n->type == JSON_STRING) ? nodeString(n) : NULL;
+}
+
+bool jindexIsInteger(struct json_object *obj){
+	struct JNode *n = (struct JNode *)obj;
+
+	if(!n || n->type != JSON_NUMBER)
+		return false;
+
+	const char *p = n->p;
+	if(*p == '-')
+		++p;
+	while(*p >= '0' && *p <= '9')
+		++p;
+
+	return *p != '.' && *p != 'e' && *p != 'E';
+}
+
+double jindexNumber(struct json_object *obj){
+	struct JNode *n = (struct JNode *)obj;
+
+	if(!n)
+		return 0;
+
+	switch(n->type){
+	case JSON_NUMBER:
+		return strtod(n->p, NULL);
+	case JSON_TRUE:
+		return 1;
+	default:
+		return 0;
+	}
+}
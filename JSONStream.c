@@ -0,0 +1,278 @@
+/* Streaming JSON decoder
+ *
+ * Incremental tokenizer fed with chunks as they are received : no DOM is
+ * built. Callbacks are called for each container's start and end and for
+ * each scalar value, with the key it is associated with. Any callback can
+ * stop the decoding (as example, as soon as the wanted value is found).
+ *
+ * Notez-bien :
+ *	- it's not a validator : separators (',' and ':') are not checked,
+ *	- \u escapes outside the BMP are encoded as two 3 bytes sequences
+ *	(surrogates are not combined).
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	JS_VALUE = 0,	/* Between tokens */
+	JS_STRING,
+	JS_ESCAPE,		/* After a backslash */
+	JS_UNICODE,		/* Reading \uXXXX digits */
+	JS_LITERAL		/* Number, true, false, null */
+};
+
+void jsonInit(struct JSONStream *js,
+	bool (*begin)(struct JSONStream *, bool),
+	bool (*end)(struct JSONStream *, bool),
+	bool (*scalar)(struct JSONStream *, enum JSONType, const char *, size_t),
+	void *data
+){
+	char *tok = js->tok;	/* The token buffer is kept */
+	size_t tokcap = js->tokcap;
+
+	memset(js, 0, sizeof(struct JSONStream));
+	js->tok = tok;
+	js->tokcap = tokcap;
+
+	js->begin = begin;
+	js->end = end;
+	js->scalar = scalar;
+	js->data = data;
+}
+
+void jsonFree(struct JSONStream *js){
+	free(js->tok);
+	js->tok = NULL;
+	js->tokcap = 0;
+}
+
+static void tokAdd(struct JSONStream *js, char c){
+	if(js->toklen + 2 > js->tokcap){
+		js->tokcap = js->tokcap ? js->tokcap * 2 : 64;
+		assert( (js->tok = realloc(js->tok, js->tokcap)) );
+	}
+	js->tok[js->toklen++] = c;
+	js->tok[js->toklen] = 0;
+}
+
+static void tokUTF8(struct JSONStream *js, unsigned int c){
+	if(c < 0x80)
+		tokAdd(js, c);
+	else if(c < 0x800){
+		tokAdd(js, 0xc0 | (c >> 6));
+		tokAdd(js, 0x80 | (c & 0x3f));
+	} else {
+		tokAdd(js, 0xe0 | (c >> 12));
+		tokAdd(js, 0x80 | ((c >> 6) & 0x3f));
+		tokAdd(js, 0x80 | (c & 0x3f));
+	}
+}
+
+static bool inArray(struct JSONStream *js){
+	return js->depth && (js->arrays & (1ULL << (js->depth - 1)));
+}
+
+static bool fail(struct JSONStream *js, const char *msg){
+	if(debug)
+		fprintf(stderr, "*E* JSON : %s at offset %lu\n", msg, js->offset);
+	js->error = true;
+	return false;
+}
+
+static bool valueDone(struct JSONStream *js){
+	/* A value has been fully read */
+	*js->key = 0;
+	js->expectkey = false;
+
+	if(!js->depth)
+		js->done = true;
+	return true;
+}
+
+static bool emitScalar(struct JSONStream *js, enum JSONType type){
+	if(js->scalar && !js->scalar(js, type, js->tok ? js->tok : "", js->toklen)){
+		js->stopped = true;
+		return false;
+	}
+
+	return valueDone(js);
+}
+
+static bool endLiteral(struct JSONStream *js){
+	const char *t = js->tok;
+	enum JSONType type;
+
+	if(!strcmp(t, "true"))
+		type = JSON_TRUE;
+	else if(!strcmp(t, "false"))
+		type = JSON_FALSE;
+	else if(!strcmp(t, "null"))
+		type = JSON_NULL;
+	else {
+		char *end;
+		strtod(t, &end);
+		if(*end || end == t)
+			return fail(js, "invalid literal");
+		type = JSON_NUMBER;
+	}
+
+	js->state = JS_VALUE;
+	return emitScalar(js, type);
+}
+
+static bool openContainer(struct JSONStream *js, bool array){
+	if(js->depth >= 64)
+		return fail(js, "too deep");
+
+	if(js->begin && !js->begin(js, array)){
+		js->stopped = true;
+		return false;
+	}
+
+	if(array)
+		js->arrays |= 1ULL << js->depth;
+	else
+		js->arrays &= ~(1ULL << js->depth);
+	++js->depth;
+
+	*js->key = 0;
+	js->expectkey = !array;
+	return true;
+}
+
+static bool closeContainer(struct JSONStream *js, bool array){
+	if(!js->depth || inArray(js) != array)
+		return fail(js, "unbalanced container");
+
+	--js->depth;
+	if(js->end && !js->end(js, array)){
+		js->stopped = true;
+		return false;
+	}
+
+	return valueDone(js);
+}
+
+static bool endString(struct JSONStream *js){
+	js->state = JS_VALUE;
+
+	if(js->expectkey){	/* It's a key */
+		size_t l = js->toklen < sizeof(js->key) - 1 ? js->toklen : sizeof(js->key) - 1;
+		memcpy(js->key, js->tok ? js->tok : "", l);
+		js->key[l] = 0;
+		js->expectkey = false;
+		return true;
+	}
+
+	return emitScalar(js, JSON_STRING);
+}
+
+bool jsonFeed(struct JSONStream *js, const char *buf, size_t len){
+	if(js->error || js->stopped)
+		return false;
+
+	for(; len--; ++buf, ++js->offset){
+		char c = *buf;
+
+		switch(js->state){
+		case JS_STRING:
+			if(c == '"'){
+				if(!endString(js))
+					return false;
+			} else if(c == '\\')
+				js->state = JS_ESCAPE;
+			else
+				tokAdd(js, c);
+			continue;
+		case JS_ESCAPE:
+			js->state = JS_STRING;
+			switch(c){
+			case 'b': tokAdd(js, '\b'); break;
+			case 'f': tokAdd(js, '\f'); break;
+			case 'n': tokAdd(js, '\n'); break;
+			case 'r': tokAdd(js, '\r'); break;
+			case 't': tokAdd(js, '\t'); break;
+			case 'u':
+				js->state = JS_UNICODE;
+				js->uni = js->unilen = 0;
+				break;
+			default:	/* ", \, / */
+				tokAdd(js, c);
+			}
+			continue;
+		case JS_UNICODE:
+			if(!isxdigit((unsigned char)c))
+				return fail(js, "invalid \\u escape");
+			js->uni = (js->uni << 4) | (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10));
+			if(++js->unilen == 4){
+				tokUTF8(js, js->uni);
+				js->state = JS_STRING;
+			}
+			continue;
+		case JS_LITERAL:
+			if(isalnum((unsigned char)c) || c == '.' || c == '-' || c == '+'){
+				tokAdd(js, c);
+				continue;
+			}
+			if(!endLiteral(js))
+				return false;
+			/* The current character still has to be processed */
+		}
+
+			/* JS_VALUE */
+		if(isspace((unsigned char)c) || c == ',' || c == ':'){
+			if(c == ',' && js->depth && !inArray(js))
+				js->expectkey = true;
+			continue;
+		}
+
+		if(js->done)
+			return fail(js, "garbage after the value");
+
+		switch(c){
+		case '{':
+		case '[':
+			if(!openContainer(js, c == '['))
+				return false;
+			break;
+		case '}':
+		case ']':
+			if(!closeContainer(js, c == ']'))
+				return false;
+			break;
+		case '"':
+			js->state = JS_STRING;
+			js->toklen = 0;
+			if(js->tok)
+				*js->tok = 0;
+			break;
+		default:
+			if(js->expectkey)
+				return fail(js, "key expected");
+			js->state = JS_LITERAL;
+			js->toklen = 0;
+			tokAdd(js, c);
+		}
+	}
+
+	return true;
+}
+
+bool jsonEnd(struct JSONStream *js){
+	/* No more data : flush a pending literal (top level number)
+	 * <- true if a complete value has been decoded (or decoding stopped)
+	 */
+	if(js->stopped)
+		return true;
+
+	if(!js->error && js->state == JS_LITERAL && !endLiteral(js))
+		return js->stopped;
+
+	return !js->error && js->done;
+}
@@ -0,0 +1,414 @@
+/* Active mDNS querier
+ *
+ * scan_TaHoma waits for TaHoma's advertisement through avahi-daemon, which
+ * may take minutes. probe_TaHoma asks for it instead : PTR, then SRV/TXT
+ * and A/AAAA questions are sent over plain UDP with the QU bit (unicast
+ * response requested), retransmitted with a growing delay, until a
+ * complete answer is received. No avahi-daemon is needed.
+ *
+ * Queries are sent from an ephemeral port : responders answer directly
+ * to it (RFC 6762, 6.7), so it doesn't conflict with a running mDNS daemon.
+ * By default, they are sent to the IPv4 mDNS group, but a target address
+ * (and port) can be provided, as example the TaHoma itself or a local
+ * responder stand-in for tests.
+ *
+ * Notez-bien : '.' and '\' inside labels are escaped by a '\'.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define SERVICE_NAME "_kizboxdev._tcp.local"
+#define MDNS_GROUP "224.0.0.251"
+#define MDNS_PORT 5353
+
+#define PROBE_TIMEOUT 10	/* Default probing duration (seconds) */
+#define RETRANS_FIRST 250	/* 1st retransmission's delay (ms) */
+#define RETRANS_MAX 4000
+
+#define DNS_NAMEMAX 256
+
+enum { RR_A = 1, RR_PTR = 12, RR_TXT = 16, RR_AAAA = 28, RR_SRV = 33 };
+#define CLASS_IN 1
+#define CLASS_QU 0x8000		/* Unicast response requested (questions) */
+
+struct Discovery {
+	char instance[DNS_NAMEMAX];	/* Service instance, empty if unknown */
+	char target[DNS_NAMEMAX];	/* Its host */
+	uint16_t port;
+	char txt[512];				/* TXT strings, quoted */
+	char address[INET6_ADDRSTRLEN];
+};
+
+	/*
+	 * Messages' encoding
+	 */
+
+static size_t putName(uint8_t *p, const char *name){
+	/* <- encoded size */
+	uint8_t *start = p;
+
+	while(*name){
+		uint8_t *len = p++;
+
+		*len = 0;
+		for(; *name && *name != '.'; ++name){
+			if(*name == '\\' && name[1])
+				++name;
+			if(*len < 63){
+				*p++ = *name;
+				++*len;
+			}
+		}
+		if(*name)
+			++name;
+	}
+	*p++ = 0;
+
+	return p - start;
+}
+
+static size_t putQuestion(uint8_t *p, const char *name, uint16_t type){
+	size_t l = putName(p, name);
+
+	p[l++] = type >> 8;
+	p[l++] = type & 0xff;
+	p[l++] = (CLASS_QU | CLASS_IN) >> 8;
+	p[l++] = (CLASS_QU | CLASS_IN) & 0xff;
+
+	return l;
+}
+
+static size_t buildQuery(uint8_t *msg, struct Discovery *d, unsigned int *nquestions){
+	/* Ask for what is still missing */
+	size_t l = 12;
+	uint16_t qd = 0;
+
+	memset(msg, 0, 12);	/* ID 0, standard query */
+
+	if(!*d->instance){
+		l += putQuestion(msg + l, SERVICE_NAME, RR_PTR);
+		++qd;
+	} else if(!*d->target){
+		l += putQuestion(msg + l, d->instance, RR_SRV);
+		l += putQuestion(msg + l, d->instance, RR_TXT);
+		qd += 2;
+	} else {
+		if(avahiIP != AVAHI_PROTO_INET6){
+			l += putQuestion(msg + l, d->target, RR_A);
+			++qd;
+		}
+		if(avahiIP != AVAHI_PROTO_INET){
+			l += putQuestion(msg + l, d->target, RR_AAAA);
+			++qd;
+		}
+	}
+
+	msg[4] = qd >> 8;
+	msg[5] = qd & 0xff;
+	*nquestions = qd;
+
+	return l;
+}
+
+	/*
+	 * Responses' decoding
+	 */
+
+static bool readName(const uint8_t *msg, size_t len, size_t *off, char *name){
+	/* Decode a (compressed) name at *off, which is moved after it */
+	size_t o = *off, l = 0;
+	bool jumped = false;
+	int jumps = 0;
+
+	for(;;){
+		if(o >= len)
+			return false;
+
+		uint8_t c = msg[o];
+		if((c & 0xc0) == 0xc0){	/* Compression pointer */
+			if(o + 1 >= len || ++jumps > 16)
+				return false;
+			if(!jumped)
+				*off = o + 2;
+			jumped = true;
+			o = ((c & 0x3f) << 8) | msg[o + 1];
+			continue;
+		}
+
+		++o;
+		if(!c)
+			break;
+		if(c > 63 || o + c > len)
+			return false;
+
+		if(l)
+			name[l++] = '.';
+		for(uint8_t i = 0; i < c; ++i){
+			char ch = msg[o + i];
+			if(l + 3 >= DNS_NAMEMAX)
+				return false;
+			if(ch == '.' || ch == '\\')
+				name[l++] = '\\';
+			name[l++] = ch;
+		}
+		o += c;
+	}
+
+	name[l] = 0;
+	if(!jumped)
+		*off = o;
+	return true;
+}
+
+static void readTXT(const uint8_t *p, size_t len, char *txt, size_t size){
+	size_t l = 0;
+
+	*txt = 0;
+	while(len){
+		size_t sl = *p++;
+		--len;
+		if(sl > len)
+			break;
+
+		int n = snprintf(txt + l, size - l, "%s\"%.*s\"", l ? " " : "", (int)sl, (const char *)p);
+		if(n < 0 || (size_t)n >= size - l)
+			break;
+		l += n;
+
+		p += sl;
+		len -= sl;
+	}
+}
+
+static bool isService(const char *name){
+	/* Is it an instance of our service ? */
+	size_t l = strlen(name), sl = strlen("." SERVICE_NAME);
+
+	return l > sl && !strcasecmp(name + l - sl, "." SERVICE_NAME);
+}
+
+static void decodeResponse(const uint8_t *msg, size_t len, struct Discovery *d){
+	if(len < 12 || !(msg[2] & 0x80))	/* Not a response */
+		return;
+
+	size_t off = 12;
+	unsigned int qd = (msg[4] << 8) | msg[5];
+	unsigned int rr = ((msg[6] << 8) | msg[7]) + ((msg[8] << 8) | msg[9]) + ((msg[10] << 8) | msg[11]);
+	char name[DNS_NAMEMAX];
+
+	for(; qd; --qd){	/* Skip echoed questions */
+		if(!readName(msg, len, &off, name) || off + 4 > len)
+			return;
+		off += 4;
+	}
+
+		/* Records may come in any order and section */
+	for(; rr; --rr){
+		if(!readName(msg, len, &off, name) || off + 10 > len)
+			return;
+
+		uint16_t type = (msg[off] << 8) | msg[off + 1];
+		uint16_t rdlen = (msg[off + 8] << 8) | msg[off + 9];
+		off += 10;
+		if(off + rdlen > len)
+			return;
+
+		const uint8_t *rdata = msg + off;
+		size_t roff = off;
+		off += rdlen;
+
+		switch(type){
+		case RR_PTR:
+			if(!*d->instance && !strcasecmp(name, SERVICE_NAME)){
+				char inst[DNS_NAMEMAX];
+				if(readName(msg, len, &roff, inst) && isService(inst))
+					strcpy(d->instance, inst);
+			}
+			break;
+		case RR_SRV:
+			if(rdlen < 7 || !isService(name) || (*d->instance && strcasecmp(name, d->instance)))
+				break;
+			if(!*d->instance)
+				strcpy(d->instance, name);
+			if(!*d->target){
+				roff += 6;
+				if(readName(msg, len, &roff, d->target))
+					d->port = (rdata[4] << 8) | rdata[5];
+				else
+					*d->target = 0;
+			}
+			break;
+		case RR_TXT:
+			if(*d->instance && !strcasecmp(name, d->instance))
+				readTXT(rdata, rdlen, d->txt, sizeof(d->txt));
+			break;
+		case RR_A:
+			if(rdlen == 4 && avahiIP != AVAHI_PROTO_INET6 && *d->target && !strcasecmp(name, d->target) && !*d->address)
+				inet_ntop(AF_INET, rdata, d->address, sizeof(d->address));
+			break;
+		case RR_AAAA:
+			if(rdlen == 16 && avahiIP != AVAHI_PROTO_INET && *d->target && !strcasecmp(name, d->target) && !*d->address)
+				inet_ntop(AF_INET6, rdata, d->address, sizeof(d->address));
+			break;
+		}
+	}
+}
+
+	/*
+	 * Probing
+	 */
+
+static bool parseTarget(const char *arg, struct sockaddr_in *dst){
+	/* "address[:port]", the mDNS group if NULL */
+	char addr[INET_ADDRSTRLEN];
+	const char *sep = arg ? strchr(arg, ':') : NULL;
+
+	memset(dst, 0, sizeof(struct sockaddr_in));
+	dst->sin_family = AF_INET;
+	dst->sin_port = htons(sep ? atoi(sep + 1) : MDNS_PORT);
+
+	if(!arg)
+		arg = MDNS_GROUP;
+	size_t l = sep ? (size_t)(sep - arg) : strlen(arg);
+	if(l >= sizeof(addr))
+		return false;
+	memcpy(addr, arg, l);
+	addr[l] = 0;
+
+	return inet_pton(AF_INET, addr, &dst->sin_addr) == 1 && dst->sin_port;
+}
+
+void func_probe(const char *arg){
+	struct sockaddr_in dst;
+	unsigned int duration = PROBE_TIMEOUT;
+	char target[64] = "";
+
+		/* Arguments : [address[:port]] [seconds] */
+	if(arg){
+		int n = 0;
+		sscanf(arg, "%63s %n", target, &n);
+		if(isdigit((unsigned char)*target) && !strchr(target, '.') && !strchr(target, ':')){	/* Only a duration */
+			duration = atoi(target);
+			*target = 0;
+		} else if(n && arg[n])
+			duration = atoi(arg + n);
+	}
+
+	if(!parseTarget(*target ? target : NULL, &dst)){
+		fprintf(stderr, "*E* Invalid target '%s' (IPv4 address[:port] expected)\n", target);
+		return;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd == -1){
+		perror("socket()");
+		return;
+	}
+
+	if(IN_MULTICAST(ntohl(dst.sin_addr.s_addr))){
+		unsigned char ttl = 255, loop = 1;	/* As required by RFC 6762 / responders on this host */
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	}
+
+	struct Discovery d;
+	memset(&d, 0, sizeof(d));
+
+	unsigned long start = nowms(), deadline = start + duration * 1000UL;
+	unsigned long next = start, delay = RETRANS_FIRST;
+	unsigned int sent = 0;
+	int stage = -1;		/* What has been asked : the delay restarts with each new question */
+
+	while(!*d.address){
+		unsigned long now = nowms();
+		if(now >= deadline)
+			break;
+
+		int cur = !*d.instance ? 0 : (!*d.target ? 1 : 2);
+		if(cur != stage){	/* Something new to ask, without waiting */
+			stage = cur;
+			next = now;
+			delay = RETRANS_FIRST;
+		}
+
+		if(now >= next){
+			uint8_t msg[1024];
+			unsigned int nq;
+			size_t l = buildQuery(msg, &d, &nq);
+
+			if(sendto(fd, msg, l, 0, (struct sockaddr *)&dst, sizeof(dst)) == -1)
+				perror("sendto()");
+			else {
+				++sent;
+				if(debug)
+					printf("*D* mDNS query #%u (%u question%s) sent at %lums\n", sent, nq, nq > 1 ? "s":"", now - start);
+			}
+
+			next = now + delay;
+			delay *= 2;
+			if(delay > RETRANS_MAX)
+				delay = RETRANS_MAX;
+		}
+
+		unsigned long wakeup = next < deadline ? next : deadline;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int res = poll(&pfd, 1, wakeup > now ? (int)(wakeup - now) : 0);
+
+		if(res == -1){
+			if(errno != EINTR){
+				perror("poll()");
+				break;
+			}
+		} else if(res && (pfd.revents & POLLIN)){
+			uint8_t msg[9000];
+			ssize_t l = recv(fd, msg, sizeof(msg), 0);
+
+			if(l > 0)
+				decodeResponse(msg, l, &d);
+		}
+	}
+	close(fd);
+
+	unsigned long elapsed = nowms() - start;
+	if(!*d.address){
+		fprintf(stderr, "*E* No complete answer after %lums (%u quer%s sent)%s%s\n", elapsed, sent, sent > 1 ? "ies":"y",
+			*d.instance ? ", found " : "", d.instance);
+		return;
+	}
+
+		/* Strip escapes from the host name */
+	char host[DNS_NAMEMAX], *h = host;
+	for(const char *s = d.target; *s; ++s){
+		if(*s == '\\' && s[1])
+			++s;
+		*h++ = *s;
+	}
+	*h = 0;
+
+	if(verbose || debug)
+		printf("*I* Service '%s' :\n"
+			"\t%s:%u (%s)\n"
+			"\tTXT=%s\n",
+			d.instance, host, d.port, d.address, d.txt
+		);
+	printf("*I* TaHoma discovered in %lums (%u quer%s sent)\n", elapsed, sent, sent > 1 ? "ies":"y");
+
+	clean(&url);
+	FreeAndSet(&tahoma, host);
+	FreeAndSet(&ip, d.address);
+	port = d.port;
+	buildURL();
+	saveDiscovery();
+}
@@ -0,0 +1,584 @@
+/* JSON queries
+ *
+ * Query extracts values from any API's response with a path expression
+ * (jq like) :
+ *	.key or ."key"	object's member
+ *	.*				all members of an object
+ *	[n]				array's element (negative : from the end)
+ *	[] or [*]		all elements of an array (or members of an object)
+ *	[?cond]			elements matching a condition :
+ *		.path			the value exists and is neither false nor null
+ *		.path op value	op being ==, !=, <, <=, >, >= or ~ (glob pattern)
+ *
+ * Expressions are compiled once in a plan (array of steps) kept in a small
+ * cache : scripts polling with the same query don't parse it again.
+ * Results are displayed one per line : strings raw, other values as
+ * compact JSON.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define QUERY_CACHE 8	/* Number of plans kept */
+
+enum QueryStepType {
+	QS_MEMBER,		/* .key */
+	QS_MEMBERS,		/* .* */
+	QS_INDEX,		/* [n] */
+	QS_ALL,			/* [] */
+	QS_FILTER		/* [?cond] */
+};
+
+enum QueryCmp { QC_EXISTS, QC_EQ, QC_NE, QC_LT, QC_LE, QC_GT, QC_GE, QC_GLOB };
+
+struct QueryPlan;
+
+struct QueryStep {
+	enum QueryStepType type;
+	char *key;				/* QS_MEMBER */
+	long index;				/* QS_INDEX */
+
+		/* QS_FILTER */
+	struct QueryPlan *cond;	/* Path of the tested value */
+	enum QueryCmp cmp;
+	char *value;			/* Compared to */
+	enum JSONType vtype;	/* value's type */
+	bool quoted;			/* value was a quoted string */
+	double number;
+};
+
+struct QueryPlan {
+	char *expr;				/* Source expression (cached plans only) */
+	size_t nsteps;
+	struct QueryStep *steps;
+};
+
+static struct QueryPlan *plans[QUERY_CACHE];	/* Most recently used first */
+
+	/*
+	 * Compilation
+	 */
+
+static void freePlan(struct QueryPlan *plan){
+	if(!plan)
+		return;
+
+	for(size_t i = 0; i < plan->nsteps; ++i){
+		free(plan->steps[i].key);
+		free(plan->steps[i].value);
+		freePlan(plan->steps[i].cond);
+	}
+
+	free(plan->steps);
+	free(plan->expr);
+	free(plan);
+}
+
+static bool qerror(const char *msg, const char *at){
+	fprintf(stderr, "*E* Query : %s at '%s'\n", msg, *at ? at : "end of expression");
+	return false;
+}
+
+static const char *skipBlank(const char *p){
+	while(isblank((unsigned char)*p))
+		++p;
+	return p;
+}
+
+static struct QueryStep *addStep(struct QueryPlan *plan, enum QueryStepType type){
+	assert( (plan->steps = realloc(plan->steps, (plan->nsteps + 1) * sizeof(struct QueryStep))) );
+
+	struct QueryStep *st = plan->steps + plan->nsteps++;
+	memset(st, 0, sizeof(struct QueryStep));
+	st->type = type;
+
+	return st;
+}
+
+static char *quotedString(const char **p){
+	/* Read a double quoted string (\ escapes the next character)
+	 * <- the string (to be freed), NULL if not terminated
+	 */
+	const char *s = *p + 1;
+	char *res, *d;
+
+	assert( (res = d = malloc(strlen(s) + 1)) );
+	for(; *s && *s != '"'; ++s){
+		if(*s == '\\' && s[1])
+			++s;
+		*d++ = *s;
+	}
+	*d = 0;
+
+	if(*s != '"'){
+		free(res);
+		qerror("unterminated string", *p);
+		return NULL;
+	}
+
+	*p = s + 1;
+	return res;
+}
+
+static struct QueryPlan *compilePath(const char **p, const char *stops);
+
+static bool compileFilter(struct QueryStep *st, const char **p){
+	/* *p is just after "[?" */
+	const char *s = skipBlank(*p);
+
+	if(*s != '.')
+		return qerror("condition must start with a path", s);
+
+	if(!(st->cond = compilePath(&s, ".[ \t=!<>~]")))
+		return false;
+
+	s = skipBlank(s);
+	if(*s == ']'){
+		st->cmp = QC_EXISTS;
+		*p = s + 1;
+		return true;
+	}
+
+		/* Operator */
+	static const struct {
+		const char *op;
+		enum QueryCmp cmp;
+	} ops[] = {	/* Longest first */
+		{ "==", QC_EQ }, { "!=", QC_NE }, { "<=", QC_LE }, { ">=", QC_GE },
+		{ "=", QC_EQ }, { "<", QC_LT }, { ">", QC_GT }, { "~", QC_GLOB },
+		{ NULL, 0 }
+	};
+
+	size_t i;
+	for(i = 0; ops[i].op; ++i)
+		if(!strncmp(s, ops[i].op, strlen(ops[i].op)))
+			break;
+	if(!ops[i].op)
+		return qerror("operator expected", s);
+
+	st->cmp = ops[i].cmp;
+	s = skipBlank(s + strlen(ops[i].op));
+
+		/* Value */
+	if(*s == '"'){
+		if(!(st->value = quotedString(&s)))
+			return false;
+		st->quoted = true;
+		st->vtype = JSON_STRING;
+	} else {
+		const char *e = strchr(s, ']');
+		if(!e)
+			return qerror("']' expected", s);
+		while(e > s && isblank((unsigned char)e[-1]))
+			--e;
+		if(e == s)
+			return qerror("value expected", s);
+
+		assert( (st->value = strndup(s, e - s)) );
+		s = e;
+
+		char *end;
+		st->number = strtod(st->value, &end);
+		if(!*end)
+			st->vtype = JSON_NUMBER;
+		else if(!strcmp(st->value, "true"))
+			st->vtype = JSON_TRUE;
+		else if(!strcmp(st->value, "false"))
+			st->vtype = JSON_FALSE;
+		else if(!strcmp(st->value, "null"))
+			st->vtype = JSON_NULL;
+		else
+			st->vtype = JSON_STRING;
+	}
+
+	s = skipBlank(s);
+	if(*s != ']')
+		return qerror("']' expected", s);
+
+	*p = s + 1;
+	return true;
+}
+
+static void bareKey(struct QueryPlan *plan, const char **p, const char *stops){
+	size_t len = strcspn(*p, stops);
+
+	if(len){	/* Otherwise, '.' is the value itself */
+		assert( (addStep(plan, QS_MEMBER)->key = strndup(*p, len)) );
+		*p += len;
+	}
+}
+
+static struct QueryPlan *compilePath(const char **p, const char *stops){
+	/* Compile steps until a character that can't start one.
+	 * Bare keys end with any character of stops.
+	 */
+	struct QueryPlan *plan = calloc(1, sizeof(struct QueryPlan));
+	const char *s = *p;
+	assert(plan);
+
+	if(*s != '"')	/* Leading '.' omitted */
+		bareKey(plan, &s, stops);
+
+	for(;;){
+		if(*s == '.'){
+			++s;
+			if(*s == '*'){
+				addStep(plan, QS_MEMBERS);
+				++s;
+			} else if(*s == '"'){
+				char *k = quotedString(&s);
+				if(!k)
+					goto err;
+				addStep(plan, QS_MEMBER)->key = k;
+			} else
+				bareKey(plan, &s, stops);
+		} else if(*s == '['){
+			++s;
+			if(*s == ']' || (*s == '*' && s[1] == ']')){
+				addStep(plan, QS_ALL);
+				s += (*s == ']') ? 1 : 2;
+			} else if(*s == '?'){
+				++s;
+				if(!compileFilter(addStep(plan, QS_FILTER), &s))
+					goto err;
+			} else {
+				char *end;
+				long idx = strtol(s, &end, 10);
+				if(end == s || *end != ']'){
+					qerror("index expected", s);
+					goto err;
+				}
+				addStep(plan, QS_INDEX)->index = idx;
+				s = end + 1;
+			}
+		} else
+			break;
+	}
+
+	*p = s;
+	return plan;
+
+err:
+	freePlan(plan);
+	return NULL;
+}
+
+static struct QueryPlan *getPlan(const char *expr){
+	/* Compiled plan of an expression, from the cache if possible
+	 * <- NULL if invalid
+	 */
+	size_t i;
+
+	for(i = 0; i < QUERY_CACHE && plans[i]; ++i)
+		if(!strcmp(plans[i]->expr, expr)){
+			struct QueryPlan *plan = plans[i];
+
+			memmove(plans + 1, plans, i * sizeof(struct QueryPlan *));
+			plans[0] = plan;
+
+			if(debug)
+				puts("*D* Query plan reused");
+			return plan;
+		}
+
+	const char *s = expr;
+	struct QueryPlan *plan = compilePath(&s, ".[ \t");
+	if(!plan)
+		return NULL;
+
+	s = skipBlank(s);
+	if(*s){
+		qerror("unexpected character", s);
+		freePlan(plan);
+		return NULL;
+	}
+	assert( (plan->expr = strdup(expr)) );
+
+	if(debug)
+		printf("*D* Query plan compiled : %lu step(s)\n", plan->nsteps);
+
+		/* Insert it, the least recently used is dropped */
+	freePlan(plans[QUERY_CACHE - 1]);
+	memmove(plans + 1, plans, (QUERY_CACHE - 1) * sizeof(struct QueryPlan *));
+	plans[0] = plan;
+
+	return plan;
+}
+
+	/*
+	 * Execution
+	 */
+
+typedef bool (*QueryEmit)(struct json_object *, void *);	/* <- false to stop */
+
+static bool runPlan(struct QueryPlan *, size_t, struct json_object *, QueryEmit, void *);
+
+struct Walk {	/* Continue the plan on each visited value */
+	struct QueryPlan *plan;
+	size_t step;			/* Next step to run */
+	struct QueryStep *filter;	/* Only on values matching this filter */
+	QueryEmit emit;
+	void *data;
+};
+
+struct CondTest {
+	struct QueryStep *st;
+	bool match;
+};
+
+static bool testCond(struct json_object *val, void *data){
+	/* <- false (stop) as soon as a value matches */
+	struct CondTest *ct = data;
+	struct QueryStep *st = ct->st;
+	enum JSONType t = typeObj(val);
+	int c;
+
+	switch(st->cmp){
+	case QC_EXISTS:
+		ct->match = (t != JSON_NULL && t != JSON_FALSE);
+		return !ct->match;
+	case QC_GLOB:
+		ct->match = (t == JSON_STRING && !fnmatch(st->value, objString(val), 0));
+		return !ct->match;
+	default:
+		break;
+	}
+
+	if(t == JSON_STRING && (st->vtype == JSON_STRING || !st->quoted))
+		c = strcmp(objString(val), st->value);
+	else if(t == JSON_NUMBER && st->vtype == JSON_NUMBER){
+		double d = objNumber(val);
+		c = (d > st->number) - (d < st->number);
+	} else if(t == st->vtype && (t == JSON_TRUE || t == JSON_FALSE || t == JSON_NULL))
+		c = 0;
+	else {	/* Not comparable */
+		ct->match = (st->cmp == QC_NE);
+		return !ct->match;
+	}
+
+	switch(st->cmp){
+	case QC_EQ: ct->match = !c; break;
+	case QC_NE: ct->match = c; break;
+	case QC_LT: ct->match = c < 0; break;
+	case QC_LE: ct->match = c <= 0; break;
+	case QC_GT: ct->match = c > 0; break;
+	default: ct->match = c >= 0;
+	}
+
+	return !ct->match;
+}
+
+static bool walkValue(struct json_object *val, void *data){
+	struct Walk *w = data;
+
+	if(w->filter){	/* Any value reached by the condition's path may match */
+		struct CondTest ct = { w->filter, false };
+
+		runPlan(w->filter->cond, 0, val, testCond, &ct);
+		if(!ct.match)
+			return true;
+	}
+
+	return runPlan(w->plan, w->step, val, w->emit, w->data);
+}
+
+static bool walkMember(const char *, struct json_object *val, void *data){
+	return walkValue(val, data);
+}
+
+static bool runPlan(struct QueryPlan *plan, size_t i, struct json_object *obj, QueryEmit emit, void *data){
+	/* Apply steps from the ith one
+	 * <- false if stopped by emit
+	 */
+	if(i == plan->nsteps)
+		return emit(obj, data);
+
+	struct QueryStep *st = plan->steps + i;
+	struct Walk w = { plan, i + 1, NULL, emit, data };
+	struct json_object *val;
+
+	switch(st->type){
+	case QS_MEMBER:
+		if(!memberObj(obj, st->key, &val))
+			return true;
+		return runPlan(plan, i + 1, val, emit, data);
+	case QS_MEMBERS:
+		return forEachMember(obj, walkMember, &w);
+	case QS_INDEX:
+		if(isArrayObj(obj)){
+			size_t len = arrayLengthObj(obj);
+			long idx = st->index < 0 ? (long)len + st->index : st->index;
+
+			if(idx >= 0 && (size_t)idx < len)
+				return runPlan(plan, i + 1, arrayGetObj(obj, idx), emit, data);
+		}
+		return true;
+	case QS_FILTER:
+		w.filter = st;
+		/* falls through */
+	case QS_ALL:
+		if(isArrayObj(obj)){
+			size_t len = arrayLengthObj(obj);
+
+			for(size_t idx = 0; idx < len; ++idx)
+				if(!walkValue(arrayGetObj(obj, idx), &w))
+					return false;
+			return true;
+		}
+		return forEachMember(obj, walkMember, &w);
+	}
+
+	return true;
+}
+
+	/*
+	 * Output
+	 */
+
+static void printString(const char *s){
+	putchar('"');
+	for(; *s; ++s)
+		switch(*s){
+		case '"':
+		case '\\':
+			putchar('\\');
+			putchar(*s);
+			break;
+		case '\n':
+			fputs("\\n", stdout);
+			break;
+		case '\t':
+			fputs("\\t", stdout);
+			break;
+		default:
+			if((unsigned char)*s < 0x20)
+				printf("\\u%04x", (unsigned char)*s);
+			else
+				putchar(*s);
+		}
+	putchar('"');
+}
+
+static void printValue(struct json_object *);
+
+static bool printMember(const char *key, struct json_object *val, void *data){
+	bool *first = data;
+
+	if(!*first)
+		putchar(',');
+	*first = false;
+
+	printString(key);
+	putchar(':');
+	printValue(val);
+
+	return true;
+}
+
+static void printValue(struct json_object *obj){
+	/* Compact JSON */
+	switch(typeObj(obj)){
+	case JSON_STRING:
+		printString(objString(obj));
+		break;
+	case JSON_NUMBER:
+		printf("%.15g", objNumber(obj));
+		break;
+	case JSON_TRUE:
+		fputs("true", stdout);
+		break;
+	case JSON_FALSE:
+		fputs("false", stdout);
+		break;
+	case JSON_NULL:
+		fputs("null", stdout);
+		break;
+	case JSON_ARRAY: {
+			size_t len = arrayLengthObj(obj);
+
+			putchar('[');
+			for(size_t i = 0; i < len; ++i){
+				if(i)
+					putchar(',');
+				printValue(arrayGetObj(obj, i));
+			}
+			putchar(']');
+		}
+		break;
+	case JSON_OBJECT: {
+			bool first = true;
+
+			putchar('{');
+			forEachMember(obj, printMember, &first);
+			putchar('}');
+		}
+		break;
+	}
+}
+
+static bool printResult(struct json_object *obj, void *data){
+	size_t *nbre = data;
+
+	if(typeObj(obj) == JSON_STRING)	/* Raw, for scripts */
+		puts(objString(obj));
+	else {
+		printValue(obj);
+		putchar('\n');
+	}
+
+	++*nbre;
+	return true;
+}
+
+	/*
+	 * User command
+	 */
+
+void func_Query(const char *arg){
+	if(!arg){
+		fputs("*E* Query is expecting an endpoint and a path expression.\n", stderr);
+		return;
+	}
+
+	struct substring ep;
+	const char *expr;
+
+	if(!extractTokenSub(&ep, arg, &expr) || !*expr)
+		expr = ".";
+
+	struct QueryPlan *plan = getPlan(expr);
+	if(!plan)
+		return;
+
+	char api[ep.len + 1];
+	sprintf(api, "%.*s", (int)ep.len, ep.s);
+
+	struct ResponseBuffer buff = {NULL};
+	long http_code = callAPI(*api == '/' ? api + 1 : api, &buff);
+
+	if(http_code != 200 || !buff.memory)
+		fprintf(stderr, "*E* '%s' failed (HTTP %ld)\n", api, http_code);
+	else {
+		struct json_object *res = parseJSON(buff.memory);
+
+		if(!res)
+			fputs("*E* Invalid JSON response\n", stderr);
+		else {
+			size_t nbre = 0;
+
+			runPlan(plan, 0, res, printResult, &nbre);
+			if(debug || verbose)
+				printf("*I* %lu value(s) found\n", nbre);
+		}
+
+		releaseJSON(res);
+	}
+
+	freeResponse(&buff);
+}
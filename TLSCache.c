@@ -0,0 +1,288 @@
+/* TLS sessions' cache
+ *
+ * A full TLS handshake with the TaHoma is most of a request's latency.
+ * Within a process, easy handles share their TLS sessions (see APIrequest.c).
+ * Across invocations, sessions are exported to a small file at exit
+ * and imported before the first request, so one-shot runs resume
+ * a session instead of negotiating a new one.
+ *
+ * File layout (native endianness) :
+ *	struct TLSHeader
+ *	{ struct TLSRecord, session key, shmac, session data }[nsessions]
+ *
+ * Notez-bien :
+ *	- exporting and importing sessions need libcurl 8.12 or newer,
+ *	built with SSLS-EXPORT support,
+ *	- the file contains sessions' secrets : it's only readable by its owner.
+ */
+
+#include "TaHomaCtl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TLS_MAGIC "TaHoTLS"
+#define TLS_VERSION 1
+#define TLS_MAXRECORD 16384	/* Sanity limit of a record's parts */
+
+struct TLSHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nsessions;
+	double handshake;		/* Duration of the last full handshake (s), 0 if unknown */
+};
+
+struct TLSRecord {
+	int64_t valid_until;	/* time_t, 0 if unknown */
+	uint32_t keylen;		/* Including the final nul */
+	uint32_t shmaclen;
+	uint32_t sdatalen;
+};
+
+char *tls_cache = NULL;		/* Cache file, NULL if disabled */
+
+static bool loaded = false;			/* Loading has been attempted */
+static unsigned int imported = 0;	/* Sessions imported from the cache */
+static double full_handshake = 0;	/* Reference : last full handshake (s) */
+
+static unsigned int handshakes = 0;	/* Handshakes done */
+static unsigned int resumed = 0;	/* ... shorter than the reference */
+static double saved = 0;			/* Time saved by resumptions (s) */
+
+	/*
+	 * Handshakes' measurement
+	 */
+
+void tlsHandshakeDone(CURL *h){
+	double conn, app;
+
+	if(curl_easy_getinfo(h, CURLINFO_CONNECT_TIME, &conn) != CURLE_OK ||
+	  curl_easy_getinfo(h, CURLINFO_APPCONNECT_TIME, &app) != CURLE_OK)
+		return;
+
+	if(app <= 0 || app < conn)	/* Connection reused : no handshake */
+		return;
+
+	double hs = app - conn;
+	bool sessions = imported || handshakes;	/* A session may have been resumed */
+	++handshakes;
+
+		/* Resumption is not reported by libcurl : an handshake clearly
+		 * shorter than the reference is considered as resumed.
+		 */
+	if(sessions && full_handshake > 0 && hs < full_handshake * .8){
+		++resumed;
+		saved += full_handshake - hs;
+
+		if(debug)
+			printf("*D* TLS handshake : %.1fms (resumed, %.1fms saved)\n", hs * 1e3, (full_handshake - hs) * 1e3);
+	} else {
+		full_handshake = hs;
+
+		if(debug)
+			printf("*D* TLS handshake : %.1fms (full)\n", hs * 1e3);
+	}
+}
+
+void tlsReport(void){
+	printf("*I* TLS sessions' cache : %s", tls_cache ? tls_cache : "disabled");
+	if(imported)
+		printf(" (%u session%s imported)", imported, imported > 1 ? "s":"");
+	putchar('\n');
+
+	if(handshakes){
+		printf("*I* TLS handshakes : %u, %u resumed", handshakes, resumed);
+		if(resumed)
+			printf(" (%.1fms saved)", saved * 1e3);
+		putchar('\n');
+	}
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+
+	/*
+	 * Export
+	 */
+
+struct Exported {
+	char *data;
+	size_t len;
+	uint32_t nbre;
+};
+
+static void addData(struct Exported *e, const void *data, size_t len){
+	assert( (e->data = realloc(e->data, e->len + len)) );
+	memcpy(e->data + e->len, data, len);
+	e->len += len;
+}
+
+static CURLcode export_cb(CURL *, void *userptr, const char *session_key,
+	const unsigned char *shmac, size_t shmac_len,
+	const unsigned char *sdata, size_t sdata_len,
+	curl_off_t valid_until, int, const char *, size_t
+){
+	struct Exported *e = userptr;
+
+	if(valid_until && valid_until <= time(NULL))	/* Expired */
+		return CURLE_OK;
+
+	struct TLSRecord rec;
+	rec.valid_until = valid_until;
+	rec.keylen = session_key ? strlen(session_key) + 1 : 0;
+	rec.shmaclen = shmac_len;
+	rec.sdatalen = sdata_len;
+
+	addData(e, &rec, sizeof(rec));
+	if(rec.keylen)
+		addData(e, session_key, rec.keylen);
+	addData(e, shmac, shmac_len);
+	addData(e, sdata, sdata_len);
+	++e->nbre;
+
+	return CURLE_OK;
+}
+
+void saveTLSSessions(CURL *h){
+	if(!tls_cache || !handshakes)	/* Nothing new */
+		return;
+
+	struct Exported e = { NULL, 0, 0 };
+	CURLcode res = curl_easy_ssls_export(h, export_cb, &e);
+	if(res != CURLE_OK){
+		if(debug)
+			fprintf(stderr, "*E* Can't export TLS sessions : %s\n", curl_easy_strerror(res));
+		free(e.data);
+		return;
+	}
+
+	struct TLSHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, TLS_MAGIC);
+	hdr.version = TLS_VERSION;
+	hdr.nsessions = e.nbre;
+	hdr.handshake = full_handshake;
+
+		/* Write a temporary file, then replace the cache */
+	char tmp[strlen(tls_cache) + 5];
+	sprintf(tmp, "%s.tmp", tls_cache);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	FILE *f = (fd == -1) ? NULL : fdopen(fd, "w");
+	if(!f){
+		perror(tmp);
+		if(fd != -1)
+			close(fd);
+	} else {
+		bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+		if(e.len)
+			ok = ok && fwrite(e.data, 1, e.len, f) == e.len;
+
+		if(fclose(f) || !ok){
+			fprintf(stderr, "*E* Can't write '%s'\n", tmp);
+			unlink(tmp);
+		} else if(rename(tmp, tls_cache) == -1){
+			perror(tls_cache);
+			unlink(tmp);
+		} else if(debug)
+			printf("*D* %u TLS session%s saved in '%s'\n", e.nbre, e.nbre > 1 ? "s":"", tls_cache);
+	}
+
+	free(e.data);
+}
+
+	/*
+	 * Import
+	 */
+
+void loadTLSSessions(CURL *h){
+	/* Only once, before the 1st request */
+	if(loaded || !tls_cache)
+		return;
+	loaded = true;
+
+	FILE *f = fopen(tls_cache, "r");
+	if(!f){
+		if(debug)
+			perror(tls_cache);
+		return;
+	}
+
+	struct TLSHeader hdr;
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TLS_MAGIC, sizeof(TLS_MAGIC)) || hdr.version != TLS_VERSION){
+		fprintf(stderr, "*E* '%s' is not a TLS sessions' cache\n", tls_cache);
+		fclose(f);
+		return;
+	}
+	full_handshake = hdr.handshake;
+
+	time_t now = time(NULL);
+	for(uint32_t i = 0; i < hdr.nsessions; ++i){
+		struct TLSRecord rec;
+
+		if(fread(&rec, sizeof(rec), 1, f) != 1 ||
+		  rec.keylen > TLS_MAXRECORD || rec.shmaclen > TLS_MAXRECORD || rec.sdatalen > TLS_MAXRECORD){
+			fprintf(stderr, "*E* '%s' : corrupted\n", tls_cache);
+			break;
+		}
+
+		unsigned char buf[rec.keylen + rec.shmaclen + rec.sdatalen + 1];
+		if(fread(buf, 1, sizeof(buf) - 1, f) != sizeof(buf) - 1 || (rec.keylen && buf[rec.keylen - 1])){
+			fprintf(stderr, "*E* '%s' : corrupted\n", tls_cache);
+			break;
+		}
+
+		if(rec.valid_until && rec.valid_until <= now)	/* Expired */
+			continue;
+
+		CURLcode res = curl_easy_ssls_import(h,
+			rec.keylen ? (const char *)buf : NULL,
+			buf + rec.keylen, rec.shmaclen,
+			buf + rec.keylen + rec.shmaclen, rec.sdatalen
+		);
+		if(res == CURLE_OK)
+			++imported;
+		else if(debug)
+			fprintf(stderr, "*E* Can't import a TLS session : %s\n", curl_easy_strerror(res));
+	}
+
+	fclose(f);
+
+	if(debug)
+		printf("*D* %u TLS session%s imported from '%s'\n", imported, imported > 1 ? "s":"", tls_cache);
+}
+
+#else	/* libcurl too old : sessions are only shared within the process */
+
+void saveTLSSessions(CURL *){
+}
+
+void loadTLSSessions(CURL *){
+	if(!loaded && tls_cache && (debug || verbose))
+		puts("*W* TLS sessions' cache needs libcurl 8.12 or newer");
+	loaded = true;
+}
+
+#endif
+
+	/*
+	 * User command
+	 */
+
+void func_tlscache(const char *arg){
+	if(!arg)
+		tlsReport();
+	else if(!strcmp(arg, "off"))
+		clean(&tls_cache);
+	else if(!strcmp(arg, "drop")){	/* Invalidate */
+		if(tls_cache && unlink(tls_cache) == -1)
+			perror(tls_cache);
+	} else {
+		FreeAndSet(&tls_cache, arg);
+		loaded = false;	/* Sessions will be imported from it by the next request */
+	}
+}
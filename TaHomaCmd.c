@@ -0,0 +1,119 @@
+/* TaHomaCmd
+ *
+ * Thin client of TaHomaCtl's daemon mode : forwards command lines
+ * to the daemon and prints out its reply.
+ *
+ * History:
+ * 	17/10/2026 - LF - First version
+ */
+
+#include "Daemon.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool sendall(int fd, const char *buf, size_t len){
+	while(len){
+		ssize_t r = write(fd, buf, len);
+		if(r == -1){
+			if(errno == EINTR)
+				continue;
+			perror("write()");
+			return false;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+int main(int ac, char **av){
+	struct sockaddr_un addr;
+	const char *path = NULL;
+	int opt;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	while( (opt = getopt(ac, av, "+S:h")) != -1){
+		switch(opt){
+		case 'S':
+			path = optarg;
+			break;
+		default:
+			puts(
+				"TaHomaCmd\n"
+				"\tSend commands to a TaHomaCtl daemon.\n"
+				"(c) L.Faillie (destroyedlolo) 2025-26\n"
+				"\nTaHomaCmd [-S socket] [command line]\n"
+				"\t-S : daemon's socket\n"
+				"\t-h ; display this help\n"
+				"\nWithout command line, commands are read from stdin."
+			);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(path){
+		if(strlen(path) >= sizeof(addr.sun_path)){
+			fputs("*F* Socket's path is too long\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		strcpy(addr.sun_path, path);
+	} else
+		defaultSocket(addr.sun_path, sizeof(addr.sun_path));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1){
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+		perror(addr.sun_path);
+		exit(EXIT_FAILURE);
+	}
+
+		/* Send the request */
+	if(optind < ac){	/* From the command line */
+		for(int i = optind; i < ac; ++i){
+			if(i > optind && !sendall(fd, " ", 1))
+				exit(EXIT_FAILURE);
+			if(!sendall(fd, av[i], strlen(av[i])))
+				exit(EXIT_FAILURE);
+		}
+		if(!sendall(fd, "\n", 1))
+			exit(EXIT_FAILURE);
+	} else {	/* From stdin */
+		char buf[4096];
+		size_t r;
+
+		while((r = fread(buf, 1, sizeof(buf), stdin)))
+			if(!sendall(fd, buf, r))
+				exit(EXIT_FAILURE);
+	}
+	shutdown(fd, SHUT_WR);
+
+		/* Print the reply */
+	for(;;){
+		char buf[4096];
+		ssize_t r = read(fd, buf, sizeof(buf));
+
+		if(r == -1){
+			if(errno == EINTR)
+				continue;
+			perror("read()");
+			exit(EXIT_FAILURE);
+		} else if(!r)
+			break;
+
+		fwrite(buf, 1, r, stdout);
+	}
+
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
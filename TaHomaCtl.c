@@ -9,8 +9,11 @@
 #include "TaHomaCtl.h"
 
 #include <unistd.h>	/* getopt() */
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include <pwd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -36,8 +39,7 @@ bool debug = false;
 
 static const char *ascript = NULL;	/* User script to launch (from launch parameters) */
 static bool nostartup = false;	/* Do not source .tahomactl */
-
-struct Device *dev;	/* Device currently considered */
+static bool daemonmode = false;	/* Serve commands through a socket */
 
 static const char *affval(const char *v){
 	if(v)
@@ -104,22 +106,35 @@ static void func_save(const char *arg){
 		return;
 	}
 
-	if(tahoma)
-		fprintf(f, "TaHoma_host %s\n", tahoma);
+	struct Gateway *cur = gateway;
+	for(struct Gateway *gw = gateways; gw; gw = gw->next){
+		switchGateway(gw);
+		if(gateways->next)
+			fprintf(f, "use_gateway %s\n", gw->name);
+
+		if(tahoma)
+			fprintf(f, "TaHoma_host %s\n", tahoma);
 
-	if(ip)
-		fprintf(f, "TaHoma_address %s\n", ip);
+		if(ip)
+			fprintf(f, "TaHoma_address %s\n", ip);
 
-	if(port)
-		fprintf(f, "TaHoma_port %u\n", port);
+		if(port)
+			fprintf(f, "TaHoma_port %u\n", port);
+
+		if(token)
+			fprintf(f, "token %s\n", token);
+	}
+	switchGateway(cur);
 
-	if(token)
-		fprintf(f, "token %s\n", token);
+	if(gateways->next)	/* Back to the current one */
+		fprintf(f, "use_gateway %s\n", cur->name);
 
 	fclose(f);
 }
 
 static void func_status(const char *){
+	if(gateways->next)
+		printf("*I* Gateway : %s\n", gateway->name);
 	printf("*I* Connection :\n"
 		"\tTahoma's host : %s\n"
 		"\tTahoma's IP : %s\n"
@@ -134,20 +149,36 @@ static void func_status(const char *){
 	);
 	if(timeout)
 		printf("\tTimeout : %lds\n", timeout);
+	printf("\tConcurrent requests : %u\n", max_inflight);
+	printf("\tStates' TTL : %us%s\n", states_ttl, listening ? " (kept up to date by events)" : "");
+	if(coalesce_window)
+		printf("\tCoalescing window : %ums\n", coalesce_window);
+	breakerReport();
+	rateReport();
+	heartbeatReport();
+	watcherReport();
+	printf("\tJSON backend : %s", JSONBackendName());
+	if(json_backend == JSONB_INDEX && json_simd)
+		printf(" (%s)", json_simd);
+	putchar('\n');
 
 	unsigned int nbre = 0;
 	for(struct Device *dev = devices_list; dev; dev = dev->next)
 		++nbre;
 
 	printf("*I* %u Stored device%c\n", nbre, nbre > 1 ? 's':' ');
+	printf("*I* Devices' cache : %s\n", affval(devices_cache));
+	func_discache(NULL);
+	tlsReport();
+	reportMemory();
 }
 
 static void device_info(struct Device *dev){
 	puts("\tCommands");
-	for(struct Command *cmd = dev->commands; cmd; cmd = cmd->next)
+	for(struct Command *cmd = dev->commands; cmd < dev->commands + dev->ncommands; ++cmd)
 		printf("\t\t%s (%d %s)\n", cmd->command, cmd->nparams, cmd->nparams > 1 ? "args": "arg");
 	puts("\tStates");
-	for(struct State *state = dev->states; state; state = state->next)
+	for(struct State *state = dev->states; state < dev->states + dev->nstates; ++state)
 		printf("\t\t%s\n", state->state);
 }
 
@@ -163,7 +194,7 @@ static void func_Devs(const char *arg){
 		const char *unused;
 
 		extractTokenSub(&devname, arg, &unused);
-		dev = findDevice(&devname);
+		struct Device *dev = findDevice(&devname);
 		if(dev){
 			printf("%s : %s\n", dev->label, dev->url);
 			device_info(dev);
@@ -223,12 +254,152 @@ static void func_timeout(const char *arg){
 		fputs("timeout is execting the number of seconds to wait.\n", stderr);
 }
 
+static void func_maxreq(const char *arg){
+	if(arg){
+		int v = atoi(arg);
+		if(v < 1){
+			fputs("*E* max_requests expects a positive number.\n", stderr);
+			return;
+		}
+		max_inflight = v;
+	} else
+		printf("*I* Concurrent requests : %u\n", max_inflight);
+}
+
+static void func_retries(const char *arg){
+	if(arg){
+		int v = atoi(arg);
+		if(v < 0){
+			fputs("*E* retries can't be negative.\n", stderr);
+			return;
+		}
+		max_retries = v;
+	} else
+		printf("*I* Failed requests are retried %u time%s\n", max_retries, max_retries > 1 ? "s":"");
+}
+
+static void func_breaker(const char *arg){
+	if(!arg){
+		if(breaker_threshold)
+			printf("*I* Circuit breaker opens after %u failures, for %us\n", breaker_threshold, breaker_cooldown);
+		else
+			puts("*I* Circuit breaker disabled");
+	} else if(!strcmp(arg, "reset"))
+		breakerReset();
+	else {
+		char *next;
+		long threshold = strtol(arg, &next, 10);
+		if(threshold < 0){
+			fputs("*E* circuit_breaker expects a positive number of failures.\n", stderr);
+			return;
+		}
+		breaker_threshold = threshold;
+		if(*next){
+			int v = atoi(next);
+			if(v < 1){
+				fputs("*E* circuit_breaker expects a positive cooldown.\n", stderr);
+				return;
+			}
+			breaker_cooldown = v;
+		}
+	}
+}
+
+static void func_ratelimit(const char *arg){
+	if(!arg){
+		if(rate_limit)
+			printf("*I* Requests limited to %g tokens/s, burst of %u\n", rate_limit, rate_burst);
+		else
+			puts("*I* Requests are not limited");
+	} else if(!strcmp(arg, "off"))
+		rate_limit = 0;
+	else {
+		char *next;
+		double v = strtod(arg, &next);
+		if(v < 0){
+			fputs("*E* rate_limit expects a positive rate.\n", stderr);
+			return;
+		}
+		if(*next){
+			int b = atoi(next);
+			if(b < 1){
+				fputs("*E* rate_limit expects a positive burst.\n", stderr);
+				return;
+			}
+			rate_burst = b;
+		}
+		rate_limit = v;
+	}
+}
+
+static void func_rateweight(const char *arg){
+	struct substring cls;
+	const char *next;
+
+	if(!arg || !extractTokenSub(&cls, arg, &next) || !*next){
+		fputs("*E* rate_weight expects an endpoint class and its weight.\n", stderr);
+		return;
+	}
+
+	char name[cls.len + 1];
+	sprintf(name, "%.*s", (int)cls.len, cls.s);
+
+	double w = atof(next);
+	if(w < 0 || !setRateWeight(name, w))
+		fputs("*E* Unknown endpoint class (discovery, states, exec, events or other) or invalid weight.\n", stderr);
+}
+
+static void func_evperiod(const char *arg){
+	if(arg){
+		int v = atoi(arg);
+		if(v < 1){
+			fputs("*E* events_period expects a positive number of seconds.\n", stderr);
+			return;
+		}
+		events_period = v;
+	} else
+		printf("*I* Events fetched every %us\n", events_period);
+}
+
+static void func_statesttl(const char *arg){
+	if(arg)
+		states_ttl = atoi(arg);
+	else
+		printf("*I* States' values are fresh for %us\n", states_ttl);
+}
+
+static void func_coalesce(const char *arg){
+	if(arg){
+		int v = atoi(arg);
+		if(v < 0){
+			fputs("*E* coalesce_window expects a delay of at least 0ms.\n", stderr);
+			return;
+		}
+		coalesce_window = v;
+	} else if(coalesce_window)
+		printf("*I* Commands are coalesced during %ums (daemon mode)\n", coalesce_window);
+	else
+		puts("*I* Commands are not coalesced");
+}
+
+static void func_jsonbackend(const char *arg){
+	if(!arg)
+		printf("*I* JSON backend : %s\n", JSONBackendName());
+	else if(!setJSONBackend(arg))
+		fputs("*E* json_backend accepts only 'json-c' and 'index'\n", stderr);
+}
+
 static void func_quit(const char *){
+	if(daemon_serving){	/* Only ends the client's session */
+		daemon_closing = true;
+		return;
+	}
+
 	exit(EXIT_SUCCESS);
 }
 
-static char *state_generator(const char *, int);
-static char *action_generator(const char *, int);
+static char **state_completion(struct Device *, const char *);
+static char **action_completion(struct Device *, const char *);
 
 struct _commands {
 	const char *name;		/* Command's name */
@@ -240,16 +411,34 @@ struct _commands {
 		 *	The second one is linked with the device's content.
 		 */
 	const bool devarg;		/* 1st argument is a device (enable autocompletion) */
-	char *(*autofunc)(const char *, int);	/* Function to be used as 2nd argument completion */
+	char **(*autofunc)(struct Device *, const char *);	/* Function to be used as 2nd argument completion */
 } Commands[] = {
 	{ NULL, NULL, "TaHoma's Configuration", false, NULL},
+	{ "use_gateway", func_gateway, "[name] select (creating it if needed) the gateway to work with, or list them", false, NULL},
 	{ "TaHoma_host", func_THost, "[name] set or display TaHoma's host", false, NULL},
 	{ "TaHoma_address", func_TAddr, "[ip] set or display TaHoma's ip address", false, NULL},
 	{ "TaHoma_port", func_TPort, "[num] set or display TaHoma's port number", false, NULL},
 	{ "TaHoma_token", func_token, "[value] indicate application token", false, NULL},
 	{ "timeout", func_timeout, "[value] specify API call timeout (seconds)", false, NULL},
+	{ "max_requests", func_maxreq, "[value] set or display the maximum number of concurrent requests", false, NULL},
+	{ "retries", func_retries, "[value] set or display how many times a failed request is retried", false, NULL},
+	{ "circuit_breaker", func_breaker, "[failures [cooldown]|reset] fail fast for cooldown seconds after consecutive failures (0 to disable)", false, NULL},
+	{ "rate_limit", func_ratelimit, "[tokens/s [burst]|off] limit requests sent to the TaHoma", false, NULL},
+	{ "rate_weight", func_rateweight, "<class> <tokens> set the cost of discovery, states, exec, events or other requests", false, NULL},
+	{ "events_period", func_evperiod, "[value] set or display the delay b/w events fetches (seconds)", false, NULL},
+	{ "states_ttl", func_statesttl, "[value] how long known states' values are trusted (seconds, 0 : only if kept up to date by events)", false, NULL},
+	{ "coalesce_window", func_coalesce, "[ms] merge commands received during this delay in a single execution (daemon mode, 0 to disable)", false, NULL},
+	{ "keep_warm", func_keepwarm, "[seconds|off] keep the connection warm, probing at most every given seconds when idle", false, NULL},
+	{ "json_backend", func_jsonbackend, "[json-c|index] set or display the JSON parser to use", false, NULL},
 	{ "scan_TaHoma", func_scan, "Look for Tahoma's ZeroConf advertising", false, NULL},
+	{ "scan_Gateways", func_scanall, "[seconds] list every advertised gateway, waiting at most the given delay", false, NULL},
+	{ "watch_TaHoma", func_watch, "[on|off] follow TaHoma's advertisements in background, applying address changes", false, NULL},
+	{ "probe_TaHoma", func_probe, "[address[:port]] [seconds] actively query TaHoma through mDNS (no avahi-daemon needed)", false, NULL},
 	{ "scan_Devices", func_scandevs, "Query and store attached devices", false, NULL},
+	{ "devices_cache", func_devcache, "[file|off|drop|load] set devices' cache file, disable, invalidate or load it", false, NULL},
+	{ "discovery_cache", func_discache, "[file|off|drop] set discovered endpoint's cache file, disable or invalidate it", false, NULL},
+	{ "discovery_ttl", func_disttl, "[value] how long a cached endpoint is trusted (seconds, 0 : forever)", false, NULL},
+	{ "tls_cache", func_tlscache, "[file|off|drop] set TLS sessions' cache file, disable or invalidate it", false, NULL},
 	{ "status", func_status, "Display current connection informations", false, NULL},
 
 	{ NULL, NULL, "Scripting", false, NULL},
@@ -263,8 +452,16 @@ struct _commands {
 	{ NULL, NULL, "Interacting", false, NULL},
 	{ "Gateway", func_Tgw, "Query your gateway own configuration", false, NULL},
 	{ "Device", func_Devs, "[name] display device \"name\" information or the devices list", true, NULL },
-	{ "States", func_States, "<device name> [state name] query the states of a device", true, state_generator },
-	{ "Command", func_Command, "<device name> <command name> <argument> send a command to a device", true, action_generator },
+	{ "States", func_States, "<device name|pattern> [state name] query the states of a device", true, state_completion },
+	{ "LiveStates", func_LiveStates, "<device name|pattern> [state name] query the states of a device, bypassing known values", true, state_completion },
+	{ "Command", func_Command, "<device name> <command name> [arguments] send a command to a device", true, action_completion },
+	{ "Batch_Add", func_BatchAdd, "<device name> <command name> [arguments] add a command to the batch", true, action_completion },
+	{ "Batch_List", func_BatchList, "List batched commands", false, NULL },
+	{ "Batch_Clear", func_BatchClear, "Forget batched commands", false, NULL },
+	{ "Batch_Run", func_BatchRun, "[label] send batched commands in a single execution", false, NULL },
+	{ "Listen", func_Listen, "[on|off|] fetch gateway's events in background", false, NULL },
+	{ "Events", func_Events, "Fetch and display gateway's events", false, NULL },
+	{ "Query", func_Query, "<endpoint> [path] extract values from any API's response", false, NULL },
 
 	{ NULL, NULL, "Miscs", false, NULL},
 	{ "#", NULL, "Comment, ignored line", false, NULL},
@@ -311,14 +508,16 @@ static void exec(struct substring *cmd, const char *arg){
 		printf("*E* Unknown command \"%.*s\" : type '?' for list of known directives\n", cmd->len, cmd->s);
 }
 
-static void execline(char *l){
+void execline(char *l){
 	struct substring cmd;
 	const char *arg;
 
+	gatewayRestore();	/* In case a completion selected another gateway */
 	if(extractTokenSub(&cmd, l, &arg))
 		exec(&cmd, *arg ? arg:NULL );
 	else	/* No argument */
 		exec(&cmd, NULL);
+	gatewayRestore();	/* "gateway/label" only applies to this command */
 }
 
 static void execscript(const char *name, bool dontfail){
@@ -326,7 +525,10 @@ static void execscript(const char *name, bool dontfail){
 	if(!f){
 		if(dontfail)
 			return;
-		else {
+		else if(daemon_serving){	/* A client's mistake doesn't stop the daemon */
+			fprintf(stderr, "*E* Can't open '%s' : %s\n", name, strerror(errno));
+			return;
+		} else {
 			perror(name);
 			exit(EXIT_FAILURE);
 		}
@@ -334,7 +536,7 @@ static void execscript(const char *name, bool dontfail){
 
 	char *l = NULL;
 	size_t len = 0;
-	while(getline(&l, &len, f) != -1){
+	while(!daemon_closing && getline(&l, &len, f) != -1){
 		char *c = strchr(l, '\n');	// Remove leading CR
 		if(c)
 			*c = 0;
@@ -347,91 +549,53 @@ static void execscript(const char *name, bool dontfail){
 	fclose(f);
 }
 
-static char *command_generator(const char *text, int state){
-    static int list_index, len;
-    const char *name;
-
-    if(!state){
-        list_index = 0;
-        len = strlen(text);
-    }
-
-    // Iterate through the command_table for names
-	while(Commands[list_index].help){
-        ++list_index;
-    	if((name = Commands[list_index].name)){
-	        if(!strncmp(name, text, len))
-    	        return(strdup(name));
-	    }
-	}
-
-    return((char *)NULL);
+	/* Completion
+	 * Notez-bien : candidates are taken from arrays sorted by name
+	 * (see completeFrom()).
+	 */
+static int cmpname(const void *a, const void *b){
+	return strcmp(*(const char **)a, *(const char **)b);
 }
 
-static char *dev_generator(const char *text, int state){
-	static struct Device *dev;
-	static int len;
-
-	if(!state){
-		dev = devices_list;
-		len = strlen(text);
-	}
+static char **command_names_completion(const char *text){
+	static const char **names = NULL;	/* Sorted commands' name */
+	static size_t nnames = 0;
 
-	while(dev){
-		struct Device *cur = dev;
-		dev = dev->next;
+	if(!names){	/* Built at first use */
+		size_t nbre = sizeof(Commands)/sizeof(Commands[0]);
+		assert( (names = malloc(nbre * sizeof(const char *))) );
 
-		if(!strncmp(cur->label, text, len))
-			return(strdup(cur->label));
+		for(size_t i = 0; i < nbre; ++i)
+			if(Commands[i].name)
+				names[nnames++] = Commands[i].name;
+		qsort(names, nnames, sizeof(const char *), cmpname);
 	}
 
-    return((char *)NULL);
+	return completeFrom(names, nnames, sizeof(const char *), text);
 }
 
-static char *state_generator(const char *text, int state){
-	static struct State *st;
-	static int len;
+static char **dev_completion(const char *text){
+	size_t nbre;
+	const char **labels = devicesLabels(&nbre);
 
-	if(!state){
-		st = dev->states;
-		len = strlen(text);
-	}
-
-	while(st){
-		struct State *cur = st;
-		st = st->next;
+	if(!labels)	/* No devices */
+		return((char **)NULL);
 
-		if(!strncmp(cur->state, text, len))
-			return(strdup(cur->state));
-	}
-	
-    return((char *)NULL);
+	return completeFrom(labels, nbre, sizeof(const char *), text);
 }
 
-static char *action_generator(const char *text, int state){
-	static struct Command *com;
-	static int len;
-
-	if(!state){
-		com = dev->commands;
-		len = strlen(text);
-	}
-
-	while(com){
-		struct Command *cur = com;
-		com = com->next;
+static char **state_completion(struct Device *dev, const char *text){
+	return completeFrom(dev->states, dev->nstates, sizeof(struct State), text);
+}
 
-		if(!strncmp(cur->command, text, len))
-			return(strdup(cur->command));
-	}
-	
-    return((char *)NULL);
+static char **action_completion(struct Device *dev, const char *text){
+	return completeFrom(dev->commands, dev->ncommands, sizeof(struct Command), text);
 }
 
 char **command_completion(const char *text, int start, int end){
 	rl_attempted_completion_over = 1;
 	if(!start)	/* At command level */
-        return rl_completion_matches(text, command_generator);
+        return command_names_completion(text);
 
 		/* Find out the command we're working on */
 	struct substring cmd;
@@ -462,20 +626,41 @@ char **command_completion(const char *text, int start, int end){
 		}
 
 		if(argnum == 1)
-			return rl_completion_matches(text, dev_generator);
+			return dev_completion(text);
 		else if(c->autofunc){
 			struct substring devname;
 			const char *unused;
 
 			extractTokenSub(&devname, arg, &unused);
-			dev = findDevice(&devname);
-			return rl_completion_matches(text, c->autofunc);
+			struct Device *dev = findDevice(&devname);
+			gatewayRestore();	/* The device's data stay valid */
+			if(dev)
+				return c->autofunc(dev, text);
 		}
 	}
 
     return((char **)NULL);
 }
 
+	/* ***
+	 * Background tasks
+	 * ***/
+
+bool backgroundTasks(void){
+	bool busy = watcher_tick();	/* 1st : requests have to target the right address */
+	busy |= forEachGateway(events_tick);	/* Each gateway has its own listener */
+	busy |= coalesce_tick();
+	busy |= forEachGateway(heartbeat_tick);	/* Keeps each connection warm */
+
+	pumpAPIAsync(false);
+	return busy || pendingAPIAsync();
+}
+
+static int rl_background(void){
+	backgroundTasks();
+	return 0;
+}
+
 	/* ***
 	 * Here we go
 	 * ***/
@@ -483,7 +668,7 @@ char **command_completion(const char *text, int start, int end){
 int main(int ac, char **av){
 	int opt;
 
-	while( (opt = getopt(ac, av, ":+NhH:p:Uk:f:dvt46")) != -1){
+	while( (opt = getopt(ac, av, ":+NhH:p:Uk:f:DS:dvt46")) != -1){
 		switch(opt){
 		case 'f':
 			ascript = optarg;
@@ -491,6 +676,12 @@ int main(int ac, char **av){
 		case 'N':
 			nostartup = true;
 			break;
+		case 'D':
+			daemonmode = true;
+			break;
+		case 'S':
+			daemon_socket = optarg;
+			break;
 		case '4':
 			avahiIP = AVAHI_PROTO_INET;
 			break;
@@ -526,6 +717,9 @@ int main(int ac, char **av){
 				"\nScripting :\n"
 				"\t-f : source provided script\n"
 				"\t-N : don't execute ~/.tahomactl at startup\n"
+				"\nDaemon mode :\n"
+				"\t-D : serve commands through a local socket (see TaHomaCmd)\n"
+				"\t-S : set daemon's socket path\n"
 				"\nTaHoma's :\n"
 				"\t-H : set TaHoma's hostname\n"
 				"\t-p : set TaHoma's port\n"
@@ -552,28 +746,43 @@ int main(int ac, char **av){
 		exit(EXIT_FAILURE);
 	}
 
-	if(unsafe){
-		if(debug || verbose)
-			puts("*W* SSL chaine not enforced (unsafe mode)");
-
-		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);	/* Don't verify SSL */
-		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-	}
-
-	if(!nostartup){
-			/* Read startup (configuration ?) file */
-		struct passwd *pw = getpwuid(getuid());	/* Find user's info */
-		if(!pw)
-			fputs("*E* Can't read user's info\n", stderr);
-		else {
-			char t[strlen(pw->pw_dir) + 12];	/* "/.tahomactl" */
+	if(unsafe && (debug || verbose))
+		puts("*W* SSL chaine not enforced (unsafe mode)");
+
+	struct passwd *pw = getpwuid(getuid());	/* Find user's info */
+	if(!pw)
+		fputs("*E* Can't read user's info\n", stderr);
+	else {
+		char t[strlen(pw->pw_dir) + 22];	/* "/.tahomactl.discovery" */
+
+			/* Default caches */
+		sprintf(t, "%s/.tahomactl.devices", pw->pw_dir);
+		FreeAndSet(&devices_cache, t);
+		sprintf(t, "%s/.tahomactl.tls", pw->pw_dir);
+		FreeAndSet(&tls_cache, t);
+		sprintf(t, "%s/.tahomactl.discovery", pw->pw_dir);
+		FreeAndSet(&discovery_cache, t);
+
+		if(!nostartup){
+				/* Read startup (configuration ?) file */
 			sprintf(t, "%s/.tahomactl", pw->pw_dir);
 			execscript(t, true);
 		}
 	}
-	
+
+	checkDiscovery();	/* The TaHoma may have moved */
+
+	if(!devices_list)	/* Avoid scan_Devices if possible */
+		loadDevicesCache();
+
+	if(daemonmode){
+		daemon_loop();
+		exit(EXIT_SUCCESS);
+	}
+
 		/* Command line handling */
 	rl_attempted_completion_function = command_completion;
+	rl_event_hook = rl_background;
 	for(;;){
 		char *l = readline(isatty(STDIN_FILENO) ? "TaHomaCtl > ":NULL);
 		
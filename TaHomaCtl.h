@@ -39,21 +39,91 @@ struct substring {
 
 extern bool extractTokenSub(struct substring *, const char *, const char**);
 extern int substringcmp(struct substring *, const char *);
+extern size_t namesFrom(const void *array, size_t nbre, size_t stride, const char *prefix, size_t len);	/* Index of the 1st name >= prefix in a sorted array */
+extern char **completeFrom(const void *array, size_t nbre, size_t stride, const char *prefix);	/* Readline's matches from a sorted array */
 
 	/* Utilities */
 extern const char *FreeAndSet(char **storage, const char *val);	/* Update a storage with a new value */
 extern void spent(bool);	/* Time spent. Caution, not reentrant */
 extern char *dynstringAdd(char *s, char *add);	/* Add 'add' string to s */
 extern char *dynstringAddSub(char *s, struct substring *add);
+extern unsigned long nowms(void);	/* Monotonic clock (ms) */
+#define SWAP(a, b) do { __typeof__(a) swap_tmp = (a); (a) = (b); (b) = swap_tmp; } while(0)
+
+	/* Arena allocator */
+struct ArenaChunk;
+struct Arena {
+	struct ArenaChunk *chunks;
+	size_t allocated;		/* Chunks' size */
+	size_t used;			/* Allocated objects' size */
+
+	const char **interned;	/* Interned strings (hash table) */
+	size_t isize;			/* Table's size */
+	size_t icount;			/* Number of interned strings */
+};
+
+extern void *arenaAlloc(struct Arena *, size_t);
+extern char *arenaStrdup(struct Arena *, const char *);
+extern const char *arenaIntern(struct Arena *, const char *);	/* Store each distinct string once */
+extern void arenaReset(struct Arena *);	/* Release all objects */
 
 	/* Configuration related */
 extern void clean(char **);		/* Safe free() an object */
 extern void func_scan(const char *);
+extern void func_scanall(const char *);	/* Every advertised gateway, within a deadline */
+
+	/* Avahi watcher : follows TaHoma's address changes in background */
+extern bool watcher_tick(void);
+extern void watcherReport(void);
+void func_watch(const char *);
 
-	/* Response handling */
+	/* Discovery cache */
+extern char *discovery_cache;	/* Cache file, NULL if disabled */
+extern unsigned int discovery_ttl;	/* How long a cached endpoint is trusted (seconds, 0 : forever) */
+extern void saveDiscovery(void);
+extern void checkDiscovery(void);	/* Check the known endpoint, look for the TaHoma if it moved */
+void func_discache(const char *);
+void func_disttl(const char *);
+extern void func_probe(const char *);	/* Active mDNS query, without avahi-daemon */
+
+	/* Commands interpreter */
+extern void execline(char *);
+
+	/* Background tasks
+	 * Called while waiting for user's input (interactive and daemon modes).
+	 * <- true if it needs to be called again soon
+	 */
+extern bool backgroundTasks(void);
+
+	/* Keep warm heartbeat (one per gateway) */
+struct Heartbeat {
+	unsigned int interval;	/* Current interval (seconds), 0 : not started */
+	bool inflight;			/* A probe is running */
+	unsigned long nprobes, nfailed;
+	double last_rtt, srtt, jitter;	/* Round trip times (ms) */
+};
+
+extern unsigned int keepwarm_max;	/* Longest interval b/w probes (seconds), 0 : disabled */
+extern bool heartbeat_tick(void);
+extern void heartbeatReport(void);
+void func_keepwarm(const char *);
+
+	/* Daemon mode */
+extern const char *daemon_socket;	/* Socket's path (default one if NULL) */
+extern bool daemon_serving;	/* stdout and stderr are redirected to a client */
+extern bool daemon_closing;	/* The client asked to end its session (Quit) */
+extern void daemon_loop(void);
+
+	/* Response handling
+	 * Notez-bien : responses are stored in buffers owned by the easy handles
+	 * and are valid until the handle's next request. freeResponse() only
+	 * forgets them.
+	 */
 struct ResponseBuffer {
     char *memory;
     size_t size;
+    size_t capacity;		/* Allocated size, 0 if borrowed */
+    unsigned int reallocs;	/* (re)allocations needed by this response */
 };
 
 void freeResponse(struct ResponseBuffer *);
@@ -62,26 +132,244 @@ void freeResponse(struct ResponseBuffer *);
 extern CURL *curl;
 extern void curl_cleanup(void);
 extern void buildURL(void);
-extern void callAPI(const char *, struct ResponseBuffer *);
+extern long callAPI(const char *, struct ResponseBuffer *);	/* GET, returns HTTP code */
+extern long postAPI(const char *, const char *data, struct ResponseBuffer *);	/* POST data */
+extern unsigned long api_activity;	/* Last request's completion (ms) */
+
+	/* Retry policy and circuit breaker */
+extern unsigned int max_retries;	/* Retries of a failed request */
+extern unsigned int breaker_threshold;	/* Consecutive failures opening the breaker, 0 : disabled */
+extern unsigned int breaker_cooldown;	/* How long it stays open (seconds) */
+extern void breakerReport(void);
+extern void breakerReset(void);
+
+	/* Rate limiter */
+extern double rate_limit;		/* Tokens per second, 0 : unlimited */
+extern unsigned int rate_burst;	/* Bucket's capacity */
+extern bool setRateWeight(const char *, double);	/* <- false if the endpoint class is unknown */
+extern void rateReport(void);
+
+	/* TLS sessions' cache */
+extern char *tls_cache;	/* Cache file, NULL if disabled */
+extern void loadTLSSessions(CURL *);	/* Import sessions (only once) */
+extern void saveTLSSessions(CURL *);
+extern void tlsHandshakeDone(CURL *);	/* Measure the handshake of a finished transfer */
+extern void tlsReport(void);
+void func_tlscache(const char *);
+
+	/* Asynchronous API calling */
+struct APIHandle;
+struct APIRequest {
+	struct APIRequest *next;	/* Internal : pending queue */
+	struct APIHandle *handle;	/* Internal : easy handle while running */
+	unsigned long queued;		/* Internal : waiting for the rate limiter since (ms) */
+	unsigned int generation;	/* Internal : endpoint it has been sent to */
+	struct Gateway *gateway;	/* Internal : context it has been issued in */
+	bool trial;					/* Internal : trial of a half-open circuit breaker */
+	unsigned int attempts;		/* Internal : retries done */
+	unsigned long retry_at;		/* Internal : not relaunched before (ms) */
+
+	char *api;					/* API to call */
+	char *post;					/* POST data, NULL for GET */
+	void (*func)(struct APIRequest *);	/* Completion callback */
+	void *data;					/* Callback's private data */
+
+		/* Result */
+	CURLcode res;				/* libcurl's result */
+	long http_code;				/* HTTP return code */
+	double elapsed;				/* Request duration (seconds) */
+	struct ResponseBuffer buff;	/* Response (valid only during the callback) */
+};
+
+extern unsigned int endpoint_generation;	/* Incremented each time TaHoma's address changes */
+extern unsigned int max_inflight;	/* Maximum number of concurrent requests */
+extern bool callAPIAsync(const char *api, const char *post, void (*func)(struct APIRequest *), void *data);
+extern void pumpAPIAsync(bool wait);	/* Process requests (until all are done if wait) */
+extern unsigned int pendingAPIAsync(void);	/* Number of queued or running requests */
+
+	/* Streaming JSON decoder
+	 * Callbacks return false to stop the decoding. The current key
+	 * (empty inside arrays) is in key.
+	 */
+enum JSONType { JSON_STRING, JSON_NUMBER, JSON_TRUE, JSON_FALSE, JSON_NULL, JSON_OBJECT, JSON_ARRAY };
+
+struct JSONStream {
+	bool (*begin)(struct JSONStream *, bool array);	/* Container's start */
+	bool (*end)(struct JSONStream *, bool array);	/* Container's end */
+	bool (*scalar)(struct JSONStream *, enum JSONType, const char *val, size_t len);
+	void *data;					/* Callbacks' private data */
+
+	char key[64];				/* Current key (truncated) */
+	unsigned int depth;			/* Containers' nesting */
+	bool done;					/* A complete value has been decoded */
+	bool stopped;				/* Stopped by a callback */
+	bool error;					/* Invalid JSON */
+
+		/* Internal */
+	int state;
+	uint64_t arrays;			/* Bit n : level n is an array */
+	bool expectkey;
+	char *tok;					/* Current token */
+	size_t toklen, tokcap;
+	unsigned int uni, unilen;	/* \u escape */
+	size_t offset;				/* Bytes consumed */
+};
+
+extern void jsonInit(struct JSONStream *,
+	bool (*begin)(struct JSONStream *, bool),
+	bool (*end)(struct JSONStream *, bool),
+	bool (*scalar)(struct JSONStream *, enum JSONType, const char *, size_t),
+	void *data
+);
+extern void jsonFree(struct JSONStream *);	/* Release the token buffer */
+extern bool jsonFeed(struct JSONStream *, const char *, size_t);	/* <- false if stopped or invalid */
+extern bool jsonEnd(struct JSONStream *);	/* <- true if a complete value has been decoded or stopped */
+extern long streamAPI(const char *, struct JSONStream *);	/* GET, the response is fed to the decoder */
+
+	/* JSON helpers
+	 * Documents are parsed either by json-c or by the structural index
+	 * (JSONIndex.c), according to json_backend. Values are opaque : they
+	 * have to be accessed only through these helpers.
+	 */
+struct json_object;
+#define OBJPATH(...) (const char*[]){ __VA_ARGS__ }
+
+enum JSONBackend { JSONB_JSONC = 0, JSONB_INDEX };
+extern enum JSONBackend json_backend;
+extern bool setJSONBackend(const char *);	/* <- false if unknown or documents are in use */
+extern const char *JSONBackendName(void);
+
+extern struct json_object *parseJSON(const char *);	/* NULL if invalid */
+extern void releaseJSON(struct json_object *);
+extern bool isArrayObj(struct json_object *);
+extern size_t arrayLengthObj(struct json_object *);
+extern struct json_object *arrayGetObj(struct json_object *, size_t);
+extern enum JSONType typeObj(struct json_object *);
+extern bool memberObj(struct json_object *, const char *key, struct json_object **val);	/* <- false if not found */
+extern bool forEachMember(struct json_object *, bool (*func)(const char *key, struct json_object *, void *), void *data);	/* <- false if stopped by func */
+extern const char *objString(struct json_object *);	/* NULL if not a string */
+extern double objNumber(struct json_object *);
+
+extern struct json_object *getObj(struct json_object *parent, const char *path[]);
+extern const char *getObjString(struct json_object *parent, const char *path[]);
+extern int getObjInt(struct json_object *parent, const char *path[]);
+extern double getObjNumber(struct json_object *parent, const char *path[]);
+extern bool getObjBool(struct json_object *parent, const char *path[]);
+
+	/* Structural index backend */
+extern const char *json_simd;	/* SIMD flavour used (NULL until the first parsing) */
+extern struct json_object *jindexParse(const char *, size_t);
+extern void jindexRelease(struct json_object *);
+extern enum JSONType jindexType(struct json_object *);
+extern struct json_object *jindexGet(struct json_object *, const char *key);
+extern bool jindexForEach(struct json_object *, bool (*)(const char *, struct json_object *, void *), void *);
+extern size_t jindexLength(struct json_object *);
+extern struct json_object *jindexIdx(struct json_object *, size_t);
+extern const char *jindexString(struct json_object *);
+extern bool jindexIsInteger(struct json_object *);
+extern double jindexNumber(struct json_object *);
+
+	/* States' value */
+struct StateValue {
+	int type;	/* Overkiz's type : 1 integer, 2 float, 3 string, 6 boolean, 10 array, 11 object */
+	union {
+		double number;
+		const char *string;
+		bool boolean;
+	};
+};
+
+extern bool decodeStateValue(struct json_object *, struct StateValue *);
+extern void printStateValue(const struct StateValue *);
 
 	/* Response processing */
 void func_Tgw(const char *);
 void func_scandevs(const char *);
 void func_States(const char *);
+void func_LiveStates(const char *);
+
+	/* JSON queries */
+void func_Query(const char *);
+
+	/* Commands' execution */
+struct Action {
+	struct Action *next;
+	char *label;		/* Device's label */
+	char *url;			/* Device's URL */
+	char *command;
+	char *params;		/* JSON parameters' list (without brackets) */
+};
+
+extern struct Action *parseAction(const char *);	/* "<device> <command> [args]", NULL on error */
+extern void freeActions(struct Action *);
+extern char *execPayload(struct Action *, const char *label);	/* exec/apply's JSON */
+extern char *execApply(struct Action *, const char *label);	/* <- execId (to be freed), NULL on error */
+
+	/* Commands' coalescing (daemon mode) */
+extern unsigned int coalesce_window;	/* Delay (ms), 0 to disable */
+extern bool coalesce_tick(void);	/* Submit held commands if the window is over, <- true if some are held */
+extern long coalesce_remaining(void);	/* Remaining time (ms) before submission, -1 if none held */
+extern void coalesce_flush(void);	/* Submit held commands now */
+
 void func_Command(const char *);
+void func_BatchAdd(const char *);
+void func_BatchList(const char *);
+void func_BatchClear(const char *);
+void func_BatchRun(const char *);
+
+	/* Gateway's events */
+enum EventType {
+	EVT_UNKNOWN = 0,
+	EVT_DEVICESTATECHANGED,
+	EVT_DEVICEAVAILABLE,
+	EVT_DEVICEUNAVAILABLE,
+	EVT_DEVICECREATED,
+	EVT_DEVICEREMOVED,
+	EVT_EXECUTIONREGISTERED,
+	EVT_EXECUTIONSTATECHANGED,
+	EVT_COMMANDEXECUTIONSTATECHANGED,
+	EVT_GATEWAYALIVE,
+	EVT_GATEWAYDOWN
+};
+
+struct EventState {
+	const char *name;
+	struct StateValue value;
+};
+
+struct Event {	/* Notez-bien : only valid during the event's processing */
+	enum EventType type;
+	const char *name;		/* Event's name as provided by the TaHoma */
+
+	const char *deviceURL;	/* Device related events */
+	const char *execId;		/* Execution related events */
+	const char *oldState;	/* Execution's state changes */
+	const char *newState;
+	const char *gatewayId;	/* Gateway related events */
+
+	size_t nstates;			/* DeviceStateChangedEvent's states */
+	struct EventState *states;
+};
+
+extern bool listening;			/* Fetching events in background */
+extern unsigned int events_period;	/* Delay b/w fetches (seconds) */
+
+extern bool events_tick(void);
+extern bool events_cover(unsigned long);	/* Are events keeping up to date values got at this time ? */
+void func_Listen(const char *);
+void func_Events(const char *);
 
 	/* Devices' */
+	/* Notez-bien : commands and states are stored in arrays sorted by name */
 struct Command {
-	struct Command *next;
-
-	const char *command;
+	const char *command;	/* Has to be the 1st field */
 	unsigned int nparams;
 };
 
 struct State {
-	struct State *next;
-
-	const char *state;
+	const char *state;		/* Has to be the 1st field */
+	struct StateValue value;	/* Last known value */
+	unsigned long updated;		/* When it has been received (ms), 0 if unknown */
 };
 
 extern struct Device {
@@ -89,10 +377,102 @@ extern struct Device {
 
 	const char *label;
 	const char *url;
+	const char *escurl;		/* URL escaped, to be used in API's path */
 
 	struct Command *commands;
+	unsigned int ncommands;
 	struct State *states;
+	unsigned int nstates;
 } *devices_list;
 
+extern struct Arena devices_arena;	/* Devices' data */
+extern void freeDeviceList(void);
+extern void reportMemory(void);
+extern void setDeviceURL(struct Device *, const char *);
+
+extern int cmpCommand(const void *, const void *);
+extern int cmpState(const void *, const void *);
+extern struct Command *deviceCommand(struct Device *, struct substring *);	/* NULL if not supported */
+extern struct State *deviceState(struct Device *, struct substring *);
+extern size_t commandsFrom(struct Device *, const char *prefix, size_t len);	/* Index of the 1st command >= prefix */
+extern size_t statesFrom(struct Device *, const char *prefix, size_t len);
+
+	/* Devices' index */
+extern void indexDevices(void);	/* (re)build the index from devices_list */
+extern void dropDevicesIndex(void);
 extern struct Device *findDevice(struct substring *);
+extern struct Device *findDeviceByURL(const char *);
+extern const char **devicesLabels(size_t *nbre);	/* Sorted labels */
+
+	/* Devices' cache */
+extern char *devices_cache;	/* Cache file, NULL if disabled */
+extern void saveDevicesCache(void);
+extern bool loadDevicesCache(void);
+extern void releaseDevicesCache(void);
+void func_devcache(const char *);
+
+	/* States' mirror */
+extern unsigned int states_ttl;	/* How long a value is considered as fresh (seconds) */
+extern void updateState(struct Device *, const char *name, const struct StateValue *);
+	/* Multiple gateways
+	 * Each gateway is a context owning its connection, devices and
+	 * events' listener. The current one lives in modules' globals :
+	 * switching exchanges them with the stored ones (which are empty for
+	 * the current gateway).
+	 */
+struct Gateway {
+	struct Gateway *next;
+	const char *name;
+	unsigned int moved;		/* endpoint_generation of its last address change */
+
+		/* Exchanged with the globals */
+	char *tahoma, *ip, *token, *url;
+	uint16_t port;
+	size_t url_len;
+
+	struct curl_slist *resolve_list, *headers;	/* APIrequest.c */
+	int breaker;
+	bool trial_inflight;
+	unsigned int failures;
+	unsigned long opened, paused_until, activity;
+
+	struct Heartbeat heartbeat;	/* Heartbeat.c */
+
+	struct Device *devices_list;	/* APIprocess.c */
+	struct Arena devices_arena;
+
+	struct Device **bylabel, **byurl;	/* DevicesIndex.c */
+	size_t mask;
+	const char **labels;
+	size_t nlabels;
+
+	char *devices_cache;	/* DevicesCache.c */
+	void *map;
+	size_t mapsize;
+
+	bool listening;			/* Events.c */
+	char *listener;
+	bool ev_inflight;
+	unsigned long lastfetch, nevents, registered, lastsuccess;
+
+	char *discovery_cache;	/* DiscoveryCache.c */
+};
+
+extern struct Gateway *gateways;	/* Known gateways */
+extern struct Gateway *gateway;		/* Current one */
+extern void switchGateway(struct Gateway *);
+extern void selectGateway(struct Gateway *);	/* Only until the end of the current command */
+extern void gatewayRestore(void);	/* Back to the gateway selected before the command */
+extern bool forEachGateway(bool (*func)(void));	/* Call func in each gateway's context, <- ORed results */
+extern struct Gateway *gatewayByHost(const char *);
+extern struct Device *findGatewayDevice(struct substring *);	/* "gateway/label", switching to its gateway */
+void func_gateway(const char *);
+
+extern void connectionExchange(struct Gateway *);
+extern void heartbeatExchange(struct Gateway *);
+extern void devicesExchange(struct Gateway *);
+extern void indexExchange(struct Gateway *);
+extern void devcacheExchange(struct Gateway *);
+extern void eventsExchange(struct Gateway *);
+extern void discoveryExchange(struct Gateway *);
 #endif
@@ -0,0 +1,138 @@
+/*
+ * Benchmark of devices' labels completion against the number of devices.
+ *
+ * N synthetic labels (Room_Kind_Number, as after scan_Devices) are sorted
+ * as the devices' index does, then a set of prefixes is completed :
+ *	- namesFrom() : lookup of the 1st candidate only,
+ *	- completeFrom() : full readline's matches list (as a TAB does),
+ *	- linear : the former generators' full strncmp() scan, only counting
+ *	matches, for reference.
+ * The latency per TAB is the mean over the given number of runs.
+ *
+ * Usage : bench_completion [runs]	(default : 10000)
+ *
+ *	GPLv3
+ *
+ * Compiling : gcc -O2 -I.. bench_completion.c ../Utilities.c -o bench_completion
+ */
+
+#include "TaHomaCtl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+bool debug = false;	/* Needed by Utilities.c */
+
+static const char *rooms[] = { "Salon", "Sejour", "Cuisine", "Chambre", "Chambre_Amis", "Bureau", "Garage", "Grenier", "Cave", "Jardin", "Terrasse", "Entree" };
+static const char *kinds[] = { "Volet", "Lumiere", "Prise", "Store", "Capteur", "Thermostat", "Porte" };
+
+static const char *prefixes[] = {
+	"",				/* Everything */
+	"C",			/* Cave, Chambre*, Cuisine */
+	"Chambre_",
+	"Chambre_Volet_",
+	"Salon_Volet_1",
+	"Zzz",			/* No match */
+	NULL
+};
+
+static const unsigned int sizes[] = { 100, 600, 5000, 0 };
+
+static int cmplabel(const void *a, const void *b){
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static const char **buildLabels(unsigned int n){
+	const char **labels = malloc(n * sizeof(const char *));
+	if(!labels){
+		fputs("*F* Out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	for(unsigned int i = 0; i < n; ++i){
+		char t[64];
+		sprintf(t, "%s_%s_%u",
+			rooms[i % (sizeof(rooms)/sizeof(*rooms))],
+			kinds[(i / (sizeof(rooms)/sizeof(*rooms))) % (sizeof(kinds)/sizeof(*kinds))],
+			i
+		);
+		if(!(labels[i] = strdup(t))){
+			fputs("*F* Out of memory\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	qsort(labels, n, sizeof(const char *), cmplabel);
+	return labels;
+}
+
+static size_t linear(const char **labels, size_t n, const char *text){
+	/* Former generator : every label is compared */
+	size_t len = strlen(text), nbre = 0;
+
+	for(size_t i = 0; i < n; ++i)
+		if(!strncmp(labels[i], text, len))
+			++nbre;
+
+	return nbre;
+}
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int ac, char **av){
+	unsigned int runs = ac > 1 ? atoi(av[1]) : 10000;
+	volatile size_t sink = 0;	/* Avoid the calls to be optimised out */
+
+	if(!runs)
+		runs = 1;
+
+	printf("%6s  %-16s %7s  %12s  %14s  %12s\n", "labels", "prefix", "matches", "namesFrom", "completeFrom", "linear");
+
+	for(const unsigned int *n = sizes; *n; ++n){
+		const char **labels = buildLabels(*n);
+
+		for(const char **p = prefixes; *p; ++p){
+			size_t len = strlen(*p), nmatches = 0;
+
+			double beg = now();
+			for(unsigned int r = 0; r < runs; ++r)
+				sink += namesFrom(labels, *n, sizeof(const char *), *p, len);
+			double lookup = (now() - beg) / runs;
+
+			beg = now();
+			for(unsigned int r = 0; r < runs; ++r){
+				char **matches = completeFrom(labels, *n, sizeof(const char *), *p);
+				if(matches){
+					size_t i;
+					for(i = 0; matches[i]; ++i)
+						free(matches[i]);
+					free(matches);
+					nmatches = i > 1 ? i - 1 : i;	/* The 1st one is the common prefix */
+				} else
+					nmatches = 0;
+			}
+			double complete = (now() - beg) / runs;
+
+			beg = now();
+			for(unsigned int r = 0; r < runs; ++r)
+				sink += linear(labels, *n, *p);
+			double scan = (now() - beg) / runs;
+
+			char name[20];
+			snprintf(name, sizeof(name), "\"%s\"", *p);
+			printf("%6u  %-16s %7lu  %10.3fus  %12.3fus  %10.3fus\n", *n, name, nmatches, lookup * 1e6, complete * 1e6, scan * 1e6);
+		}
+
+		for(unsigned int i = 0; i < *n; ++i)
+			free((char *)labels[i]);
+		free(labels);
+	}
+
+	exit(EXIT_SUCCESS);
+}
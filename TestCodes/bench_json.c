@@ -0,0 +1,305 @@
+/*
+ * Benchmark of the JSON backends (json_backend) on a synthetic
+ * setup/devices response.
+ *
+ * A fixture of N devices (with their commands, states definition and
+ * current states, as the TaHoma sends them) is generated, then parsed
+ * by json-c (json_tokener_parse) and by the structural index
+ * (JSONIndex.c). Each run is end to end : parsing, walking every device
+ * as scan_Devices does, then releasing the document. The best run
+ * is reported.
+ *
+ * Usage : bench_json [-d] [devices [runs]]
+ *	-d : dump the fixture on stdout instead of benchmarking
+ *	(default : 600 devices, 20 runs)
+ *
+ *	GPLv3
+ *
+ * Compiling : gcc -O2 -I.. bench_json.c ../JSONIndex.c -o bench_json -ljson-c
+ */
+
+#include "TaHomaCtl.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <json-c/json.h>
+
+	/* ***
+	 * Fixture
+	 * ***/
+
+static const char *models[][2] = {	/* controllableName, uiClass */
+	{ "io:RollerShutterGenericIOComponent", "RollerShutter" },
+	{ "io:OnOffIOComponent", "OnOff" },
+	{ "io:DimmableLightIOComponent", "Light" },
+	{ "io:SomfyContactIOSystemSensor", "ContactSensor" }
+};
+
+static const char *commands[] = { "open", "close", "stop", "setClosure", "my", "identify", "wink", "getName", "refreshMemorized1Position", "setName" };
+static const char *states[] = { "core:StatusState", "core:ClosureState", "core:OpenClosedState", "core:NameState", "core:PriorityLockTimerState", "core:DiscreteRSSILevelState", "core:RSSILevelState" };
+
+#define NCMDS (sizeof(commands)/sizeof(*commands))
+#define NSTATES (sizeof(states)/sizeof(*states))
+
+static char *fixture;
+static size_t flen, fcap;
+
+static void add(const char *fmt, ...){
+	va_list ap;
+
+	for(;;){
+		va_start(ap, fmt);
+		int n = vsnprintf(fixture + flen, fcap - flen, fmt, ap);
+		va_end(ap);
+
+		if(n >= 0 && (size_t)n < fcap - flen){
+			flen += n;
+			return;
+		}
+
+		fcap = fcap ? fcap * 2 : 64*1024;
+		if(!(fixture = realloc(fixture, fcap))){
+			fputs("*F* Out of memory\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void generate(unsigned int ndevices){
+	add("[");
+	for(unsigned int i = 0; i < ndevices; ++i){
+		unsigned int m = i % (sizeof(models)/sizeof(*models));
+
+		add("%s{\"creationTime\":1700000000000,\"lastUpdateTime\":1700000000000,"
+			"\"label\":\"%s %u\",\"deviceURL\":\"io://1234-5678-9012/%u\","
+			"\"shortcut\":false,\"controllableName\":\"%s\",\"definition\":{\"commands\":[",
+			i ? "," : "", models[m][1], i, 1000000 + i, models[m][0]
+		);
+		for(unsigned int c = 0; c < NCMDS; ++c)
+			add("%s{\"commandName\":\"%s\",\"nparams\":%u}", c ? "," : "", commands[c], c % 3);
+
+		add("],\"states\":[");
+		for(unsigned int s = 0; s < NSTATES; ++s)
+			add("%s{\"type\":\"DiscreteState\",\"values\":[\"available\",\"unavailable\"],\"name\":\"%s\"}", s ? "," : "", states[s]);
+
+		add("],\"dataProperties\":[{\"value\":\"500\",\"qualifiedName\":\"core:identifyInterval\"}],"
+			"\"widgetName\":\"%s\",\"uiProfiles\":[\"Specific\"],\"uiClass\":\"%s\","
+			"\"qualifiedName\":\"%s\",\"type\":\"ACTUATOR\"},\"states\":[",
+			models[m][1], models[m][1], models[m][0]
+		);
+		for(unsigned int s = 0; s < NSTATES; ++s){
+			if(s % 2)
+				add("%s{\"name\":\"%s\",\"type\":1,\"value\":%u}", s ? "," : "", states[s], (i * 7 + s) % 100);
+			else
+				add("%s{\"name\":\"%s\",\"type\":3,\"value\":\"Label \\\"%u\\\" \\u00e9t\\u00e9\"}", s ? "," : "", states[s], i);
+		}
+
+		add("],\"available\":true,\"enabled\":true,\"placeOID\":\"%08x-ac10-3e01-6ff0-c8d2f9e1a7c0\","
+			"\"type\":1,\"oid\":\"%08x-1c21-4f0e-a1b2-0242ac120002\",\"uiClass\":\"%s\"}",
+			i * 31, i, models[m][1]
+		);
+	}
+	add("]");
+}
+
+	/* ***
+	 * Devices' walk, as scan_Devices does
+	 * Returns a checksum, so nothing is optimized out.
+	 * ***/
+
+static size_t walkJSONC(struct json_object *root){
+	size_t sum = 0;
+	struct json_object *obj, *lst;
+
+	for(size_t i = 0; i < json_object_array_length(root); ++i){
+		struct json_object *dev = json_object_array_get_idx(root, i);
+
+		if(json_object_object_get_ex(dev, "label", &obj))
+			sum += strlen(json_object_get_string(obj));
+		if(json_object_object_get_ex(dev, "deviceURL", &obj))
+			sum += strlen(json_object_get_string(obj));
+
+		struct json_object *def;
+		if(!json_object_object_get_ex(dev, "definition", &def))
+			continue;
+
+		if(json_object_object_get_ex(def, "commands", &lst))
+			for(size_t j = 0; j < json_object_array_length(lst); ++j){
+				struct json_object *cmd = json_object_array_get_idx(lst, j);
+				if(json_object_object_get_ex(cmd, "commandName", &obj))
+					sum += strlen(json_object_get_string(obj));
+				if(json_object_object_get_ex(cmd, "nparams", &obj))
+					sum += json_object_get_int(obj);
+			}
+
+		if(json_object_object_get_ex(def, "states", &lst))
+			for(size_t j = 0; j < json_object_array_length(lst); ++j)
+				if(json_object_object_get_ex(json_object_array_get_idx(lst, j), "name", &obj))
+					sum += strlen(json_object_get_string(obj));
+
+		if(json_object_object_get_ex(dev, "states", &lst))
+			for(size_t j = 0; j < json_object_array_length(lst); ++j){
+				struct json_object *st = json_object_array_get_idx(lst, j);
+				if(json_object_object_get_ex(st, "name", &obj))
+					sum += strlen(json_object_get_string(obj));
+				if(json_object_object_get_ex(st, "value", &obj)){
+					if(json_object_is_type(obj, json_type_string))
+						sum += strlen(json_object_get_string(obj));
+					else
+						sum += (size_t)json_object_get_double(obj);
+				}
+			}
+	}
+
+	return sum;
+}
+
+static size_t walkIndex(struct json_object *root){
+	size_t sum = 0;
+	struct json_object *obj, *lst;
+
+	for(size_t i = 0; i < jindexLength(root); ++i){
+		struct json_object *dev = jindexIdx(root, i);
+
+		if((obj = jindexGet(dev, "label")))
+			sum += strlen(jindexString(obj));
+		if((obj = jindexGet(dev, "deviceURL")))
+			sum += strlen(jindexString(obj));
+
+		struct json_object *def = jindexGet(dev, "definition");
+		if(!def)
+			continue;
+
+		if((lst = jindexGet(def, "commands")))
+			for(size_t j = 0; j < jindexLength(lst); ++j){
+				struct json_object *cmd = jindexIdx(lst, j);
+				if((obj = jindexGet(cmd, "commandName")))
+					sum += strlen(jindexString(obj));
+				if((obj = jindexGet(cmd, "nparams")))
+					sum += (size_t)jindexNumber(obj);
+			}
+
+		if((lst = jindexGet(def, "states")))
+			for(size_t j = 0; j < jindexLength(lst); ++j)
+				if((obj = jindexGet(jindexIdx(lst, j), "name")))
+					sum += strlen(jindexString(obj));
+
+		if((lst = jindexGet(dev, "states")))
+			for(size_t j = 0; j < jindexLength(lst); ++j){
+				struct json_object *st = jindexIdx(lst, j);
+				if((obj = jindexGet(st, "name")))
+					sum += strlen(jindexString(obj));
+				if((obj = jindexGet(st, "value"))){
+					if(jindexType(obj) == JSON_STRING)
+						sum += strlen(jindexString(obj));
+					else
+						sum += (size_t)jindexNumber(obj);
+				}
+			}
+	}
+
+	return sum;
+}
+
+	/* ***
+	 * Benchmark
+	 * ***/
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Result {
+	double parse;	/* Best parsing time (s) */
+	double total;	/* Best end to end time (s) */
+	size_t sum;
+};
+
+static struct Result bench(bool index, unsigned int runs){
+	struct Result r = { 1e9, 1e9, 0 };
+
+	for(unsigned int i = 0; i < runs; ++i){
+		double beg = now();
+		struct json_object *root = index ? jindexParse(fixture, flen) : json_tokener_parse(fixture);
+		double parsed = now();
+
+		if(!root){
+			fprintf(stderr, "*F* %s failed to parse the fixture\n", index ? "index" : "json-c");
+			exit(EXIT_FAILURE);
+		}
+
+		r.sum = index ? walkIndex(root) : walkJSONC(root);
+		if(index)
+			jindexRelease(root);
+		else
+			json_object_put(root);
+		double end = now();
+
+		if(parsed - beg < r.parse)
+			r.parse = parsed - beg;
+		if(end - beg < r.total)
+			r.total = end - beg;
+	}
+
+	return r;
+}
+
+static void report(const char *name, struct Result *r){
+	printf("%-16s parse %8.3fms (%7.1f MB/s)   end to end %8.3fms (%7.1f MB/s)\n",
+		name,
+		r->parse * 1e3, flen / r->parse / 1e6,
+		r->total * 1e3, flen / r->total / 1e6
+	);
+}
+
+int main(int ac, char **av){
+	bool dump = false;
+	unsigned int ndevices = 600, runs = 20;
+	int opt;
+
+	while((opt = getopt(ac, av, "d")) != -1){
+		if(opt == 'd')
+			dump = true;
+		else {
+			fprintf(stderr, "Usage : %s [-d] [devices [runs]]\n", av[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind < ac)
+		ndevices = atoi(av[optind++]);
+	if(optind < ac)
+		runs = atoi(av[optind]);
+	if(!runs)
+		runs = 1;
+
+	generate(ndevices);
+
+	if(dump){
+		fwrite(fixture, 1, flen, stdout);
+		putchar('\n');
+		exit(EXIT_SUCCESS);
+	}
+
+	printf("Fixture : %u devices, %lu bytes, best of %u runs\n", ndevices, flen, runs);
+
+	struct Result jc = bench(false, runs);
+	report("json-c", &jc);
+
+	struct Result ji = bench(true, runs);
+	char name[32];
+	sprintf(name, "index/%s", json_simd);
+	report(name, &ji);
+
+	if(jc.sum != ji.sum)
+		fprintf(stderr, "*E* Backends disagree (checksums %lu / %lu)\n", jc.sum, ji.sum);
+
+	printf("Speedup : parse x%.1f, end to end x%.1f\n", jc.parse / ji.parse, jc.total / ji.total);
+
+	exit(EXIT_SUCCESS);
+}
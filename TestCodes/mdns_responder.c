@@ -0,0 +1,286 @@
+/*
+ * mDNS responder stand-in, to test probe_TaHoma without a TaHoma.
+ *
+ * It listens on a local UDP port and answers PTR, SRV, TXT and A questions
+ * about a fake TaHoma, with compressed names (as real responders do), to
+ * the querier's address. The first queries are dropped, so retransmissions
+ * are exercised too.
+ *
+ * Usage : mdns_responder [-l address] [-p port] [-a TaHoma's address] [-d dropped]
+ *	(default : listens on 127.0.0.1:15353, TaHoma at 192.168.0.36,
+ *	the 1st query is dropped)
+ *
+ * Then, in TaHomaCtl :
+ *	TaHomaCtl > probe_TaHoma 127.0.0.1:15353
+ *
+ *	GPLv3
+ *
+ * Compiling : gcc mdns_responder.c -o mdns_responder
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define SERVICE "_kizboxdev._tcp.local"
+#define INSTANCE "gateway-1234-5678-9abc." SERVICE
+#define HOST "gateway-1234-5678-9abc.local"
+#define TAHOMA_PORT 8443
+
+static const char *txt[] = { "gateway_pin=1234-5678-9abc", "fw_version=2025.1.4-11", "api_version=1", NULL };
+
+enum { RR_A = 1, RR_PTR = 12, RR_TXT = 16, RR_AAAA = 28, RR_SRV = 33 };
+#define CLASS_IN 1
+#define CACHE_FLUSH 0x8000	/* Unique records (answers) */
+#define TTL 120
+
+	/* ***
+	 * Names' compression : every name written in the response is
+	 * remembered with its offset, so its suffixes are pointed to.
+	 * ***/
+
+#define MAXNAMES 64
+
+static struct {
+	char name[256];		/* Fully qualified, from this label */
+	uint16_t offset;
+} known[MAXNAMES];
+static unsigned int nknown;
+
+static void remember(const char *name, size_t offset){
+	if(nknown < MAXNAMES && offset < 0x3fff){
+		strcpy(known[nknown].name, name);
+		known[nknown++].offset = offset;
+	}
+}
+
+static size_t putName(uint8_t *msg, size_t l, const char *name){
+	/* Write name at l, compressed as much as possible
+	 * <- new length
+	 */
+	while(*name){
+		for(unsigned int i = 0; i < nknown; ++i)
+			if(!strcasecmp(known[i].name, name)){	/* Already written : pointer */
+				msg[l++] = 0xc0 | (known[i].offset >> 8);
+				msg[l++] = known[i].offset & 0xff;
+				return l;
+			}
+
+		remember(name, l);
+
+		const char *dot = strchr(name, '.');
+		size_t len = dot ? (size_t)(dot - name) : strlen(name);
+		msg[l++] = len;
+		memcpy(msg + l, name, len);
+		l += len;
+		name += len + (dot ? 1 : 0);
+	}
+	msg[l++] = 0;
+
+	return l;
+}
+
+static size_t putU16(uint8_t *msg, size_t l, uint16_t v){
+	msg[l++] = v >> 8;
+	msg[l++] = v & 0xff;
+	return l;
+}
+
+static size_t putRR(uint8_t *msg, size_t l, const char *owner, uint16_t type, bool unique){
+	/* Record's header, its data length is left to set
+	 * <- offset of the data length
+	 */
+	l = putName(msg, l, owner);
+	l = putU16(msg, l, type);
+	l = putU16(msg, l, CLASS_IN | (unique ? CACHE_FLUSH : 0));
+	l = putU16(msg, l, TTL >> 16);
+	l = putU16(msg, l, TTL & 0xffff);
+
+	return l;
+}
+
+static size_t endRR(uint8_t *msg, size_t rdlen_at, size_t l){
+	putU16(msg, rdlen_at, l - rdlen_at - 2);
+	return l;
+}
+
+	/* ***
+	 * Queries' handling
+	 * ***/
+
+static bool readName(const uint8_t *msg, size_t len, size_t *off, char *name){
+	/* Questions' names are expected uncompressed */
+	size_t o = *off, l = 0;
+
+	while(o < len && msg[o]){
+		uint8_t c = msg[o++];
+		if(c > 63 || o + c > len || l + c + 2 > 256)
+			return false;
+		if(l)
+			name[l++] = '.';
+		memcpy(name + l, msg + o, c);
+		l += c;
+		o += c;
+	}
+	if(o >= len)
+		return false;
+
+	name[l] = 0;
+	*off = o + 1;
+	return true;
+}
+
+static size_t answer(const uint8_t *query, size_t qlen, uint8_t *resp, struct in_addr *addr){
+	/* <- response's length, 0 if nothing to answer */
+	if(qlen < 12 || (query[2] & 0x80))	/* Not a query */
+		return 0;
+
+	unsigned int qd = (query[4] << 8) | query[5], an = 0;
+	size_t off = 12, l = 12;
+
+	nknown = 0;
+	memset(resp, 0, 12);
+	resp[2] = 0x84;		/* Response, authoritative */
+
+		/* Questions are echoed : answers point to their names */
+	for(unsigned int i = 0; i < qd; ++i){
+		char name[256];
+		if(!readName(query, qlen, &off, name) || off + 4 > qlen)
+			return 0;
+
+		l = putName(resp, l, name);
+		memcpy(resp + l, query + off, 4);
+		l += 4;
+		off += 4;
+	}
+	putU16(resp, 4, qd);
+
+	off = 12;
+	for(unsigned int i = 0; i < qd; ++i){
+		char name[256];
+		readName(query, qlen, &off, name);
+		uint16_t type = (query[off] << 8) | query[off + 1];
+		off += 4;
+
+		printf("\tQuestion : %s type %u%s\n", name, type, (query[off - 2] & 0x80) ? " (QU)" : "");
+
+		size_t rd;
+		if(type == RR_PTR && !strcasecmp(name, SERVICE)){
+			rd = putRR(resp, l, name, RR_PTR, false);
+			l = endRR(resp, rd, putName(resp, rd + 2, INSTANCE));
+		} else if(type == RR_SRV && !strcasecmp(name, INSTANCE)){
+			rd = putRR(resp, l, name, RR_SRV, true);
+			l = putU16(resp, rd + 2, 0);	/* Priority */
+			l = putU16(resp, l, 0);			/* Weight */
+			l = putU16(resp, l, TAHOMA_PORT);
+			l = endRR(resp, rd, putName(resp, l, HOST));
+		} else if(type == RR_TXT && !strcasecmp(name, INSTANCE)){
+			rd = putRR(resp, l, name, RR_TXT, true);
+			l = rd + 2;
+			for(const char **t = txt; *t; ++t){
+				resp[l++] = strlen(*t);
+				memcpy(resp + l, *t, strlen(*t));
+				l += strlen(*t);
+			}
+			l = endRR(resp, rd, l);
+		} else if(type == RR_A && !strcasecmp(name, HOST)){
+			rd = putRR(resp, l, name, RR_A, true);
+			memcpy(resp + rd + 2, addr, 4);
+			l = endRR(resp, rd, rd + 6);
+		} else
+			continue;	/* Not ours (AAAA included) */
+
+		++an;
+	}
+	putU16(resp, 6, an);
+
+	return an ? l : 0;
+}
+
+int main(int ac, char **av){
+	const char *listen_addr = "127.0.0.1";
+	uint16_t listen_port = 15353;
+	struct in_addr tahoma_addr;
+	unsigned int drop = 1, nquery = 0;
+	int opt;
+
+	inet_pton(AF_INET, "192.168.0.36", &tahoma_addr);
+	setvbuf(stdout, NULL, _IOLBF, 0);	/* Follow it live, even redirected */
+
+	while((opt = getopt(ac, av, "l:p:a:d:")) != -1){
+		switch(opt){
+		case 'l':
+			listen_addr = optarg;
+			break;
+		case 'p':
+			listen_port = atoi(optarg);
+			break;
+		case 'a':
+			if(inet_pton(AF_INET, optarg, &tahoma_addr) != 1){
+				fprintf(stderr, "*F* Invalid address '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'd':
+			drop = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage : %s [-l address] [-p port] [-a TaHoma's address] [-d dropped]\n", av[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd == -1){
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(listen_port);
+	if(inet_pton(AF_INET, listen_addr, &sa.sin_addr) != 1){
+		fprintf(stderr, "*F* Invalid address '%s'\n", listen_addr);
+		exit(EXIT_FAILURE);
+	}
+	if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1){
+		perror("bind()");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("*I* Answering on %s:%u as %s (%s:%u)\n", listen_addr, listen_port, INSTANCE, HOST, TAHOMA_PORT);
+
+	for(;;){
+		uint8_t query[9000], resp[9000];
+		struct sockaddr_in from;
+		socklen_t fromlen = sizeof(from);
+
+		ssize_t l = recvfrom(fd, query, sizeof(query), 0, (struct sockaddr *)&from, &fromlen);
+		if(l == -1){
+			perror("recvfrom()");
+			continue;
+		}
+
+		char peer[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &from.sin_addr, peer, sizeof(peer));
+		printf("*I* Query #%u from %s:%u", ++nquery, peer, ntohs(from.sin_port));
+
+		if(nquery <= drop){
+			puts(" dropped");
+			continue;
+		}
+		putchar('\n');
+
+		size_t rl = answer(query, l, resp, &tahoma_addr);
+		if(rl && sendto(fd, resp, rl, 0, (struct sockaddr *)&from, fromlen) == -1)
+			perror("sendto()");
+	}
+}
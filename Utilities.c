@@ -47,6 +47,77 @@ int substringcmp(struct substring *s, const char *with){
 	return strncmp(s->s, with, s->len);
 }
 
+static int subcmp(const char *s, size_t len, const char *name){
+	/* Lexical order b/w a substring and a name */
+	int r = strncmp(s, name, len);
+	if(r)
+		return r;
+
+	return name[len] ? -1 : 0;	/* A prefix comes first */
+}
+
+size_t namesFrom(const void *array, size_t nbre, size_t stride, const char *s, size_t len){
+	/* Index of the first element whose name is not lower than s
+	 * (array is sorted by name which is the 1st field of its elements)
+	 */
+	size_t lo = 0, hi = nbre;
+
+	while(lo < hi){
+		size_t mid = (lo + hi) / 2;
+		const char *name = *(const char **)((const char *)array + mid * stride);
+
+		if(subcmp(s, len, name) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+	/* Completion
+	 * Notez-bien : candidates are taken from arrays sorted by name : the
+	 * 1st one is found by dichotomy and matches are consecutive.
+	 * Readline's matches list is built directly, without generator.
+	 */
+char **completeFrom(const void *array, size_t nbre, size_t stride, const char *text){
+	size_t len = strlen(text);
+	size_t first = namesFrom(array, nbre, stride, text, len);
+	size_t last = first;
+
+#define NAME(i) (*(const char **)((const char *)array + (i) * stride))
+	while(last < nbre && !strncmp(NAME(last), text, len))
+		++last;
+
+	if(first == last)
+		return((char **)NULL);
+
+	char **matches = malloc((last - first + 2) * sizeof(char *));
+	assert(matches);
+
+	if(last - first == 1){	/* Single match */
+		assert( (matches[0] = strdup(NAME(first))) );
+		matches[1] = NULL;
+	} else {
+			/* 1st entry is the common prefix : as the array is sorted,
+			 * it's the one of the first and the last matches.
+			 */
+		const char *f = NAME(first), *l = NAME(last - 1);
+		size_t common = 0;
+		while(f[common] && f[common] == l[common])
+			++common;
+		assert( (matches[0] = strndup(f, common)) );
+
+		size_t i = 1;
+		for(size_t idx = first; idx < last; ++idx)
+			assert( (matches[i++] = strdup(NAME(idx))) );
+		matches[i] = NULL;
+	}
+#undef NAME
+
+	return matches;
+}
+
 	/* Storage management */
 const char *FreeAndSet(char **storage, const char *val){
 	if(*storage)
@@ -70,6 +141,13 @@ static unsigned long timespec_to_ms(const struct timespec *ts){
 	return((unsigned long)ts->tv_sec * 1000) + (ts->tv_nsec / 1000000L);
 }
 
+unsigned long nowms(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_ms(&ts);
+}
+
 void spent(bool ending){
 		/* Measure time spent b/w starting (false) and ending (true) */
 	static struct timespec beg, end;
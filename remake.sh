@@ -1,4 +1,4 @@
 #!/bin/bash
 # This script will rebuild a Makefile suitable to compile TaHomaCtl
 
-LFMakeMaker -v +f=Makefile -cc='cc -Wall -pedantic -O2' --opts='-lreadline -lhistory $(shell pkg-config --cflags --libs avahi-client libcurl json-c) -lrt' *.c -t=TaHomaCtl > Makefile
+LFMakeMaker -v +f=Makefile -cc='cc -Wall -pedantic -O2' --opts='-lreadline -lhistory $(shell pkg-config --cflags --libs avahi-client libcurl json-c) -lrt' Utilities.c TaHomaCtl.c Daemon.c Events.c Execution.c DevicesCache.c DevicesIndex.c Arena.c AvahiScaning.c APIrequest.c APIprocess.c JSONStream.c JSONIndex.c Query.c TLSCache.c Heartbeat.c MDNSQuery.c DiscoveryCache.c Gateways.c -t=TaHomaCtl TaHomaCmd.c -t=TaHomaCmd > Makefile